@@ -0,0 +1,160 @@
+#include "mingoose.h"
+#include <sys/mman.h>
+
+// Packed static asset archive, see mgpack.c for the writer.
+//
+// Layout, all integers in host byte order:
+//
+//   struct mg_archive_header
+//   uint32_t seeds[num_buckets]     displacement seed per hash bucket
+//   uint32_t slots[num_slots]       entry index per hash slot, or ~0
+//   struct mg_archive_entry entries[num_entries]
+//   paths, MIME types and file bodies, referenced by entry offsets
+//
+// A path is found by perfect hashing: its bucket gives the seed, the
+// seed gives the slot, and the slot gives the only entry that may hold it.
+
+// FNV-1a with a seed and a final avalanche, so that different seeds give
+// independent slot assignments.
+uint32_t mg_archive_hash(const char *key, size_t len, uint32_t seed) {
+    uint32_t h = 2166136261U ^ (seed * 0x9e3779b9U);
+
+    while (len-- > 0) {
+        h = (h ^ * (const unsigned char *) key++) * 16777619U;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static int is_valid_range(const struct mg_archive *arc, uint64_t offset,
+                          uint64_t len) {
+    return offset <= arc->size && len <= arc->size - offset;
+}
+
+// Make sure that every offset in the archive points inside of it, so
+// that lookups never need to check anything.
+static int is_valid_archive(const struct mg_archive *arc) {
+    const struct mg_archive_header *hdr = arc->hdr;
+    const struct mg_archive_entry *e;
+    uint32_t i;
+
+    if (memcmp(hdr->magic, MG_ARCHIVE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->byte_order != MG_ARCHIVE_BYTE_ORDER ||
+        hdr->num_buckets == 0 || hdr->num_slots < hdr->num_entries ||
+        !is_valid_range(arc, hdr->seeds_offset,
+                        (uint64_t) hdr->num_buckets * sizeof(uint32_t)) ||
+        !is_valid_range(arc, hdr->slots_offset,
+                        (uint64_t) hdr->num_slots * sizeof(uint32_t)) ||
+        !is_valid_range(arc, hdr->entries_offset,
+                        (uint64_t) hdr->num_entries * sizeof(*e)) ||
+        hdr->seeds_offset % sizeof(uint32_t) != 0 ||
+        hdr->slots_offset % sizeof(uint32_t) != 0 ||
+        hdr->entries_offset % sizeof(uint64_t) != 0) {
+        return 0;
+    }
+
+    for (i = 0; i < hdr->num_slots; i++) {
+        if (arc->slots[i] != MG_ARCHIVE_NO_ENTRY &&
+            arc->slots[i] >= hdr->num_entries) {
+            return 0;
+        }
+    }
+
+    for (i = 0; i < hdr->num_entries; i++) {
+        e = &arc->entries[i];
+        if (!is_valid_range(arc, e->path_offset, e->path_len) ||
+            !is_valid_range(arc, e->mime_offset, e->mime_len) ||
+            !is_valid_range(arc, e->data_offset, e->data_size) ||
+            !is_valid_range(arc, e->gz_offset, e->gz_size)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Map the archive into memory. Return NULL on error, errno is set.
+struct mg_archive *mg_archive_open(const char *path) {
+    struct mg_archive *arc;
+    struct stat st;
+    void *p;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return NULL;
+    } else if (fstat(fd, &st) != 0 ||
+               (arc = (struct mg_archive *) calloc(1, sizeof(*arc))) == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    arc->size = (uint64_t) st.st_size;
+    arc->dev = st.st_dev;
+    arc->ino = st.st_ino;
+    arc->mtime = st.st_mtime;
+    arc->refs = 1;
+
+    errno = EINVAL;
+    p = arc->size < sizeof(struct mg_archive_header) ? MAP_FAILED :
+        mmap(NULL, arc->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        free(arc);
+        return NULL;
+    }
+
+    arc->base = (const char *) p;
+    arc->hdr = (const struct mg_archive_header *) p;
+    arc->seeds = (const uint32_t *) (arc->base + arc->hdr->seeds_offset);
+    arc->slots = (const uint32_t *) (arc->base + arc->hdr->slots_offset);
+    arc->entries = (const struct mg_archive_entry *)
+        (arc->base + arc->hdr->entries_offset);
+
+    if (!is_valid_archive(arc)) {
+        munmap((void *) arc->base, arc->size);
+        free(arc);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Tell the kernel that the archive is going to be used. It is the
+    // document root after all.
+    (void) madvise((void *) arc->base, arc->size, MADV_WILLNEED);
+
+    return arc;
+}
+
+void mg_archive_close(struct mg_archive *arc) {
+    if (arc != NULL) {
+        munmap((void *) arc->base, arc->size);
+        free(arc);
+    }
+}
+
+// Find an entry by its URI path, e.g. "/css/main.css". Return NULL if
+// there is no such entry.
+const struct mg_archive_entry *mg_archive_find(const struct mg_archive *arc,
+                                               const char *path, size_t len) {
+    const struct mg_archive_header *hdr = arc->hdr;
+    const struct mg_archive_entry *e;
+    uint32_t seed, i;
+
+    if (hdr->num_entries == 0) {
+        return NULL;
+    }
+
+    seed = arc->seeds[mg_archive_hash(path, len, 0) % hdr->num_buckets];
+    i = arc->slots[mg_archive_hash(path, len, seed) % hdr->num_slots];
+    if (i == MG_ARCHIVE_NO_ENTRY) {
+        return NULL;
+    }
+
+    e = &arc->entries[i];
+    return e->path_len == len &&
+        memcmp(arc->base + e->path_offset, path, len) == 0 ? e : NULL;
+}
@@ -73,6 +73,8 @@ static FILE *open_auth_file(struct mg_connection *conn, const char *path) {
     fp = fopen(gpass, "r");
     // Important: using local struct file to test path for is_directory flag.
     // If filep is used, mg_stat() makes it appear as if auth file was opened.
+  } else if (path == NULL) {
+    // No filesystem to look for .htpasswd in, e.g. document_archive
   } else if (mg_stat(path, &file) && file.is_directory) {
     mg_snprintf(name, sizeof(name), "%s%c%s",
                 path, '/', PASSWORDS_FILE_NAME);
@@ -95,57 +97,77 @@ struct ah {
   char *user, *uri, *cnonce, *response, *qop, *nc, *nonce;
 };
 
-// Return 1 on success. Always initializes the ah structure.
+static int is_name(const char *name, size_t len, const char *expected) {
+  return strlen(expected) == len && !memcmp(name, expected, len);
+}
+
+// Field of the ah structure for the parameter name, or NULL.
+static char **auth_field(struct ah *ah, const char *name, size_t len) {
+  return is_name(name, len, "username") ? &ah->user :
+    is_name(name, len, "cnonce") ? &ah->cnonce :
+    is_name(name, len, "response") ? &ah->response :
+    is_name(name, len, "uri") ? &ah->uri :
+    is_name(name, len, "qop") ? &ah->qop :
+    is_name(name, len, "nc") ? &ah->nc :
+    is_name(name, len, "nonce") ? &ah->nonce : NULL;
+}
+
+// Return 1 on success. Always initializes the ah structure. The header
+// is left as it is, the values used are copied to buf.
 static int parse_auth_header(struct mg_connection *conn, char *buf,
                              size_t buf_size, struct ah *ah) {
-  char *name, *value, *s;
-  const char *auth_header;
+  const char *s, *name, *auth_header;
+  char **field, *out = buf, *end = buf + buf_size;
+  size_t name_len;
+  int quoted;
 
   (void) memset(ah, 0, sizeof(*ah));
-  if ((auth_header = mg_get_header(conn, "Authorization")) == NULL ||
+  if ((auth_header = mg_get_known_header(conn, MG_HEADER_AUTHORIZATION)) == NULL ||
       mg_strncasecmp(auth_header, "Digest ", 7) != 0) {
     return 0;
   }
 
-  // Make modifiable copy of the auth header
-  (void) mg_strlcpy(buf, auth_header + 7, buf_size);
-  s = buf;
-
   // Parse authorization header
-  for (;;) {
+  for (s = auth_header + 7;;) {
     // Gobble initial spaces
-    while (isspace(* (unsigned char *) s)) {
+    while (isspace(* (const unsigned char *) s)) {
       s++;
     }
-    name = skip_quoted(&s, "=", " ", 0);
-    // Value is either quote-delimited, or ends at first comma or space.
-    if (s[0] == '\"') {
+    name = s;
+    name_len = strcspn(s, "=");
+    if (name_len == 0) {
+      break;
+    }
+    for (s += name_len; *s == '=' || *s == ' '; s++) {
+    }
+
+    // Value is either quote-delimited, with \" for a quote, or ends at
+    // first comma or space. IE uses commas, FF uses spaces.
+    if ((field = auth_field(ah, name, name_len)) != NULL && out < end) {
+      *field = out;
+    } else {
+      field = NULL;
+    }
+    if ((quoted = *s == '\"') != 0) {
       s++;
-      value = skip_quoted(&s, "\"", " ", '\\');
-      if (s[0] == ',') {
+    }
+    for (; *s != '\0' && (quoted ? *s != '\"' : *s != ',' && *s != ' '); s++) {
+      if (quoted && s[0] == '\\' && s[1] == '\"') {
         s++;
       }
-    } else {
-      value = skip_quoted(&s, ", ", " ", 0);  // IE uses commas, FF uses spaces
+      if (field != NULL && out < end - 1) {
+        *out++ = *s;
+      }
     }
-    if (*name == '\0') {
-      break;
+    if (field != NULL) {
+      *out++ = '\0';
     }
-
-    if (!strcmp(name, "username")) {
-      ah->user = value;
-    } else if (!strcmp(name, "cnonce")) {
-      ah->cnonce = value;
-    } else if (!strcmp(name, "response")) {
-      ah->response = value;
-    } else if (!strcmp(name, "uri")) {
-      ah->uri = value;
-    } else if (!strcmp(name, "qop")) {
-      ah->qop = value;
-    } else if (!strcmp(name, "nc")) {
-      ah->nc = value;
-    } else if (!strcmp(name, "nonce")) {
-      ah->nonce = value;
+    if (quoted && *s == '\"') {
+      for (s++; *s == ' '; s++) {
+      }
+    }
+    if (*s == ',' || *s == ' ') {
+      s++;
     }
   }
 
@@ -175,7 +197,7 @@ static int authorize(struct mg_connection *conn, FILE *fp) {
     }
 
     if (!strcmp(ah.user, f_user) &&
-        !strcmp(conn->ctx->config[op("authentication_domain")], f_domain))
+        !strcmp(conn->cfg->authentication_domain, f_domain))
       return check_password(conn->request_info.request_method, ha1, ah.uri,
                             ah.nonce, ah.nc, ah.cnonce, ah.qop, ah.response);
   }
@@ -186,16 +208,15 @@ static int authorize(struct mg_connection *conn, FILE *fp) {
 // Return 1 if request is authorised, 0 otherwise.
 int check_authorization(struct mg_connection *conn, const char *path) {
   char fname[PATH_MAX];
-  struct vec uri_vec, filename_vec;
-  const char *list;
+  const struct config_pair *pair;
   FILE *fp = NULL;
-  int authorized = 1;
+  int i, authorized = 1;
 
-  list = conn->ctx->config[op("protect_uri")];
-  while ((list = next_vector_eq(list, &uri_vec, &filename_vec)) != NULL) {
-    if (!memcmp(conn->request_info.uri, uri_vec.ptr, uri_vec.len)) {
+  for (i = 0; i < conn->cfg->num_protect_uri; i++) {
+    pair = &conn->cfg->protect_uri[i];
+    if (!memcmp(conn->request_info.uri, pair->name.ptr, pair->name.len)) {
       mg_snprintf(fname, sizeof(fname), "%.*s",
-                  (int) filename_vec.len, filename_vec.ptr);
+                  (int) pair->value.len, pair->value.ptr);
       fp = fopen(fname, "r");
       break;
     }
@@ -214,7 +235,7 @@ int check_authorization(struct mg_connection *conn, const char *path) {
 }
 
 int is_authorized_for_put(struct mg_connection *conn) {
-    const char *passfile = conn->ctx->config[op("put_delete_auth_file")];
+    const char *passfile = conn->cfg->put_delete_auth_file;
   FILE *fp;
   int ret = 0;
 
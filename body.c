@@ -0,0 +1,312 @@
+#include "mingoose.h"
+
+// Request body reading.
+//
+// mg_read() returns the body of the current request, whether it comes
+// with a Content-Length or as "Transfer-Encoding: chunked". Bytes that
+// arrived with the headers are taken from the receive buffer first,
+// the rest is read from the socket straight into the caller's buffer.
+//
+// Chunked bodies are decoded as they are read: chunk data goes to the
+// caller, only chunk size lines and trailers are read into the receive
+// buffer, after what is left of the request there. Memory is bounded
+// by the receive buffer whatever the size of the body. Bytes read past
+// the last chunk are kept, they are the next pipelined request.
+//
+// PUT bodies of known length go from the socket to the file with
+// splice() through a pipe, never entering user space.
+//
+// Receive buffer after the headers:
+//
+//  conn->buf + request_len
+//    |<-body_consumed->|<------- not decoded yet ------->|
+//    |     taken       |                  conn->buf + data_len
+
+#define MAX_CHUNK_SIZE_DIGITS 15
+#if !defined(SPLICE_PIPE_SIZE)
+#define SPLICE_PIPE_SIZE (1024 * 1024)  // Bytes moved per splice() call
+#endif
+
+// Start of the bytes not decoded yet, and how many of them are buffered.
+static char *raw_start(const struct mg_connection *conn, int *len) {
+    int off = conn->request_len + conn->body_consumed;
+
+    *len = conn->data_len - off;
+    return conn->buf + off;
+}
+
+// Take up to len bytes from the buffer, or read them from the socket if
+// there are none. Return number of bytes, 0 if the client closed the
+// connection, negative on error.
+static int read_raw(struct mg_connection *conn, char *buf, int len) {
+    int buffered;
+    const char *p = raw_start(conn, &buffered);
+
+    if (buffered > 0) {
+        if (len > buffered) {
+            len = buffered;
+        }
+        memcpy(buf, p, len);
+        conn->body_consumed += len;
+        return len;
+    }
+    return pull(NULL, conn, buf, len);
+}
+
+// Make a line available at the start of the bytes not decoded yet,
+// reading more if needed. Return its length including the line break,
+// or -1 if the client went away or the line does not fit the buffer.
+static int read_line(struct mg_connection *conn, const char **line) {
+    const char *p, *eol;
+    int buffered, n;
+
+    for (;;) {
+        p = raw_start(conn, &buffered);
+        if (buffered > 0 &&
+            (eol = (const char *) memchr(p, '\n', buffered)) != NULL) {
+            *line = p;
+            return (int) (eol - p) + 1;
+        }
+
+        // Drop what has been taken to make room
+        if (conn->body_consumed > 0) {
+            memmove(conn->buf + conn->request_len,
+                    conn->buf + conn->request_len + conn->body_consumed,
+                    conn->data_len - conn->request_len - conn->body_consumed);
+            conn->data_len -= conn->body_consumed;
+            conn->body_consumed = 0;
+        }
+
+        // After pipelined requests, the buffer may start near its end:
+        // move the request down, its strings are copied out of it
+        if (conn->data_len >= conn->buf_size && conn->buf != conn->buf_base) {
+            memmove(conn->buf_base, conn->buf, conn->data_len);
+            conn->buf_size += (int) (conn->buf - conn->buf_base);
+            conn->buf = conn->buf_base;
+        }
+        if (conn->data_len >= conn->buf_size ||
+            (n = pull(NULL, conn, conn->buf + conn->data_len,
+                      conn->buf_size - conn->data_len)) <= 0) {
+            return -1;
+        }
+        conn->data_len += n;
+    }
+}
+
+// Parse "<hex size>[;extensions]\r\n". Return -1 if malformed.
+static int64_t parse_chunk_size(const char *line, int len) {
+    int64_t size = 0;
+    int i, c;
+
+    for (i = 0; i < len && isxdigit(c = ((const unsigned char *) line)[i]);
+         i++) {
+        if (i >= MAX_CHUNK_SIZE_DIGITS) {
+            return -1;
+        }
+        size = size * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+    }
+    while (i < len && (line[i] == ' ' || line[i] == '\t')) {
+        i++;
+    }
+
+    return i == 0 || (line[i] != ';' && line[i] != '\r' && line[i] != '\n') ?
+        -1 : size;
+}
+
+static int is_empty_line(const char *line, int len) {
+    return len == 1 || (len == 2 && line[0] == '\r');
+}
+
+// Decode next piece of a chunked body.
+static int read_chunked(struct mg_connection *conn, char *buf, int len) {
+    const char *line;
+    int n;
+
+    for (;;) {
+        switch (conn->chunk_state) {
+            case CHUNK_DATA:
+                if ((int64_t) len > conn->chunk_left) {
+                    len = (int) conn->chunk_left;
+                }
+                if ((n = read_raw(conn, buf, len)) <= 0) {
+                    return -1;
+                }
+                if ((conn->chunk_left -= n) == 0) {
+                    conn->chunk_state = CHUNK_DATA_END;
+                }
+                return n;
+            case CHUNKS_DONE:
+                return 0;
+            default:
+                break;
+        }
+
+        // Other states expect a line
+        if ((n = read_line(conn, &line)) < 0) {
+            return -1;
+        }
+        conn->body_consumed += n;
+        if (conn->chunk_state == CHUNK_SIZE) {
+            if ((conn->chunk_left = parse_chunk_size(line, n)) < 0) {
+                return -1;
+            }
+            conn->chunk_state = conn->chunk_left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+        } else if (conn->chunk_state == CHUNK_DATA_END) {
+            if (!is_empty_line(line, n)) {
+                return -1;
+            }
+            conn->chunk_state = CHUNK_SIZE;
+        } else if (is_empty_line(line, n)) {
+            // Trailer headers are ignored
+            conn->chunk_state = CHUNKS_DONE;
+        }
+    }
+}
+
+// Answer "Expect: 100-continue" before the body is read. Return 0 after
+// answering 417 if the expectation is another one.
+int body_expect(struct mg_connection *conn) {
+    const char *expect = mg_get_known_header(conn, MG_HEADER_EXPECT);
+
+    if (expect == NULL) {
+        return 1;
+    } else if (mg_strcasecmp(expect, "100-continue")) {
+        response_error(conn, 417, "Expectation Failed", "%s", "");
+        return 0;
+    }
+    (void) mg_printf(conn, "%s", "HTTP/1.1 100 Continue\r\n\r\n");
+    return 1;
+}
+
+// Read up to len bytes of the request body. Return number of bytes read,
+// 0 at the end of the body, or -1 if the client went away or sent a
+// malformed body, after what the connection is closed.
+int mg_read(struct mg_connection *conn, void *buf, int len) {
+    int64_t left;
+    int n;
+
+    if (len <= 0) {
+        return 0;
+    } else if (conn->chunk_state != 0) {
+        n = read_chunked(conn, (char *) buf, len);
+    } else if ((left = conn->content_len - conn->body_read) <= 0) {
+        return 0;
+    } else {
+        n = read_raw(conn, (char *) buf, left < len ? (int) left : len);
+        // Without Content-Length, the body ends when the client closes
+        if (n == 0 && conn->content_len != INT64_MAX) {
+            n = -1;
+        }
+    }
+
+    if (n > 0) {
+        conn->body_read += n;
+    } else if (n < 0) {
+        conn->must_close = 1;
+    }
+
+    return n;
+}
+
+// Return how many buffered bytes the request and its body take, or -1
+// if the end of the body is not known yet.
+int body_buffered_len(const struct mg_connection *conn) {
+    int64_t end = conn->request_len + conn->body_consumed;
+
+    if (conn->chunk_state != 0) {
+        return conn->chunk_state == CHUNKS_DONE ? (int) end : -1;
+    }
+
+    // Body read so far is out of the buffer, the rest follows it
+    end += conn->content_len - conn->body_read;
+    return conn->content_len >= 0 && conn->request_len > 0 &&
+        end < (int64_t) conn->data_len ? (int) end : conn->data_len;
+}
+
+#if defined(SPLICE_F_MOVE) && !defined(NO_SPLICE)
+// Move whole pipe content to the file at *offset. Return 0 on error.
+static int drain_pipe(int pipe_fd, int fd, loff_t *offset, ssize_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = splice(pipe_fd, NULL, fd, offset, (size_t) len,
+                        SPLICE_F_MOVE)) < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return 0;
+        }
+        len -= n;
+    }
+
+    return 1;
+}
+#endif
+
+// Write the rest of a body of known length to the file at offset, without
+// copying it through user space. Return 1 on success, 0 on error, or -1
+// if it cannot be done for this body, socket or file, and nothing has
+// been read yet.
+int body_splice(struct mg_connection *conn, int fd, int64_t offset) {
+#if defined(SPLICE_F_MOVE) && !defined(NO_SPLICE)
+    int64_t left = conn->content_len - conn->body_read;
+    int pipe_fd[2], buffered, moved = 0, ok = 1;
+    loff_t off = (loff_t) offset;
+    ssize_t n;
+    char *p;
+
+    if (conn->ssl != NULL || conn->chunk_state != 0 ||
+        conn->content_len == INT64_MAX || fd < 0 || offset < 0 ||
+        pipe2(pipe_fd, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    (void) fcntl(pipe_fd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+
+    // Bytes that came with the headers
+    p = raw_start(conn, &buffered);
+    if (buffered > left) {
+        buffered = (int) left;
+    }
+    if (buffered > 0) {
+        ok = pwrite(fd, p, buffered, off) == buffered;
+        conn->body_consumed += buffered;
+        conn->body_read += buffered;
+        left -= buffered;
+        off += buffered;
+        moved = 1;
+    }
+
+    while (ok && left > 0 && conn->ctx->stop_flag == 0) {
+        n = splice(conn->client.sock, NULL, pipe_fd[1], NULL,
+                   left < SPLICE_PIPE_SIZE ? (size_t) left : SPLICE_PIPE_SIZE,
+                   SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && !moved && (errno == EINVAL || errno == ENOSYS)) {
+            close(pipe_fd[0]);
+            close(pipe_fd[1]);
+            return -1;
+        } else if (n <= 0) {
+            ok = 0;
+            break;
+        }
+        moved = 1;
+        conn->num_bytes_read += n;
+        conn->body_read += n;
+        left -= n;
+        ok = drain_pipe(pipe_fd[0], fd, &off, n);
+    }
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+
+    if (!ok || left > 0) {
+        conn->must_close = 1;
+        return 0;
+    }
+    return 1;
+#else
+    (void) conn;
+    (void) fd;
+    (void) offset;
+    return -1;
+#endif
+}
@@ -0,0 +1,191 @@
+#include "mingoose.h"
+
+// Configuration snapshot.
+//
+// Options that are looked at per request are compiled into a struct
+// config: flags and numbers parsed, lists split, patterns and throttle
+// rules compiled. A connection takes a reference to the current snapshot
+// when a request starts and keeps it until the request is done, so a
+// reload never changes the options under a request.
+//
+// On SIGHUP, the options are loaded again from config_file and the
+// command line, and the new snapshot replaces the current one. Readers
+// never lock: they only count themselves in config_readers while they
+// take their reference, and the reloader waits for that count to drop
+// to zero before releasing the old snapshot. Options that are only used
+// at startup, e.g. listening_ports or num_threads, need a restart.
+
+static void free_values(char **values) {
+    int i;
+
+    for (i = 0; i < NUM_OPTIONS; i++) {
+        free(values[i]);
+    }
+}
+
+static void free_config(struct config *cfg) {
+    mg_glob_free(cfg->hide_glob);
+    mg_glob_free_rules(cfg->rewrite_rules, cfg->num_rewrite_rules);
+    throttle_free(cfg->throttle);
+    free(cfg->index_files);
+    free(cfg->protect_uri);
+    free_values(cfg->values);
+    free(cfg);
+}
+
+// Split comma separated list into an array of vectors pointing into it.
+// Return 0 on OOM.
+static int split_list(const char *list, struct vec **vecs, int *num) {
+    struct vec vec;
+    const char *p;
+    int n = 0;
+
+    for (p = list; (p = next_vector(p, &vec)) != NULL; n++) {
+    }
+    if ((*vecs = (struct vec *) calloc(n + 1, sizeof(**vecs))) == NULL) {
+        return 0;
+    }
+    for (*num = 0; (list = next_vector(list, &(*vecs)[*num])) != NULL;
+         (*num)++) {
+    }
+    return 1;
+}
+
+// Same for "x=y" lists.
+static int split_pairs(const char *list, struct config_pair **pairs,
+                       int *num) {
+    struct vec a, b;
+    const char *p;
+    int n = 0;
+
+    for (p = list; (p = next_vector_eq(p, &a, &b)) != NULL; n++) {
+    }
+    if ((*pairs = (struct config_pair *) calloc(n + 1, sizeof(**pairs))) == NULL) {
+        return 0;
+    }
+    for (*num = 0; (list = next_vector_eq(list, &(*pairs)[*num].name,
+                                          &(*pairs)[*num].value)) != NULL;
+         (*num)++) {
+    }
+    return 1;
+}
+
+static int is_yes(const char *value) {
+    return value != NULL && !mg_strcasecmp(value, "yes");
+}
+
+// Compile option values, which the snapshot takes ownership of.
+// Return NULL on OOM.
+static struct config *compile_config(struct mg_context *ctx, char **values) {
+    const char *pattern = values[op("hide_files_patterns")], *fsync_policy;
+    struct config *cfg;
+    char *hide;
+    size_t len;
+    int i, ok;
+
+    if ((cfg = (struct config *) calloc(1, sizeof(*cfg))) == NULL) {
+        free_values(values);
+        return NULL;
+    }
+    cfg->refs = 1;
+    memcpy(cfg->values, values, sizeof(cfg->values));
+
+    i = op("put_delete_auth_file");
+    cfg->values[i] = get_absolute_path(cfg->values[i], ctx->argv[0]);
+    cfg->put_delete_auth_file = cfg->values[i];
+    cfg->authentication_domain = cfg->values[op("authentication_domain")];
+    cfg->enable_keep_alive = is_yes(cfg->values[op("enable_keep_alive")]);
+    cfg->enable_directory_listing =
+        is_yes(cfg->values[op("enable_directory_listing")]);
+    cfg->request_timeout_ms = cfg->values[op("request_timeout_ms")] == NULL ?
+        0 : atoi(cfg->values[op("request_timeout_ms")]);
+    fsync_policy = cfg->values[op("put_fsync")];
+    cfg->put_fsync = fsync_policy == NULL ? PUT_FSYNC_NO :
+        !strcmp(fsync_policy, "file") ? PUT_FSYNC_FILE :
+        !strcmp(fsync_policy, "dir") ? PUT_FSYNC_DIR : PUT_FSYNC_NO;
+
+    // Passwords file and PUT temporary files are always hidden
+    len = sizeof("**" PASSWORDS_FILE_NAME "$|**" PUT_TEMP_PREFIX "|") +
+        (pattern == NULL ? 0 : strlen(pattern));
+    if ((hide = (char *) malloc(len)) != NULL) {
+        mg_snprintf(hide, len,
+                    "**" PASSWORDS_FILE_NAME "$|**" PUT_TEMP_PREFIX "%s%s",
+                    pattern == NULL ? "" : "|", pattern == NULL ? "" : pattern);
+        cfg->hide_glob = mg_glob_compile(hide, (int) strlen(hide));
+        free(hide);
+    }
+
+    ok = cfg->hide_glob != NULL &&
+        split_list(cfg->values[op("index_files")], &cfg->index_files,
+                   &cfg->num_index_files) &&
+        split_pairs(cfg->values[op("protect_uri")], &cfg->protect_uri,
+                    &cfg->num_protect_uri) &&
+        mg_glob_compile_rules(cfg->values[op("url_rewrite_patterns")],
+                              &cfg->rewrite_rules, &cfg->num_rewrite_rules) &&
+        (cfg->throttle = throttle_compile(cfg->values[op("throttle")],
+                                          cfg->values[op("global_throttle")],
+                                          ctx->cfg == NULL ? NULL :
+                                          ctx->cfg->throttle)) != NULL;
+    if (!ok) {
+        free_config(cfg);
+        cfg = NULL;
+    }
+
+    return cfg;
+}
+
+// Return referenced current snapshot. Never blocks.
+struct config *config_acquire(struct mg_context *ctx) {
+    struct config *cfg;
+
+    __sync_add_and_fetch(&ctx->config_readers, 1);
+    cfg = ctx->cfg;
+    __sync_add_and_fetch(&cfg->refs, 1);
+    __sync_sub_and_fetch(&ctx->config_readers, 1);
+
+    return cfg;
+}
+
+void config_release(struct config *cfg) {
+    if (cfg != NULL && __sync_sub_and_fetch(&cfg->refs, 1) == 0) {
+        free_config(cfg);
+    }
+}
+
+// Load options and make them current. Return 0 on error, the current
+// snapshot is kept then.
+int config_load(struct mg_context *ctx) {
+    struct config *cfg, *old;
+    char *values[NUM_OPTIONS];
+
+    memset(values, 0, sizeof(values));
+    if (!load_options(ctx, values, ctx->argv)) {
+        free_values(values);
+        return 0;
+    }
+    if ((cfg = compile_config(ctx, values)) == NULL) {
+        cry(create_fake_connection(ctx), "%s", "Cannot load config: OOM");
+        return 0;
+    }
+
+    old = ctx->cfg;
+    __sync_synchronize();
+    ctx->cfg = cfg;
+    __sync_synchronize();
+
+    // A reader that saw the old snapshot has taken its reference once
+    // the count drops to zero
+    while (ctx->config_readers > 0) {
+        sched_yield();
+    }
+    config_release(old);
+
+    // Resolutions and listings depend on index files, rewrites and
+    // hide patterns
+    if (old != NULL) {
+        resolve_cache_invalidate(NULL);
+        dir_cache_invalidate(NULL);
+    }
+
+    return 1;
+}
@@ -0,0 +1,299 @@
+#include "mingoose.h"
+
+// Directory listing cache.
+//
+// A listing is a snapshot of the directory: names in one arena, metadata
+// taken with fstatat() on the directory descriptor, and a sorted order
+// per sort key, made when first asked for. Snapshots are reference
+// counted, so a listing being sent is not freed under the sender.
+//
+// A snapshot is rebuilt when the directory's mtime changes, i.e. when
+// entries are added, removed or renamed. Changes to the entries
+// themselves are reported by the watcher; without it, snapshots are
+// only trusted for DIR_CACHE_TTL seconds.
+
+#if !defined(DIR_CACHE_SIZE)
+#define DIR_CACHE_SIZE 64       // Max number of cached directories
+#endif
+#if !defined(DIR_CACHE_TTL)
+#define DIR_CACHE_TTL 1         // Seconds, when the watcher is off
+#endif
+
+static struct {
+    pthread_mutex_t mutex;      // Protects everything below, and orders
+    struct dir_listing *listings[DIR_CACHE_SIZE];
+} cache = { PTHREAD_MUTEX_INITIALIZER, { NULL } };
+
+void dir_listing_release(struct dir_listing *l) {
+    int i;
+
+    if (l != NULL && __sync_sub_and_fetch(&l->refs, 1) == 0) {
+        for (i = 0; i < DIR_SORT_ORDERS; i++) {
+            free(l->orders[i]);
+        }
+        free(l->entries);
+        free(l->names);
+        free(l->path);
+        free(l);
+    }
+}
+
+// Drop the listing of the given directory, or all if path is NULL.
+// Registered as a watcher listener.
+void dir_cache_invalidate(const char *path) {
+    size_t len = path == NULL ? 0 : strlen(path);
+    unsigned int hash;
+    int i;
+
+    while (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    hash = path == NULL ? 0 : mg_hash(path, len);
+
+    (void) pthread_mutex_lock(&cache.mutex);
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (cache.listings[i] != NULL &&
+            (path == NULL || (cache.listings[i]->hash == hash &&
+                              cache.listings[i]->path_len == len &&
+                              !memcmp(cache.listings[i]->path, path, len)))) {
+            dir_listing_release(cache.listings[i]);
+            cache.listings[i] = NULL;
+        }
+    }
+    (void) pthread_mutex_unlock(&cache.mutex);
+}
+
+static int is_same_version(const struct dir_listing *l, const struct stat *st) {
+    return l->dev == st->st_dev && l->ino == st->st_ino &&
+        l->mtime.tv_sec == st->st_mtim.tv_sec &&
+        l->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Read the directory. Return NULL on error, errno is set.
+static struct dir_listing *scan(struct mg_connection *conn, const char *dir,
+                                size_t dir_len, unsigned int hash) {
+    struct dir_listing *l;
+    struct dir_entry *entries;
+    struct dirent *dp;
+    struct stat st;
+    size_t names_size = 4096, names_len = 0, name_len;
+    int fd, size = 128;
+    DIR *dirp;
+    char *p;
+
+    if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return NULL;
+    } else if (fstat(fd, &st) != 0 || (dirp = fdopendir(fd)) == NULL) {
+        close(fd);
+        return NULL;
+    } else if ((l = (struct dir_listing *) calloc(1, sizeof(*l))) == NULL) {
+        closedir(dirp);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    l->refs = 1;
+    if ((l->path = (char *) malloc(dir_len + 1)) == NULL ||
+        (l->entries = (struct dir_entry *)
+         malloc(size * sizeof(*entries))) == NULL ||
+        (l->names = (char *) malloc(names_size)) == NULL) {
+        closedir(dirp);
+        dir_listing_release(l);
+        errno = ENOMEM;
+        return NULL;
+    }
+    l->hash = hash;
+    memcpy(l->path, dir, dir_len);
+    l->path[dir_len] = '\0';
+    l->path_len = dir_len;
+    l->dev = st.st_dev;
+    l->ino = st.st_ino;
+    l->mtime = st.st_mtim;
+    l->built = time(NULL);
+
+    while ((dp = readdir(dirp)) != NULL) {
+        // Do not show current dir and hidden files
+        if (!strcmp(dp->d_name, ".") ||
+            !strcmp(dp->d_name, "..") ||
+            must_hide_file(conn, dp->d_name)) {
+            continue;
+        }
+
+        name_len = strlen(dp->d_name) + 1;
+        if (l->num_entries >= size) {
+            if ((entries = (struct dir_entry *)
+                 realloc(l->entries, 2 * size * sizeof(*entries))) == NULL) {
+                break;
+            }
+            l->entries = entries;
+            size *= 2;
+        }
+        if (names_len + name_len > names_size) {
+            while (names_len + name_len > names_size) {
+                names_size *= 2;
+            }
+            if ((p = (char *) realloc(l->names, names_size)) == NULL) {
+                break;
+            }
+            l->names = p;
+        }
+
+        // An entry that cannot be stat()-ed is listed with zero metadata
+        memcpy(l->names + names_len, dp->d_name, name_len);
+        l->entries[l->num_entries].name_offset = names_len;
+        memset(&l->entries[l->num_entries].file, 0, sizeof(struct file));
+        if (fstatat(dirfd(dirp), dp->d_name, &st, 0) == 0) {
+            l->entries[l->num_entries].file.is_directory = S_ISDIR(st.st_mode);
+            l->entries[l->num_entries].file.size = st.st_size;
+            l->entries[l->num_entries].file.modification_time = st.st_mtime;
+        }
+        names_len += name_len;
+        l->num_entries++;
+    }
+    closedir(dirp);
+
+    return l;
+}
+
+// Return referenced listing of the directory, or NULL on error, with
+// errno set. The caller must dir_listing_release() it.
+struct dir_listing *dir_listing_get(struct mg_connection *conn,
+                                    const char *dir) {
+    struct dir_listing *l = NULL, *old;
+    struct stat st;
+    size_t len = strlen(dir);
+    unsigned int hash;
+    int i, slot = 0;
+
+    while (len > 1 && dir[len - 1] == '/') {
+        len--;
+    }
+    hash = mg_hash(dir, len);
+
+    if (stat(dir, &st) != 0) {
+        return NULL;
+    }
+
+    (void) pthread_mutex_lock(&cache.mutex);
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+        if ((old = cache.listings[i]) != NULL && old->hash == hash &&
+            old->path_len == len && !memcmp(old->path, dir, len)) {
+            if (is_same_version(old, &st) &&
+                (mg_watch_covers(old->path, len) ||
+                 time(NULL) - old->built < DIR_CACHE_TTL)) {
+                l = old;
+                __sync_add_and_fetch(&l->refs, 1);
+            }
+            break;
+        }
+    }
+    (void) pthread_mutex_unlock(&cache.mutex);
+
+    // Listings made with options a reload has replaced are not kept,
+    // hide patterns may have changed
+    if (l != NULL || (l = scan(conn, dir, len, hash)) == NULL ||
+        conn->cfg != conn->ctx->cfg) {
+        return l;
+    }
+
+    // Replace the old version, or the least recently built listing
+    (void) pthread_mutex_lock(&cache.mutex);
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+        if ((old = cache.listings[i]) == NULL ||
+            (old->hash == hash && old->path_len == len &&
+             !memcmp(old->path, dir, len))) {
+            slot = i;
+            break;
+        } else if (old->built < cache.listings[slot]->built) {
+            slot = i;
+        }
+    }
+    dir_listing_release(cache.listings[slot]);
+    cache.listings[slot] = l;
+    __sync_add_and_fetch(&l->refs, 1);
+    (void) pthread_mutex_unlock(&cache.mutex);
+
+    return l;
+}
+
+// Sort key of the listing, from the query string: n(ame), s(ize) or
+// d(ate), then a(scending) or d(escending).
+int dir_sort_order(const char *query_string) {
+    int key;
+
+    if (query_string == NULL || query_string[0] == '\0') {
+        query_string = "na";
+    }
+    key = query_string[0] == 'n' ? 0 : query_string[0] == 's' ? 1 :
+        query_string[0] == 'd' ? 2 : 3;
+
+    return key * 2 + (query_string[1] == 'd');
+}
+
+struct sort_context {
+    const struct dir_listing *l;
+    int order;
+};
+
+static int compare_dir_entries(const void *p1, const void *p2, void *arg) {
+    const struct sort_context *sc = (const struct sort_context *) arg;
+    const struct dir_entry *a = &sc->l->entries[* (const int *) p1];
+    const struct dir_entry *b = &sc->l->entries[* (const int *) p2];
+    int cmp_result = 0;
+
+    if (a->file.is_directory && !b->file.is_directory) {
+        return -1;  // Always put directories on top
+    } else if (!a->file.is_directory && b->file.is_directory) {
+        return 1;   // Always put directories on top
+    } else if (sc->order / 2 == 0) {
+        cmp_result = strcmp(sc->l->names + a->name_offset,
+                            sc->l->names + b->name_offset);
+    } else if (sc->order / 2 == 1) {
+        cmp_result = a->file.size == b->file.size ? 0 :
+            a->file.size > b->file.size ? 1 : -1;
+    } else if (sc->order / 2 == 2) {
+        cmp_result = a->file.modification_time == b->file.modification_time ? 0 :
+            a->file.modification_time > b->file.modification_time ? 1 : -1;
+    }
+
+    return sc->order % 2 ? -cmp_result : cmp_result;
+}
+
+// Return entry indices in the given sort order, see dir_sort_order().
+// Sorted once per listing and order. Return NULL on OOM.
+const int *dir_listing_order(struct dir_listing *l, int order) {
+    struct sort_context sc;
+    const int *result;
+    int *indices, i;
+
+    (void) pthread_mutex_lock(&cache.mutex);
+    result = l->orders[order];
+    (void) pthread_mutex_unlock(&cache.mutex);
+
+    if (result == NULL &&
+        (indices = (int *) malloc((l->num_entries + 1) * sizeof(int))) != NULL) {
+        for (i = 0; i < l->num_entries; i++) {
+            indices[i] = i;
+        }
+        sc.l = l;
+        sc.order = order;
+        qsort_r(indices, (size_t) l->num_entries, sizeof(indices[0]),
+                compare_dir_entries, &sc);
+
+        // Another thread may have sorted it meanwhile
+        (void) pthread_mutex_lock(&cache.mutex);
+        if (l->orders[order] == NULL) {
+            l->orders[order] = indices;
+        } else {
+            free(indices);
+        }
+        result = l->orders[order];
+        (void) pthread_mutex_unlock(&cache.mutex);
+    }
+
+    return result;
+}
+
+void dir_cache_init(void) {
+    mg_watch_add_listener(dir_cache_invalidate);
+}
@@ -1,50 +1,12 @@
 #include "mingoose.h"
 
-static int remove_directory(struct mg_connection *conn, const char *dir) {
-    char path[PATH_MAX];
-    struct dirent *dp;
-    DIR *dirp;
-    struct de de;
-
-    if ((dirp = opendir(dir)) == NULL) {
-        return 0;
-    } else {
-        de.conn = conn;
-
-        while ((dp = readdir(dirp)) != NULL) {
-            // Do not show current dir, but show hidden files
-            if (!strcmp(dp->d_name, ".") ||
-                !strcmp(dp->d_name, "..")) {
-                continue;
-            }
-
-            mg_snprintf(path, sizeof(path), "%s%c%s", dir, '/', dp->d_name);
-
-            // If we don't memset stat structure to zero, mtime will have
-            // garbage and strftime() will segfault later on in
-            // print_dir_entry(). memset is required only if mg_stat()
-            // fails. For more details, see
-            // http://code.google.com/p/mongoose/issues/detail?id=79
-            memset(&de.file, 0, sizeof(de.file));
-            mg_stat(path, &de.file);
-            if(de.file.modification_time) {
-                if(de.file.is_directory) {
-                    remove_directory(conn, path);
-                } else {
-                    mg_remove(path);
-                }
-            }
-
-        }
-        (void) closedir(dirp);
-
-        rmdir(dir);
-    }
-
-    return 1;
+// Called when the server itself changes the filesystem. Do not wait for
+// the watcher, next request must see the change.
+static void invalidate_caches(const char *path) {
+    file_cache_invalidate(path);
+    resolve_cache_invalidate(path);
 }
 
-
 static void handle_delete_request(struct mg_connection *conn,
                                   const char *path) {
     struct file file = STRUCT_FILE_INITIALIZER;
@@ -55,9 +17,16 @@ static void handle_delete_request(struct mg_connection *conn,
         response_error(conn, 500, http_500_error, "remove(%s): %s", path,
                         strerror(ERRNO));
     } else if (file.is_directory) {
-        remove_directory(conn, path);
-        response_error(conn, 204, "No Content", "%s", "");
+        // The trash answers at once, whatever the size of the tree
+        if (!trash_move(conn->ctx, path) && !remove_tree(conn->ctx, path)) {
+            response_error(conn, 500, http_500_error, "remove(%s): %s", path,
+                            strerror(ERRNO));
+        } else {
+            response_error(conn, 204, "No Content", "%s", "");
+        }
+        invalidate_caches(NULL);
     } else if (mg_remove(path) == 0) {
+        invalidate_caches(path);
         response_error(conn, 204, "No Content", "%s", "");
     } else {
         response_error(conn, 423, "Locked", "remove(%s): %s", path,
@@ -68,111 +37,32 @@ static void handle_delete_request(struct mg_connection *conn,
 
 
 static int is_put_or_delete_request(const struct mg_connection *conn) {
-    const char *s = conn->request_info.request_method;
-    return s != NULL && (!strcmp(s, "PUT") ||
-                         !strcmp(s, "DELETE"));
+    int method = conn->request_info.method;
+    return method == MG_METHOD_PUT || method == MG_METHOD_DELETE;
 }
 
 
-static int isbyte(int n) {
-    return n >= 0 && n <= 255;
-}
-
 static uint32_t get_remote_ip(const struct mg_connection *conn) {
     return ntohl(* (uint32_t *) &conn->client.rsa.sin.sin_addr);
 }
 
-static int parse_net(const char *spec, uint32_t *net, uint32_t *mask) {
-    int n, a, b, c, d, slash = 32, len = 0;
-
-    if ((sscanf(spec, "%d.%d.%d.%d/%d%n", &a, &b, &c, &d, &slash, &n) == 5 ||
-         sscanf(spec, "%d.%d.%d.%d%n", &a, &b, &c, &d, &n) == 4) &&
-        isbyte(a) && isbyte(b) && isbyte(c) && isbyte(d) &&
-        slash >= 0 && slash < 33) {
-        len = n;
-        *net = ((uint32_t)a << 24) | ((uint32_t)b << 16) | ((uint32_t)c << 8) | d;
-        *mask = slash ? 0xffffffffU << (32 - slash) : 0;
-    }
-
-    return len;
-}
-
-
-static int set_throttle(const char *spec, uint32_t remote_ip, const char *uri) {
-    int throttle = 0;
-    struct vec vec, val;
-    uint32_t net, mask;
-    char mult;
-    double v;
-
-    while ((spec = next_vector_eq(spec, &vec, &val)) != NULL) {
-        mult = ',';
-        if (sscanf(val.ptr, "%lf%c", &v, &mult) < 1 || v < 0 ||
-            (lowercase(&mult) != 'k' && lowercase(&mult) != 'm' && mult != ',')) {
-            continue;
-        }
-        v *= lowercase(&mult) == 'k' ? 1024 : lowercase(&mult) == 'm' ? 1048576 : 1;
-        if (vec.len == 1 && vec.ptr[0] == '*') {
-            throttle = (int) v;
-        } else if (parse_net(vec.ptr, &net, &mask) > 0) {
-            if ((remote_ip & mask) == net) {
-                throttle = (int) v;
-            }
-        } else if (match_prefix(vec.ptr, vec.len, uri) > 0) {
-            throttle = (int) v;
-        }
-    }
-
-    return throttle;
-}
-
-
 int forward_body_data(struct mg_connection *conn, FILE *fp,
                              SOCKET sock, SSL *ssl) {
-    const char *expect, *body;
     char buf[MG_BUF_LEN];
-    int nread, buffered_len, success = 0;
-    int64_t left;
+    int nread, success = 0;
 
-    expect = mg_get_header(conn, "Expect");
     assert(fp != NULL);
 
-    if (conn->content_len == INT64_MAX) {
+    if (conn->content_len == INT64_MAX && conn->chunk_state == 0) {
         response_error(conn, 411, "Length Required", "%s", "");
-    } else if (expect != NULL && mg_strcasecmp(expect, "100-continue")) {
-        response_error(conn, 417, "Expectation Failed", "%s", "");
-    } else {
-        if (expect != NULL) {
-            (void) mg_printf(conn, "%s", "HTTP/1.1 100 Continue\r\n\r\n");
-        }
-
-        buffered_len = conn->data_len - conn->request_len;
-        body = conn->buf + conn->request_len;
-        assert(buffered_len >= 0);
-
-        if (buffered_len > 0) {
-            if ((int64_t) buffered_len > conn->content_len) {
-                buffered_len = (int) conn->content_len;
+    } else if (body_expect(conn)) {
+        // Straight from the socket to the file, if possible
+        if (sock != INVALID_SOCKET ||
+            (success = body_splice(conn, fileno(fp), ftello(fp))) < 0) {
+            while ((nread = mg_read(conn, buf, sizeof(buf))) > 0 &&
+                   push(fp, sock, ssl, buf, nread) == nread) {
             }
-            push(fp, sock, ssl, body, (int64_t) buffered_len);
-            memmove((char *) body, body + buffered_len, buffered_len);
-            conn->data_len -= buffered_len;
-        }
-
-        nread = 0;
-        while (conn->num_bytes_read < conn->content_len + conn->request_len) {
-            left = left_to_read(conn);
-            if (left > (int64_t) sizeof(buf)) {
-                left = sizeof(buf);
-            }
-            nread = pull(NULL, conn, buf, (int) left);
-            if (nread <= 0 || push(fp, sock, ssl, buf, nread) != nread) {
-                break;
-            }
-        }
-
-        if (left_to_read(conn) == 0) {
-            success = nread >= 0;
+            success = nread == 0;
         }
 
         // Each error code path in this function must send an error
@@ -206,9 +96,13 @@ static int put_dir(const char *path) {
 
         // Try to create intermediate directory
         DEBUG_TRACE(("mkdir(%s)", buf));
-        if (!mg_stat(buf, &file) && mg_mkdir(buf, 0755) != 0) {
-            res = -1;
-            break;
+        if (!mg_stat(buf, &file)) {
+            if (mg_mkdir(buf, 0755) != 0) {
+                res = -1;
+                break;
+            }
+            // Anything cached as missing below buf is stale now
+            invalidate_caches(NULL);
         }
 
         // Is path itself a directory?
@@ -221,50 +115,115 @@ static int put_dir(const char *path) {
 }
 
 
+// Copy the current content of the file, for a partial write. Return 0 on
+// error.
+static int copy_file(const char *path, int to) {
+    char buf[MG_BUF_LEN];
+    ssize_t n;
+    int from, ok;
+
+    if ((from = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return 0;
+    }
+
+    // Shares the blocks where the file system can, else copies in kernel
+    while ((n = copy_file_range(from, NULL, to, NULL, 1 << 30, 0)) > 0) {
+    }
+    if (n < 0 && lseek(to, 0, SEEK_CUR) == 0) {
+        while ((n = read(from, buf, sizeof(buf))) > 0 && write(to, buf, n) == n) {
+        }
+    }
+    ok = n == 0;
+    close(from);
+
+    return ok;
+}
+
+// The body is written to a temporary file, see upload.c. A
+// "Content-Range: bytes=<first>-<last>" write starts from a copy of the
+// current file, a "bytes <first>-<last>/<total>" one is a piece of an
+// upload session.
 static void put_file(struct mg_connection *conn, const char *path) {
-    struct file file = STRUCT_FILE_INITIALIZER;
-    FILE *fp;
+    char tmp[PATH_MAX];
+    struct stat st;
     const char *range;
-    int64_t r1, r2;
-    int rc;
+    int64_t r1 = 0, r2 = 0, total, offset = 0;
+    int rc, fd, exists, partial;
+    FILE *fp;
 
-    conn->status_code = mg_stat(path, &file) ? 200 : 201;
+    exists = stat(path, &st) == 0;
+    conn->status_code = exists ? 200 : 201;
+    range = mg_get_known_header(conn, MG_HEADER_CONTENT_RANGE);
+    partial = range != NULL && parse_range_header(range, &r1, &r2) > 0;
 
     if ((rc = put_dir(path)) == 0) {
         mg_printf(conn, "HTTP/1.1 %d OK\r\n\r\n", conn->status_code);
+        return;
     } else if (rc == -1) {
         response_error(conn, 500, http_500_error,
                         "put_dir(%s): %s", path, strerror(ERRNO));
-    } else if ((fp = fopen(path, "wb+")) == NULL) {
+        return;
+    } else if (range != NULL && upload_parse_range(range, &r1, &r2, &total)) {
+        upload_put(conn, path, r1, r2, total);
+        return;
+    } else if ((fd = open_temp_file(path, tmp, sizeof(tmp))) < 0) {
+        response_error(conn, 500, http_500_error,
+                        "open(%s): %s", tmp, strerror(ERRNO));
+        return;
+    }
+
+    if ((exists && (fchmod(fd, st.st_mode & 07777) != 0 ||
+                    (partial && !copy_file(path, fd)))) ||
+        (fp = fdopen(fd, "wb")) == NULL) {
+        response_error(conn, 500, http_500_error,
+                        "%s: %s", tmp, strerror(ERRNO));
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+
+    if (partial) {
+        conn->status_code = 206;
+        offset = r1;
+    }
+    fseeko(fp, offset, SEEK_SET);
+
+    // Reserve the space at once, a large file is then less fragmented
+#if defined(FALLOC_FL_KEEP_SIZE)
+    if (conn->chunk_state == 0 && conn->content_len != INT64_MAX &&
+        conn->content_len > 0) {
+        (void) fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, conn->content_len);
+    }
+#endif
+
+    // forward_body_data() answers on error
+    if (!forward_body_data(conn, fp, INVALID_SOCKET, NULL)) {
         fclose(fp);
+        unlink(tmp);
+        return;
+    }
+
+    if (fflush(fp) != 0) {
         response_error(conn, 500, http_500_error,
-                        "fopen(%s): %s", path, strerror(ERRNO));
-    } else {
-        fclose_on_exec(fp);
-        range = mg_get_header(conn, "Content-Range");
-        r1 = r2 = 0;
-        if (range != NULL && parse_range_header(range, &r1, &r2) > 0) {
-            conn->status_code = 206;
-            fseeko(fp, r1, SEEK_SET);
-        }
-        if (!forward_body_data(conn, fp, INVALID_SOCKET, NULL)) {
-            conn->status_code = 500;
-        }
+                        "write(%s): %s", tmp, strerror(ERRNO));
+        unlink(tmp);
+    } else if (put_commit(conn, fd, tmp, path)) {
         mg_printf(conn, "HTTP/1.1 %d OK\r\nContent-Length: 0\r\n\r\n",
                   conn->status_code);
-        fclose(fp);
     }
+    fclose(fp);
 }
 
-// Return True if we should reply 304 Not Modified.
+// Return True if we should reply 304 Not Modified. Clients send back
+// the Last-Modified they got, so the date is only parsed if that differs.
 static int is_not_modified(const struct mg_connection *conn,
-                           const struct file *filep) {
-    char etag[64];
-    const char *ims = mg_get_header(conn, "If-Modified-Since");
-    const char *inm = mg_get_header(conn, "If-None-Match");
-    construct_etag(etag, sizeof(etag), filep);
-    return (inm != NULL && !mg_strcasecmp(etag, inm)) ||
-        (ims != NULL && filep->modification_time <= parse_date_string(ims));
+                           const struct resolution *res) {
+    const char *ims = mg_get_known_header(conn, MG_HEADER_IF_MODIFIED_SINCE);
+    const char *inm = mg_get_known_header(conn, MG_HEADER_IF_NONE_MATCH);
+    return (inm != NULL && !mg_strcasecmp(res->etag, inm)) ||
+        (ims != NULL && (!strcmp(ims, res->last_modified) ||
+                         res->file.modification_time <=
+                         parse_date_string(ims)));
 }
 
 
@@ -273,11 +232,10 @@ static int is_not_modified(const struct mg_connection *conn,
 // If the file is found, it's stats is returned in stp.
 static int substitute_index_file(struct mg_connection *conn, char *path,
                                  size_t path_len, struct file *filep) {
-    const char *list = conn->ctx->config[op("index_files")];
     struct file file = STRUCT_FILE_INITIALIZER;
-    struct vec filename_vec;
+    const struct vec *filename_vec;
     size_t n = strlen(path);
-    int found = 0;
+    int i, found = 0;
 
     // The 'path' given to us points to the directory. Remove all trailing
     // directory separator characters from the end of the path, and
@@ -289,14 +247,15 @@ static int substitute_index_file(struct mg_connection *conn, char *path,
 
     // Traverse index files list. For each entry, append it to the given
     // path and see if the file exists. If it exists, break the loop
-    while ((list = next_vector(list, &filename_vec)) != NULL) {
+    for (i = 0; i < conn->cfg->num_index_files; i++) {
+        filename_vec = &conn->cfg->index_files[i];
 
         // Ignore too long entries that may overflow path buffer
-        if (filename_vec.len > path_len - (n + 2))
+        if (filename_vec->len > path_len - (n + 2))
             continue;
 
         // Prepare full path to the index file
-        mg_strlcpy(path + n + 1, filename_vec.ptr, filename_vec.len + 1);
+        mg_strlcpy(path + n + 1, filename_vec->ptr, filename_vec->len + 1);
 
         // Does it exist?
         if (mg_stat(path, &file)) {
@@ -338,15 +297,19 @@ static void remove_double_dots_and_double_slashes(char *s) {
     *p = '\0';
 }
 
+static int accepts_gzip(const struct mg_connection *conn) {
+    const char *accept_encoding = mg_get_known_header(conn, MG_HEADER_ACCEPT_ENCODING);
+    return accept_encoding != NULL && strstr(accept_encoding, "gzip") != NULL;
+}
+
 // Return 1 if real file has been found, 0 otherwise
 static int convert_uri_to_file_name(struct mg_connection *conn, char *buf,
                                     size_t buf_len, struct file *filep) {
-    struct vec a, b;
-    const char *rewrite, *uri = conn->request_info.uri,
+    const struct glob_rule *rule;
+    const char *uri = conn->request_info.uri,
         *root = conn->ctx->settings.document_root;
-    int match_len;
+    int i, match_len;
     char gz_path[PATH_MAX];
-    char const* accept_encoding;
 
     // No filesystem access
     if (root == NULL) {
@@ -358,11 +321,11 @@ static int convert_uri_to_file_name(struct mg_connection *conn, char *buf,
     // If document_root is NULL, leave the file empty.
     mg_snprintf(buf, buf_len - 1, "%s%s", root, uri);
 
-    rewrite = conn->ctx->config[op("url_rewrite_patterns")];
-    while ((rewrite = next_vector_eq(rewrite, &a, &b)) != NULL) {
-        if ((match_len = match_prefix(a.ptr, a.len, uri)) > 0) {
-            mg_snprintf(buf, buf_len - 1, "%.*s%s", (int) b.len, b.ptr,
-                        uri + match_len);
+    for (i = 0; i < conn->cfg->num_rewrite_rules; i++) {
+        rule = &conn->cfg->rewrite_rules[i];
+        if ((match_len = mg_glob_match(rule->glob, uri)) > 0) {
+            mg_snprintf(buf, buf_len - 1, "%.*s%s", (int) rule->value.len,
+                        rule->value.ptr, uri + match_len);
             break;
         }
     }
@@ -377,13 +340,11 @@ static int convert_uri_to_file_name(struct mg_connection *conn, char *buf,
     // to indicate that the response need to have the content-
     // encoding: gzip header
     // we can only do this if the browser declares support
-    if ((accept_encoding = mg_get_header(conn, "Accept-Encoding")) != NULL) {
-        if (strstr(accept_encoding,"gzip") != NULL) {
-            snprintf(gz_path, sizeof(gz_path), "%s.gz", buf);
-            if (mg_stat(gz_path, filep)) {
-                filep->gzipped = 1;
-                return 1;
-            }
+    if (accepts_gzip(conn)) {
+        snprintf(gz_path, sizeof(gz_path), "%s.gz", buf);
+        if (mg_stat(gz_path, filep)) {
+            filep->gzipped = 1;
+            return 1;
         }
     }
 
@@ -391,37 +352,110 @@ static int convert_uri_to_file_name(struct mg_connection *conn, char *buf,
 }
 
 
+// Map the request URI to a file and decide what to answer. Only the URI,
+// the filesystem and Accept-Encoding are looked at, so that the result
+// can be cached, see resolve_cache.c.
+static void resolve_request(struct mg_connection *conn,
+                            struct resolution *res) {
+    const char *uri = conn->request_info.uri;
+    size_t uri_len = strlen(uri);
+
+    memset(&res->file, 0, sizeof(res->file));
+    res->path[0] = '\0';
+    convert_uri_to_file_name(conn, res->path, sizeof(res->path), &res->file);
+    mg_strlcpy(res->file_path, res->path, sizeof(res->file_path));
+
+    if (res->file.modification_time == (time_t) 0 ||
+        must_hide_file(conn, res->path)) {
+        res->kind = RESOLVED_NOT_FOUND;
+    } else if (res->file.is_directory && uri[uri_len - 1] != '/') {
+        res->kind = RESOLVED_REDIRECT;
+    } else if (res->file.is_directory &&
+               !substitute_index_file(conn, res->file_path,
+                                      sizeof(res->file_path), &res->file)) {
+        res->kind = RESOLVED_LISTING;
+    } else {
+        res->kind = RESOLVED_FILE;
+        res->mime = mg_get_builtin_mime_type(res->file_path);
+        construct_etag(res->etag, sizeof(res->etag), &res->file);
+        gmt_time_string(res->last_modified, sizeof(res->last_modified),
+                        &res->file.modification_time);
+    }
+}
+
+// Same as below, but for the document_archive. The archive is immutable,
+// and there are no per-directory passwords files in it.
+static void dispatch_archive(struct mg_connection *conn,
+                             struct mg_archive *arc) {
+    struct mg_request_info *ri = &conn->request_info;
+
+    if (!is_put_or_delete_request(conn) &&
+        !check_authorization(conn, NULL)) {
+        send_authorization_request(conn);
+    } else if (call_user(MG_REQUEST_BEGIN, conn, (void *) ri->uri) == 1) {
+        // Do nothing, callback has served the request
+    } else if (ri->method == MG_METHOD_OPTIONS) {
+        response_options(conn);
+    } else if (is_put_or_delete_request(conn)) {
+        response_error(conn, 405, "Method Not Allowed", "%s",
+                       "document_archive is read-only");
+    } else {
+        response_archive(conn, arc);
+    }
+}
+
+
 // This is the heart of the Mongoose's logic.
 // This function is called when the request is read, parsed and validated,
 // and Mongoose must decide what action to take: serve a file, or
 // a directory, or call embedded function, etcetera.
 void dispatch_and_send_response(struct mg_connection *conn) {
     struct mg_request_info *ri = &conn->request_info;
-    char path[PATH_MAX];
-    int uri_len;
-    struct file file = STRUCT_FILE_INITIALIZER;
+    struct resolution res;
+    unsigned int generation = 0;
+    int gzip = accepts_gzip(conn), cached = 0;
+    struct mg_archive *arc;
 
-    if ((conn->request_info.query_string = strchr(ri->uri, '?')) != NULL) {
-        * ((char *) conn->request_info.query_string++) = '\0';
+    // The URI is a copy of raw_uri, which is the cache key. Decoding
+    // never makes it longer.
+    if (!is_put_or_delete_request(conn) &&
+        resolve_cache_lookup(&ri->raw_uri, gzip, (char *) ri->uri, &res,
+                             &generation)) {
+        cached = 1;
+    } else {
+        mg_url_decode(ri->raw_uri.ptr, (int) ri->raw_uri.len, (char *) ri->uri,
+                      (int) ri->raw_uri.len + 1, 0);
+        remove_double_dots_and_double_slashes((char *) ri->uri);
+    }
+    set_throttle(conn, get_remote_ip(conn), ri->uri);
+
+    if ((arc = mg_archive_acquire(conn->ctx)) != NULL) {
+        dispatch_archive(conn, arc);
+        mg_archive_release(conn->ctx, arc);
+        return ;
+    }
+
+    if (!cached) {
+        resolve_request(conn, &res);
+
+        // A resolution made with options a reload has replaced must not
+        // outlive the request. Reloads swap the options before dropping
+        // the cache, so a store that passes this check is dropped then.
+        if (!is_put_or_delete_request(conn) && conn->cfg == conn->ctx->cfg) {
+            resolve_cache_store(&ri->raw_uri, gzip, ri->uri, &res, generation);
+        }
     }
-    uri_len = (int) strlen(ri->uri);
-    mg_url_decode(ri->uri, uri_len, (char *) ri->uri, uri_len + 1, 0);
-    remove_double_dots_and_double_slashes((char *) ri->uri);
-    conn->throttle = set_throttle(conn->ctx->config[op("throttle")],
-                                  get_remote_ip(conn), ri->uri);
-    path[0] = '\0';
-    convert_uri_to_file_name(conn, path, sizeof(path), &file);
 
     // Perform redirect and auth checks before calling begin_request() handler.
     // Otherwise, begin_request() would need to perform auth checks and redirects.
     if (!is_put_or_delete_request(conn) &&
-        !check_authorization(conn, path)) {
+        !check_authorization(conn, res.path)) {
         send_authorization_request(conn);
         return ;
     } else if (call_user(MG_REQUEST_BEGIN, conn, (void *) ri->uri) == 1) {
         // Do nothing, callback has served the request
         return ;
-    } else if (!strcmp(ri->request_method, "OPTIONS")) {
+    } else if (ri->method == MG_METHOD_OPTIONS) {
         response_options(conn);
         return ;
     } else if (conn->ctx->settings.document_root == NULL) {
@@ -431,35 +465,33 @@ void dispatch_and_send_response(struct mg_connection *conn) {
                (is_authorized_for_put(conn) != 1)) {
         send_authorization_request(conn);
         return ;
-    } else if (!strcmp(ri->request_method, "PUT")) {
-        put_file(conn, path);
+    } else if (ri->method == MG_METHOD_PUT) {
+        put_file(conn, res.path);
         return ;
-    } else if (!strcmp(ri->request_method, "DELETE")) {
-        handle_delete_request(conn, path);
+    } else if (ri->method == MG_METHOD_DELETE) {
+        handle_delete_request(conn, res.path);
         return ;
-    } else if (file.modification_time == (time_t) 0 ||
-               must_hide_file(conn, path)) {
+    } else if (res.kind == RESOLVED_NOT_FOUND) {
         response_error(conn, 404, "Not Found", "%s", "File not found");
         return ;
-    } else if (file.is_directory && ri->uri[uri_len - 1] != '/') {
+    } else if (res.kind == RESOLVED_REDIRECT) {
         mg_printf(conn, "HTTP/1.1 301 Moved Permanently\r\n"
                   "Location: %s/\r\n\r\n", ri->uri);
         return ;
-    } else if (file.is_directory &&
-               !substitute_index_file(conn, path, sizeof(path), &file)) {
-        if (!mg_strcasecmp(conn->ctx->config[op("enable_directory_listing")], "yes")) {
-            response_directory_index(conn, path);
+    } else if (res.kind == RESOLVED_LISTING) {
+        if (conn->cfg->enable_directory_listing) {
+            response_directory_index(conn, res.file_path);
             return ;
         } else {
             response_error(conn, 403, "Directory Listing Denied",
                             "Directory listing denied");
             return ;
         }
-    } else if (is_not_modified(conn, &file)) {
+    } else if (is_not_modified(conn, &res)) {
         response_error(conn, 304, "Not Modified", "%s", "");
         return ;
     } else {
-        response_file(conn, path, &file);
+        response_file(conn, &res);
         return ;
     }
 }
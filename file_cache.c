@@ -0,0 +1,378 @@
+#include "mingoose.h"
+
+// File metadata and content cache.
+//
+// Keeps mg_stat() results, including negative ones, for paths covered
+// by the file watcher, see watcher.c. Small files also keep their
+// content. Entries live until the watcher reports a change, so a hit
+// costs no system call at all.
+//
+// Misses are coalesced: the first thread that misses inserts a "filling"
+// placeholder and does the work, threads that miss the same path
+// meanwhile wait for it instead of hitting the disk themselves.
+
+#if !defined(FILE_CACHE_SIZE)
+#define FILE_CACHE_SIZE 65536   // Max number of cached entries
+#endif
+#if !defined(FILE_CACHE_MAX_CONTENT)
+#define FILE_CACHE_MAX_CONTENT (256 * 1024)  // Max size of a cached file
+#endif
+#if !defined(FILE_CACHE_CONTENT_SIZE)
+#define FILE_CACHE_CONTENT_SIZE (64 * 1024 * 1024)  // Max total content
+#endif
+#if !defined(FILE_CACHE_WAIT_MS)
+#define FILE_CACHE_WAIT_MS 2000 // How long to wait for another filler
+#endif
+#define FILE_CACHE_BUCKETS 16384
+
+struct file_cache_entry {
+    struct file_cache_entry *next;  // Next entry in the bucket chain
+    unsigned int hash;
+    int filling;                    // 1 while stat() is in progress
+    int content_filling;            // 1 while content is being read
+    struct file file;               // modification_time 0 if missing
+    struct file_content *content;   // Cached file body, or NULL
+    size_t path_len;
+    char path[1];                   // Allocated to hold the whole path
+};
+
+static struct {
+    volatile int enabled;
+    pthread_mutex_t mutex;          // Protects everything below
+    pthread_cond_t filled;          // Signaled when any fill finishes
+    unsigned int generation;        // Bumped on every invalidation
+    int num_entries;
+    int64_t content_size;           // Total size of cached content
+    struct file_cache_entry *buckets[FILE_CACHE_BUCKETS];
+} cache = { 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+            0, 0, 0, { NULL } };
+
+// Trailing slashes do not name a different file: "a/b/" is "a/b".
+static size_t key_len(const char *path) {
+    size_t len = strlen(path);
+
+    while (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    return len;
+}
+
+static struct file_cache_entry **find(const char *path, size_t len,
+                                      unsigned int hash) {
+    struct file_cache_entry **pp = &cache.buckets[hash % FILE_CACHE_BUCKETS];
+
+    while (*pp != NULL && ((*pp)->hash != hash || (*pp)->path_len != len ||
+                           memcmp((*pp)->path, path, len) != 0)) {
+        pp = &(*pp)->next;
+    }
+
+    return pp;
+}
+
+void file_content_release(struct file_content *content) {
+    if (content != NULL &&
+        __sync_sub_and_fetch(&content->refs, 1) == 0) {
+        free(content);
+    }
+}
+
+// Unlink and free the entry. Must be called with mutex held.
+static void drop(struct file_cache_entry **pp) {
+    struct file_cache_entry *e = *pp;
+
+    *pp = e->next;
+    if (e->content != NULL) {
+        cache.content_size -= e->content->len;
+        file_content_release(e->content);
+    }
+    free(e);
+    cache.num_entries--;
+}
+
+// Must be called with mutex held.
+static void flush(void) {
+    int i;
+
+    for (i = 0; i < FILE_CACHE_BUCKETS; i++) {
+        while (cache.buckets[i] != NULL) {
+            drop(&cache.buckets[i]);
+        }
+    }
+    assert(cache.num_entries == 0 && cache.content_size == 0);
+}
+
+// Drop the entry for the given path, or everything if path is NULL.
+// Registered as a watcher listener, and also called directly when the
+// server itself changes a file, e.g. on PUT.
+void file_cache_invalidate(const char *path) {
+    struct file_cache_entry **pp;
+    size_t len;
+    unsigned int hash;
+
+    if (!cache.enabled) {
+        return;
+    }
+
+    (void) pthread_mutex_lock(&cache.mutex);
+    cache.generation++;
+    if (path == NULL) {
+        flush();
+    } else {
+        len = key_len(path);
+        hash = mg_hash(path, len);
+        if (*(pp = find(path, len, hash)) != NULL) {
+            drop(pp);
+        }
+    }
+    // Waiters must not sleep on a placeholder that is gone
+    (void) pthread_cond_broadcast(&cache.filled);
+    (void) pthread_mutex_unlock(&cache.mutex);
+}
+
+// Wait until some fill finishes. Return 0 on timeout.
+// Must be called with mutex held.
+static int wait_filled(const struct timespec *deadline) {
+    return pthread_cond_timedwait(&cache.filled, &cache.mutex,
+                                  deadline) != ETIMEDOUT;
+}
+
+static void get_deadline(struct timespec *deadline) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += FILE_CACHE_WAIT_MS / 1000;
+    deadline->tv_nsec += (FILE_CACHE_WAIT_MS % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+static struct file_cache_entry *new_entry(const char *path, size_t len,
+                                          unsigned int hash) {
+    struct file_cache_entry *e;
+
+    if ((e = (struct file_cache_entry *) calloc(1, sizeof(*e) + len)) != NULL) {
+        e->hash = hash;
+        e->path_len = len;
+        memcpy(e->path, path, len);
+        e->path[len] = '\0';
+    }
+
+    return e;
+}
+
+// Return 1 and fill filep if the path is cached.
+// Otherwise, the caller must stat() the path and pass the result to
+// file_cache_store() along with the ticket. If another thread is already
+// doing that, wait for its result instead.
+int file_cache_lookup(const char *path, struct file *filep,
+                      struct file_cache_ticket *ticket) {
+    struct file_cache_entry *e, **pp;
+    struct timespec deadline;
+    size_t len;
+    unsigned int hash;
+    int found = 0, waited = 0;
+
+    ticket->owner = 0;
+    if (!cache.enabled || !mg_watch_is_active()) {
+        return 0;
+    }
+
+    len = key_len(path);
+    hash = mg_hash(path, len);
+
+    (void) pthread_mutex_lock(&cache.mutex);
+    for (;;) {
+        if ((e = *(pp = find(path, len, hash))) == NULL) {
+            // Become the filler, if the path can be cached at all
+            if (cache.num_entries >= FILE_CACHE_SIZE) {
+                cache.generation++;
+                flush();
+                (void) pthread_cond_broadcast(&cache.filled);
+                pp = find(path, len, hash);
+            }
+            if (mg_watch_covers(path, len) &&
+                (e = new_entry(path, len, hash)) != NULL) {
+                e->filling = 1;
+                *pp = e;
+                cache.num_entries++;
+                ticket->owner = 1;
+                ticket->generation = cache.generation;
+            }
+            break;
+        } else if (!e->filling) {
+            filep->modification_time = e->file.modification_time;
+            filep->size = e->file.size;
+            filep->is_directory = e->file.is_directory;
+            found = 1;
+            break;
+        } else if (!waited) {
+            get_deadline(&deadline);
+            waited = 1;
+        }
+        if (!wait_filled(&deadline)) {
+            // Filler is stuck, e.g. on a dead NFS server. Do it ourselves.
+            break;
+        }
+    }
+    (void) pthread_mutex_unlock(&cache.mutex);
+
+    return found;
+}
+
+// Remember stat result for the path. Nothing is stored if any invalidation
+// happened since file_cache_lookup() issued the ticket, as the result might
+// already be stale.
+void file_cache_store(const char *path, const struct file *filep,
+                      const struct file_cache_ticket *ticket) {
+    struct file_cache_entry *e, **pp;
+    size_t len;
+    unsigned int hash;
+
+    if (!ticket->owner) {
+        return;
+    }
+
+    len = key_len(path);
+    hash = mg_hash(path, len);
+
+    (void) pthread_mutex_lock(&cache.mutex);
+    if ((e = *(pp = find(path, len, hash))) != NULL && e->filling) {
+        if (ticket->generation != cache.generation) {
+            drop(pp);
+        } else {
+            e->file = *filep;
+            e->file.gzipped = 0;
+            e->filling = 0;
+        }
+        (void) pthread_cond_broadcast(&cache.filled);
+    }
+    (void) pthread_mutex_unlock(&cache.mutex);
+}
+
+// Give up filling the entry, the result must not be cached.
+void file_cache_abandon(const char *path,
+                        const struct file_cache_ticket *ticket) {
+    struct file_cache_entry *e, **pp;
+    size_t len;
+
+    if (!ticket->owner) {
+        return;
+    }
+
+    len = key_len(path);
+    (void) pthread_mutex_lock(&cache.mutex);
+    if ((e = *(pp = find(path, len, mg_hash(path, len)))) != NULL &&
+        e->filling) {
+        drop(pp);
+        (void) pthread_cond_broadcast(&cache.filled);
+    }
+    (void) pthread_mutex_unlock(&cache.mutex);
+}
+
+// Read the whole file into a newly allocated content buffer, if it is
+// still the file described by filep.
+static struct file_content *read_content(const char *path,
+                                         const struct file *filep) {
+    struct file_content *content;
+    struct stat st;
+    int64_t n, len = filep->size;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return NULL;
+    } else if (fstat(fd, &st) != 0 || st.st_size != len ||
+               st.st_mtime != filep->modification_time ||
+               (content = (struct file_content *)
+                malloc(sizeof(*content) + len)) == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    content->refs = 1;
+    content->len = 0;
+    while (content->len < len &&
+           (n = read(fd, content->data + content->len, len - content->len)) > 0) {
+        content->len += n;
+    }
+    close(fd);
+
+    if (content->len != len) {
+        free(content);
+        content = NULL;
+    }
+
+    return content;
+}
+
+// Return referenced content of a small file, or NULL if the file cannot be
+// served from memory. The caller must file_content_release() it.
+// Only one thread reads a given file; the others wait for it to finish.
+struct file_content *file_cache_get_content(const char *path,
+                                            const struct file *filep) {
+    struct file_cache_entry *e;
+    struct file_content *content = NULL;
+    struct timespec deadline;
+    size_t len;
+    unsigned int hash, generation;
+    int waited = 0;
+
+    if (!cache.enabled || !mg_watch_is_active() || filep->is_directory ||
+        filep->size > FILE_CACHE_MAX_CONTENT) {
+        return NULL;
+    }
+
+    len = key_len(path);
+    hash = mg_hash(path, len);
+
+    (void) pthread_mutex_lock(&cache.mutex);
+    for (;;) {
+        e = *find(path, len, hash);
+        if (e == NULL || e->filling ||
+            e->file.modification_time != filep->modification_time ||
+            e->file.size != filep->size) {
+            // Only content of a cached, up to date entry is kept
+            break;
+        } else if (e->content != NULL) {
+            content = e->content;
+            __sync_add_and_fetch(&content->refs, 1);
+            break;
+        } else if (!e->content_filling) {
+            if (cache.content_size + filep->size > FILE_CACHE_CONTENT_SIZE) {
+                break;
+            }
+            e->content_filling = 1;
+            generation = cache.generation;
+            (void) pthread_mutex_unlock(&cache.mutex);
+
+            content = read_content(path, filep);
+
+            (void) pthread_mutex_lock(&cache.mutex);
+            // Entry may have been dropped while the lock was released
+            e = *find(path, len, hash);
+            if (e != NULL && e->content_filling) {
+                e->content_filling = 0;
+                if (content != NULL && generation == cache.generation) {
+                    e->content = content;
+                    cache.content_size += content->len;
+                    __sync_add_and_fetch(&content->refs, 1);
+                }
+            }
+            (void) pthread_cond_broadcast(&cache.filled);
+            break;
+        } else if (!waited) {
+            get_deadline(&deadline);
+            waited = 1;
+        }
+        if (!wait_filled(&deadline)) {
+            break;
+        }
+    }
+    (void) pthread_mutex_unlock(&cache.mutex);
+
+    return content;
+}
+
+void file_cache_init(void) {
+    cache.enabled = 1;
+    mg_watch_add_listener(file_cache_invalidate);
+}
@@ -0,0 +1,187 @@
+#include "mingoose.h"
+
+// Compiled glob patterns.
+//
+// Patterns of hide_files_patterns, url_rewrite_patterns and throttle are
+// compiled with the configuration into a bit-parallel NFA (Shift-And), one per
+// '|' alternative. Bit i of the state is set when the first i tokens of
+// the alternative have matched, so a string is matched in a single pass,
+// whatever the number of stars in the pattern.
+//
+// Syntax is the one of match_prefix(): '?' is any character, '*' is any
+// run of characters but '/', '**' is any run of characters, '$' anchors
+// the end of the string, everything else matches case insensitively.
+// Return value differs in one way: the longest matching prefix is
+// returned, where match_prefix() returns the one its backtracking finds
+// first. The two agree for the patterns used in practice, where stars
+// are greedy.
+
+#define GLOB_MAX_TOKENS 63          // State bits, the last one is accepting
+
+struct glob_alt {
+    uint64_t consume[256];          // Tokens matching the character
+    uint64_t loop_any;              // '**' tokens
+    uint64_t loop_segment;          // '*' tokens
+    uint64_t accept;
+    int anchored;                   // Pattern ends with '$'
+    const char *fallback;           // Too many tokens, use match_prefix()
+    int fallback_len;
+};
+
+struct mg_glob {
+    int num_alts;
+    struct glob_alt alts[1];        // Followed by a copy of the pattern
+};
+
+static void compile_alt(struct glob_alt *alt, const char *p, int len) {
+    int i, c, n = 0, prev_star = 0;
+    uint64_t bit;
+
+    memset(alt, 0, sizeof(*alt));
+    for (i = 0; i < len && p[i] != '$'; i++) {
+        if (n >= GLOB_MAX_TOKENS && !(prev_star && p[i] == '*')) {
+            alt->fallback = p;
+            alt->fallback_len = len;
+            return;
+        } else if (p[i] == '*') {
+            // Adjacent stars make one, '**' if any of them is
+            bit = prev_star ? (uint64_t) 1 << (n - 1) : (uint64_t) 1 << n;
+            if (i + 1 < len && p[i + 1] == '*') {
+                i++;
+                alt->loop_segment &= ~bit;
+                alt->loop_any |= bit;
+            } else if (!(alt->loop_any & bit)) {
+                alt->loop_segment |= bit;
+            }
+            n += !prev_star;
+            prev_star = 1;
+            continue;
+        }
+
+        bit = (uint64_t) 1 << n++;
+        prev_star = 0;
+        for (c = 1; c < 256; c++) {
+            if (p[i] == '?' || tolower(c) == lowercase(&p[i])) {
+                alt->consume[c] |= bit;
+            }
+        }
+    }
+    alt->anchored = i < len;
+    alt->accept = (uint64_t) 1 << n;
+}
+
+// Compile pattern of the given length. Return NULL on OOM.
+struct mg_glob *mg_glob_compile(const char *pattern, int len) {
+    struct mg_glob *g;
+    const char *p, *end, *or_str;
+    char *copy;
+    int i, num_alts = 1;
+
+    for (p = pattern; (p = (const char *) memchr(p, '|', pattern + len - p)) !=
+         NULL; p++) {
+        num_alts++;
+    }
+    if ((g = (struct mg_glob *) malloc(sizeof(*g) + (num_alts - 1) *
+                                       sizeof(g->alts[0]) + len)) == NULL) {
+        return NULL;
+    }
+
+    // Fallback alternatives point into the copy
+    copy = (char *) &g->alts[num_alts];
+    memcpy(copy, pattern, len);
+    pattern = copy;
+    end = pattern + len;
+    g->num_alts = num_alts;
+    for (i = 0, p = pattern; i < num_alts; i++, p = or_str + 1) {
+        if ((or_str = (const char *) memchr(p, '|', end - p)) == NULL) {
+            or_str = end;
+        }
+        compile_alt(&g->alts[i], p, (int) (or_str - p));
+    }
+
+    return g;
+}
+
+void mg_glob_free(struct mg_glob *g) {
+    free(g);
+}
+
+static int match_alt(const struct glob_alt *alt, const char *str) {
+    uint64_t state, skip = alt->loop_any | alt->loop_segment;
+    int j, c, res;
+
+    if (alt->fallback != NULL) {
+        return match_prefix(alt->fallback, alt->fallback_len, str);
+    }
+
+    // Stars may match nothing
+    state = 1;
+    state |= (state & skip) << 1;
+    res = state & alt->accept ? 0 : -1;
+
+    for (j = 0; (c = ((const unsigned char *) str)[j]) != '\0'; j++) {
+        state = ((state & alt->consume[c]) << 1) | (state & alt->loop_any) |
+            (c == '/' ? 0 : state & alt->loop_segment);
+        state |= (state & skip) << 1;
+        if (state == 0) {
+            return alt->anchored ? -1 : res;
+        } else if (state & alt->accept) {
+            res = j + 1;
+        }
+    }
+
+    return !alt->anchored ? res : state & alt->accept ? j : -1;
+}
+
+// Same as match_prefix(): length of the matched prefix of str, or -1.
+// Alternatives are tried in order, the first non-empty match wins.
+int mg_glob_match(const struct mg_glob *g, const char *str) {
+    int i, res = -1;
+
+    for (i = 0; i < g->num_alts; i++) {
+        if ((res = match_alt(&g->alts[i], str)) > 0) {
+            break;
+        }
+    }
+
+    return res;
+}
+
+// Compile "pattern=value,..." list. Return 0 on OOM.
+int mg_glob_compile_rules(const char *list, struct glob_rule **rules,
+                          int *num_rules) {
+    struct glob_rule *p;
+    struct vec pattern, value;
+    int size = 0;
+
+    *rules = NULL;
+    *num_rules = 0;
+    while ((list = next_vector_eq(list, &pattern, &value)) != NULL) {
+        if (*num_rules >= size) {
+            size = size * 2 + 4;
+            if ((p = (struct glob_rule *)
+                 realloc(*rules, size * sizeof(*p))) == NULL) {
+                return 0;
+            }
+            *rules = p;
+        }
+        p = &(*rules)[*num_rules];
+        p->pattern = pattern;
+        p->value = value;
+        if ((p->glob = mg_glob_compile(pattern.ptr, (int) pattern.len)) == NULL) {
+            return 0;
+        }
+        (*num_rules)++;
+    }
+
+    return 1;
+}
+
+void mg_glob_free_rules(struct glob_rule *rules, int num_rules) {
+    int i;
+
+    for (i = 0; i < num_rules; i++) {
+        mg_glob_free(rules[i].glob);
+    }
+    free(rules);
+}
@@ -0,0 +1,156 @@
+#include "mingoose.h"
+#include <sys/uio.h>
+
+// File read offloading.
+//
+// Reads of data that is already in the page cache are done right away by
+// the worker thread, with preadv2(RWF_NOWAIT), which fails instead of
+// going to the disk. Everything else is handed to a small pool of I/O
+// threads, so that a slow disk or NFS document_root ties up at most
+// io_threads reads, and the worker can send the current chunk to the
+// client while the next one is being read.
+
+static struct {
+    pthread_mutex_t mutex;          // Protects everything below
+    pthread_cond_t queued;          // Signaled when a request is queued
+    pthread_cond_t done;            // Broadcast when a request is done
+    struct io_request *head;        // Queue of pending requests
+    struct io_request *tail;
+    int num_threads;                // Running I/O threads
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+           PTHREAD_COND_INITIALIZER, NULL, NULL, 0 };
+
+// Read without blocking on the disk. Return -1 with errno EAGAIN if the
+// data is not in the page cache, or if that cannot be told.
+static ssize_t read_nowait(int fd, char *buf, size_t len, int64_t offset) {
+#if defined(RWF_NOWAIT)
+    struct iovec iov;
+    ssize_t n;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    if ((n = preadv2(fd, &iov, 1, (off_t) offset, RWF_NOWAIT)) < 0 &&
+        errno != EAGAIN) {
+        // E.g. EOPNOTSUPP on filesystems that do not support it
+        errno = EAGAIN;
+    }
+    return n;
+#else
+    (void) fd; (void) buf; (void) len; (void) offset;
+    errno = EAGAIN;
+    return -1;
+#endif
+}
+
+static void *io_thread(void *param) {
+    struct mg_context *ctx = (struct mg_context *) param;
+    struct io_request *req;
+    struct timespec deadline;
+
+    (void) pthread_mutex_lock(&pool.mutex);
+    for (;;) {
+        if ((req = pool.head) != NULL) {
+            if ((pool.head = req->next) == NULL) {
+                pool.tail = NULL;
+            }
+            (void) pthread_mutex_unlock(&pool.mutex);
+
+            req->result = pread(req->fd, req->buf, req->len,
+                                (off_t) req->offset);
+
+            (void) pthread_mutex_lock(&pool.mutex);
+            req->state = IO_DONE;
+            (void) pthread_cond_broadcast(&pool.done);
+        } else if (ctx->stop_flag) {
+            // Queue is empty. Requests are not queued once the last thread
+            // is gone, see io_read_start().
+            break;
+        } else {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec++;
+            (void) pthread_cond_timedwait(&pool.queued, &pool.mutex,
+                                          &deadline);
+        }
+    }
+    pool.num_threads--;
+    (void) pthread_mutex_unlock(&pool.mutex);
+
+    // Signal master that we're done, same as worker threads do
+    (void) pthread_mutex_lock(&ctx->mutex);
+    ctx->num_threads--;
+    (void) pthread_cond_signal(&ctx->cond);
+    (void) pthread_mutex_unlock(&ctx->mutex);
+
+    DEBUG_TRACE(("exiting"));
+    return NULL;
+}
+
+// Start reading len bytes at offset into buf. The result must be picked
+// up with io_read_finish(), and buf must stay valid until then.
+void io_read_start(struct io_request *req, int fd, char *buf, size_t len,
+                   int64_t offset) {
+    req->fd = fd;
+    req->buf = buf;
+    req->len = len;
+    req->offset = offset;
+    req->next = NULL;
+
+    // A short read is fine, the rest is read with the next chunk
+    if ((req->result = read_nowait(fd, buf, len, offset)) >= 0) {
+        req->state = IO_DONE;
+        return;
+    }
+
+    (void) pthread_mutex_lock(&pool.mutex);
+    if (pool.num_threads > 0) {
+        req->state = IO_QUEUED;
+        if (pool.tail == NULL) {
+            pool.head = req;
+        } else {
+            pool.tail->next = req;
+        }
+        pool.tail = req;
+        (void) pthread_cond_signal(&pool.queued);
+    } else {
+        // No pool, read in io_read_finish() as before
+        req->state = IO_DEFERRED;
+    }
+    (void) pthread_mutex_unlock(&pool.mutex);
+}
+
+// Wait for the read to complete. Return the number of bytes read, 0 at
+// end of file, or -1 on error.
+ssize_t io_read_finish(struct io_request *req) {
+    if (req->state == IO_DEFERRED) {
+        req->result = pread(req->fd, req->buf, req->len, (off_t) req->offset);
+    } else if (req->state == IO_QUEUED) {
+        (void) pthread_mutex_lock(&pool.mutex);
+        while (req->state != IO_DONE) {
+            (void) pthread_cond_wait(&pool.done, &pool.mutex);
+        }
+        (void) pthread_mutex_unlock(&pool.mutex);
+    }
+    req->state = IO_DONE;
+
+    return req->result;
+}
+
+// Start io_threads I/O threads. With none, reads are done by the workers.
+void io_pool_start(struct mg_context *ctx) {
+    int i;
+
+    for (i = 0; i < ctx->settings.io_threads; i++) {
+        (void) pthread_mutex_lock(&pool.mutex);
+        pool.num_threads++;
+        (void) pthread_mutex_unlock(&pool.mutex);
+        if (mg_start_thread(io_thread, ctx) != 0) {
+            cry(create_fake_connection(ctx), "Cannot start I/O thread: %ld",
+                (long) ERRNO);
+            (void) pthread_mutex_lock(&pool.mutex);
+            pool.num_threads--;
+            (void) pthread_mutex_unlock(&pool.mutex);
+        } else {
+            ctx->num_threads++;
+        }
+    }
+}
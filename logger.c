@@ -39,11 +39,11 @@ void cry(struct mg_connection *conn, const char *fmt, ...) {
   }
 }
 
-static void log_header(const struct mg_connection *conn, const char *header,
+static void log_header(const struct mg_connection *conn, int header,
                        FILE *fp) {
   const char *header_value;
 
-  if ((header_value = mg_get_header(conn, header)) == NULL) {
+  if ((header_value = mg_get_known_header(conn, header)) == NULL) {
     (void) fprintf(fp, "%s", " -");
   } else {
     (void) fprintf(fp, " \"%s\"", header_value);
@@ -74,8 +74,8 @@ void log_access(const struct mg_connection *conn) {
           ri->request_method ? ri->request_method : "-",
           ri->uri ? ri->uri : "-", ri->http_version,
           conn->status_code, conn->num_bytes_sent);
-  log_header(conn, "Referer", fp);
-  log_header(conn, "User-Agent", fp);
+  log_header(conn, MG_HEADER_REFERER, fp);
+  log_header(conn, MG_HEADER_USER_AGENT, fp);
   fputc('\n', fp);
   fflush(fp);
 
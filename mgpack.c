@@ -0,0 +1,446 @@
+// mgpack: pack a directory into a document_archive for mingoose.
+//
+// Usage: mgpack <directory> <archive> [<mime_types_file>]
+//
+// Every file under the directory becomes an entry with its MIME type,
+// Etag and Last-Modified precomputed. MIME types are resolved here, not
+// by the server: its mime_types_file option does not apply to archived
+// files, pass the same file to mgpack instead. If both "x" and "x.gz" exist, the
+// latter is also stored as the precompressed variant of "x", so clients
+// that accept gzip get it without any lookups. Passwords files are
+// never packed. Symbolic links are followed, except those leading back
+// to a directory being packed, which would never end.
+//
+// The archive is written to a temporary file and renamed into place, so
+// a running server picks up the new build atomically. Never overwrite a
+// served archive in place: it is mapped into the server's memory.
+#include "mingoose.h"
+
+struct pack_entry {
+    char *uri;                  // "/css/main.css"
+    char *fs_path;              // Path on disk, NULL for directories
+    struct stat st;
+    int flags;                  // MG_ARCHIVE_* flags
+    int gz;                     // Index of the gzipped variant, or -1
+    uint64_t data_offset;       // Where the body is written
+};
+
+// Directory being scanned, and those it is in
+struct visit {
+    const struct visit *parent;
+    dev_t dev;
+    ino_t ino;
+};
+
+static struct pack_entry *entries;
+static int num_entries, entries_size;
+
+static void die_errno(const char *what, const char *path) {
+    die("%s(%s): %s", what, path, strerror(errno));
+}
+
+static int add_entry(const char *uri, const char *fs_path,
+                     const struct stat *st, int flags) {
+    struct pack_entry *e;
+
+    if (num_entries >= entries_size) {
+        entries_size = entries_size == 0 ? 1024 : entries_size * 2;
+        if ((entries = (struct pack_entry *)
+             realloc(entries, entries_size * sizeof(*entries))) == NULL) {
+            die("%s", "out of memory");
+        }
+    }
+    e = &entries[num_entries];
+    e->uri = mg_strdup(uri);
+    e->fs_path = fs_path == NULL ? NULL : mg_strdup(fs_path);
+    e->st = *st;
+    e->flags = flags;
+    e->gz = -1;
+    e->data_offset = 0;
+
+    return num_entries++;
+}
+
+static int is_visited(const struct visit *v, const struct stat *st) {
+    for (; v != NULL; v = v->parent) {
+        if (v->dev == st->st_dev && v->ino == st->st_ino) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void scan(const char *dir, const char *uri, const struct visit *self) {
+    char path[PATH_MAX], child_uri[PATH_MAX];
+    struct visit child;
+    struct dirent *dp;
+    struct stat st;
+    DIR *dirp;
+
+    if ((dirp = opendir(dir)) == NULL) {
+        die_errno("opendir", dir);
+    }
+    while ((dp = readdir(dirp)) != NULL) {
+        if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..") ||
+            !strcmp(dp->d_name, PASSWORDS_FILE_NAME)) {
+            continue;
+        }
+        mg_snprintf(path, sizeof(path), "%s/%s", dir, dp->d_name);
+        mg_snprintf(child_uri, sizeof(child_uri), "%s/%s", uri, dp->d_name);
+        if (stat(path, &st) != 0) {
+            die_errno("stat", path);
+        } else if (S_ISDIR(st.st_mode) && is_visited(self, &st)) {
+            fprintf(stderr, "mgpack: skipping %s: link to a parent\n", path);
+        } else if (S_ISDIR(st.st_mode)) {
+            add_entry(child_uri, NULL, &st, MG_ARCHIVE_DIRECTORY);
+            child.parent = self;
+            child.dev = st.st_dev;
+            child.ino = st.st_ino;
+            scan(path, child_uri, &child);
+        } else if (S_ISREG(st.st_mode)) {
+            add_entry(child_uri, path, &st, 0);
+        }
+    }
+    closedir(dirp);
+}
+
+static int compare_uris(const void *a, const void *b) {
+    return strcmp(entries[*(const int *) a].uri, entries[*(const int *) b].uri);
+}
+
+// Find the entry whose URI is the first len bytes of uri in sorted, the
+// indices of n entries ordered by URI. Return -1 if there is none.
+static int find_entry(const int *sorted, int n, const char *uri, size_t len) {
+    const char *s;
+    int lo = 0, hi = n, mid, cmp;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        s = entries[sorted[mid]].uri;
+        if ((cmp = strncmp(uri, s, len)) == 0 && s[len] != '\0') {
+            cmp = -1;
+        }
+        if (cmp == 0) {
+            return sorted[mid];
+        } else if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return -1;
+}
+
+// Attach every "x.gz" to "x". If "x" does not exist, add it as gzip-only,
+// same as the server does for .gz files on disk.
+static void pair_gzipped(void) {
+    int i, n = num_entries, base, *sorted;
+    size_t len;
+
+    if ((sorted = (int *) calloc(n + 1, sizeof(int))) == NULL) {
+        die("%s", "out of memory");
+    }
+    for (i = 0; i < n; i++) {
+        sorted[i] = i;
+    }
+    qsort(sorted, n, sizeof(sorted[0]), compare_uris);
+
+    for (i = 0; i < n; i++) {
+        len = strlen(entries[i].uri);
+        if (entries[i].flags != 0 || len < 4 ||
+            strcmp(entries[i].uri + len - 3, ".gz") != 0) {
+            continue;
+        }
+        if ((base = find_entry(sorted, n, entries[i].uri, len - 3)) < 0) {
+            entries[i].uri[len - 3] = '\0';
+            base = add_entry(entries[i].uri, NULL, &entries[i].st,
+                             MG_ARCHIVE_GZ_ONLY);
+            entries[i].uri[len - 3] = '.';
+        }
+        if (!(entries[base].flags & MG_ARCHIVE_DIRECTORY)) {
+            entries[base].gz = i;
+        }
+    }
+    free(sorted);
+}
+
+// Build perfect hash: every bucket gets a seed that sends its keys to
+// distinct free slots. Biggest buckets are placed first, while most
+// slots are still free. Entries are grouped by bucket once, so a seed
+// is only tried on the keys of its bucket.
+static void build_hash(uint32_t *seeds, uint32_t num_buckets,
+                       uint32_t *slots, uint32_t num_slots) {
+    uint32_t *bucket_of, *order, *taken, *start, *members, b, i, j, k, n;
+    uint32_t *sizes, tmp, seed, slot;
+
+    bucket_of = (uint32_t *) calloc(num_entries + 1, sizeof(uint32_t));
+    members = (uint32_t *) calloc(num_entries + 1, sizeof(uint32_t));
+    order = (uint32_t *) calloc(num_buckets, sizeof(uint32_t));
+    sizes = (uint32_t *) calloc(num_buckets, sizeof(uint32_t));
+    start = (uint32_t *) calloc(num_buckets + 1, sizeof(uint32_t));
+    taken = (uint32_t *) calloc(num_entries + 1, sizeof(uint32_t));
+    if (bucket_of == NULL || members == NULL || order == NULL ||
+        sizes == NULL || start == NULL || taken == NULL) {
+        die("%s", "out of memory");
+    }
+
+    for (i = 0; i < num_slots; i++) {
+        slots[i] = MG_ARCHIVE_NO_ENTRY;
+    }
+    for (i = 0; i < (uint32_t) num_entries; i++) {
+        bucket_of[i] = mg_archive_hash(entries[i].uri, strlen(entries[i].uri),
+                                       0) % num_buckets;
+        sizes[bucket_of[i]]++;
+    }
+
+    // Keys of bucket b are members[start[b]] to members[start[b + 1] - 1]
+    for (b = 0; b < num_buckets; b++) {
+        start[b + 1] = start[b] + sizes[b];
+    }
+    for (i = 0; i < (uint32_t) num_entries; i++) {
+        members[start[bucket_of[i] + 1] - sizes[bucket_of[i]]--] = i;
+    }
+    for (b = 0; b < num_buckets; b++) {
+        sizes[b] = start[b + 1] - start[b];
+        order[b] = b;
+        seeds[b] = 0;
+    }
+
+    // Insertion sort is fine: buckets are few compared to the file I/O
+    for (i = 1; i < num_buckets; i++) {
+        for (j = i; j > 0 && sizes[order[j - 1]] < sizes[order[j]]; j--) {
+            tmp = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = tmp;
+        }
+    }
+
+    for (b = 0; b < num_buckets && sizes[order[b]] > 0; b++) {
+        for (seed = 1; ; seed++) {
+            if (seed == 0) {
+                die("%s", "cannot build perfect hash");
+            }
+            // Try to place all keys of the bucket with this seed
+            for (i = start[order[b]], n = 0; i < start[order[b] + 1]; i++) {
+                j = members[i];
+                slot = mg_archive_hash(entries[j].uri, strlen(entries[j].uri),
+                                       seed) % num_slots;
+                for (k = 0; k < n && taken[k] != slot; k++) {
+                }
+                if (slots[slot] != MG_ARCHIVE_NO_ENTRY || k < n) {
+                    break;
+                }
+                taken[n++] = slot;
+            }
+            if (i == start[order[b] + 1]) {
+                break;
+            }
+        }
+        seeds[order[b]] = seed;
+        for (k = 0; k < n; k++) {
+            slots[taken[k]] = members[start[order[b]] + k];
+        }
+    }
+
+    free(bucket_of);
+    free(members);
+    free(order);
+    free(sizes);
+    free(start);
+    free(taken);
+}
+
+static void write_all(FILE *fp, const void *buf, size_t len, const char *path) {
+    if (len > 0 && fwrite(buf, 1, len, fp) != len) {
+        die_errno("fwrite", path);
+    }
+}
+
+// Pad the output to the given alignment.
+static uint64_t align(FILE *fp, uint64_t offset, uint64_t alignment,
+                      const char *path) {
+    static const char zeroes[8];
+
+    while (offset % alignment != 0) {
+        write_all(fp, zeroes, 1, path);
+        offset++;
+    }
+    return offset;
+}
+
+static uint64_t copy_file(FILE *fp, const char *src, uint64_t offset,
+                          const char *path) {
+    char buf[MG_BUF_LEN];
+    size_t n;
+    FILE *in;
+
+    if ((in = fopen(src, "rb")) == NULL) {
+        die_errno("fopen", src);
+    }
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        write_all(fp, buf, n, path);
+        offset += n;
+    }
+    fclose(in);
+
+    return offset;
+}
+
+static void set_etag(char *buf, size_t len, const struct stat *st) {
+    mg_snprintf(buf, len, "\"%lx.%" INT64_FMT "\"",
+                (unsigned long) st->st_mtime, (int64_t) st->st_size);
+}
+
+static void write_archive(const char *path) {
+    struct mg_archive_header hdr;
+    struct mg_archive_entry *out;
+    struct pack_entry *e;
+    uint32_t *seeds, *slots;
+    uint64_t offset;
+    const char *mime;
+    char tmp[PATH_MAX];
+    FILE *fp;
+    int i;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MG_ARCHIVE_MAGIC, sizeof(hdr.magic));
+    hdr.byte_order = MG_ARCHIVE_BYTE_ORDER;
+    hdr.num_entries = num_entries;
+    hdr.num_buckets = num_entries / 4 + 1;
+    hdr.num_slots = num_entries + num_entries / 4 + 1;
+    hdr.seeds_offset = sizeof(hdr);
+    hdr.slots_offset = hdr.seeds_offset + hdr.num_buckets * sizeof(uint32_t);
+    hdr.entries_offset = hdr.slots_offset + hdr.num_slots * sizeof(uint32_t);
+    hdr.entries_offset = (hdr.entries_offset + 7) & ~(uint64_t) 7;
+
+    seeds = (uint32_t *) calloc(hdr.num_buckets, sizeof(uint32_t));
+    slots = (uint32_t *) calloc(hdr.num_slots, sizeof(uint32_t));
+    out = (struct mg_archive_entry *) calloc(num_entries + 1, sizeof(*out));
+    if (seeds == NULL || slots == NULL || out == NULL) {
+        die("%s", "out of memory");
+    }
+    build_hash(seeds, hdr.num_buckets, slots, hdr.num_slots);
+
+    mg_snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fp = fopen(tmp, "wb")) == NULL) {
+        die_errno("fopen", tmp);
+    }
+
+    // Header and tables are written last, when all offsets are known
+    offset = hdr.entries_offset + num_entries * sizeof(*out);
+    if (fseeko(fp, (off_t) offset, SEEK_SET) != 0) {
+        die_errno("fseeko", tmp);
+    }
+
+    // Strings
+    for (i = 0; i < num_entries; i++) {
+        e = &entries[i];
+        out[i].path_offset = offset;
+        out[i].path_len = strlen(e->uri);
+        write_all(fp, e->uri, out[i].path_len, tmp);
+        offset += out[i].path_len;
+
+        mime = e->flags & MG_ARCHIVE_DIRECTORY ? "" :
+            mg_get_builtin_mime_type(e->uri);
+        out[i].mime_offset = offset;
+        out[i].mime_len = strlen(mime);
+        write_all(fp, mime, out[i].mime_len, tmp);
+        offset += out[i].mime_len;
+    }
+
+    // Bodies. Each file is stored once, gzipped variants point to the
+    // body of the .gz entry.
+    for (i = 0; i < num_entries; i++) {
+        e = &entries[i];
+        if (e->fs_path != NULL) {
+            offset = align(fp, offset, 8, tmp);
+            e->data_offset = offset;
+            offset = copy_file(fp, e->fs_path, offset, tmp);
+            if (offset - e->data_offset != (uint64_t) e->st.st_size) {
+                die("%s changed while packing", e->fs_path);
+            }
+        }
+    }
+
+    for (i = 0; i < num_entries; i++) {
+        e = &entries[i];
+        out[i].flags = e->flags;
+        out[i].mtime = e->st.st_mtime;
+        strftime(out[i].last_modified, sizeof(out[i].last_modified),
+                 "%a, %d %b %Y %H:%M:%S GMT", gmtime(&e->st.st_mtime));
+        if (e->fs_path != NULL) {
+            out[i].data_offset = e->data_offset;
+            out[i].data_size = e->st.st_size;
+            set_etag(out[i].etag, sizeof(out[i].etag), &e->st);
+        }
+        if (e->gz >= 0) {
+            out[i].gz_offset = entries[e->gz].data_offset;
+            out[i].gz_size = entries[e->gz].st.st_size;
+            set_etag(out[i].gz_etag, sizeof(out[i].gz_etag), &entries[e->gz].st);
+        }
+    }
+
+    rewind(fp);
+    write_all(fp, &hdr, sizeof(hdr), tmp);
+    write_all(fp, seeds, hdr.num_buckets * sizeof(uint32_t), tmp);
+    write_all(fp, slots, hdr.num_slots * sizeof(uint32_t), tmp);
+    align(fp, hdr.slots_offset + hdr.num_slots * sizeof(uint32_t), 8, tmp);
+    write_all(fp, out, num_entries * sizeof(*out), tmp);
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0 || fclose(fp) != 0) {
+        die_errno("write", tmp);
+    } else if (rename(tmp, path) != 0) {
+        die_errno("rename", tmp);
+    }
+
+    free(seeds);
+    free(slots);
+    free(out);
+}
+
+void die(const char *fmt, ...) {
+    va_list ap;
+
+    fprintf(stderr, "mgpack: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    char dir[PATH_MAX];
+    struct visit root;
+    struct stat st;
+    size_t len;
+
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s <directory> <archive> [<mime_types_file>]\n"
+                "MIME types are stored in the archive: the server's "
+                "mime_types_file\noption does not apply to it, give the "
+                "same file here.\n", argv[0]);
+        return EXIT_FAILURE;
+    } else if (argc == 4 && !mg_load_mime_types(argv[3])) {
+        die_errno("mg_load_mime_types", argv[3]);
+    }
+
+    mg_strlcpy(dir, argv[1], sizeof(dir));
+    len = strlen(dir);
+    while (len > 1 && dir[len - 1] == '/') {
+        dir[--len] = '\0';
+    }
+
+    if (stat(dir, &st) != 0) {
+        die_errno("stat", dir);
+    }
+    root.parent = NULL;
+    root.dev = st.st_dev;
+    root.ino = st.st_ino;
+    scan(dir, "", &root);
+    pair_gzipped();
+    write_archive(argv[2]);
+    printf("%s: %d entries\n", argv[2], num_entries);
+
+    return EXIT_SUCCESS;
+}
@@ -48,22 +48,163 @@ const struct mime_type builtin_mime_types[] = {
     {".avi", 4, "video/x-msvideo"},
     {".bmp", 4, "image/bmp"},
     {".ttf", 4, "application/x-font-ttf"},
+    {".woff", 5, "font/woff"},
+    {".woff2", 6, "font/woff2"},
+    {".wasm", 5, "application/wasm"},
+    {".webp", 5, "image/webp"},
+    {".avif", 5, "image/avif"},
     {NULL,  0, NULL}
 };
 
-const char *mg_get_builtin_mime_type(const char *path) {
-    const char *ext;
-    size_t i, path_len;
+// Extensions are looked up in an open addressing hash table, keyed by
+// the lowercase extension without the dot. It is filled with the types
+// above on first use, and extended by mg_load_mime_types() at startup,
+// before any worker runs; after that it is only read.
+
+#define MAX_EXT_LEN 16
+
+struct mime_slot {
+    char ext[MAX_EXT_LEN];      // Lowercase, "" for a free slot
+    const char *mime_type;
+};
+
+static struct {
+    struct mime_slot *slots;
+    unsigned int size;          // Power of two
+    unsigned int count;
+} table;
+
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+// Lowercase the extension of the path's last component into buf.
+// Return its length, or 0 if there is none or it is too long.
+static size_t get_extension(const char *path, size_t path_len, char *buf) {
+    const char *p = path + path_len;
+    size_t i, len;
+
+    while (p > path && p[-1] != '.' && p[-1] != '/') {
+        p--;
+    }
+    if (p == path || p[-1] != '.' || (len = path + path_len - p) == 0 ||
+        len >= MAX_EXT_LEN) {
+        return 0;
+    }
+    for (i = 0; i < len; i++) {
+        buf[i] = (char) tolower(* (const unsigned char *) &p[i]);
+    }
+    buf[len] = '\0';
+
+    return len;
+}
+
+static struct mime_slot *find_slot(struct mime_slot *slots, unsigned int size,
+                                   const char *ext, size_t len) {
+    unsigned int i = mg_hash(ext, len) & (size - 1);
+
+    while (slots[i].ext[0] != '\0' && strcmp(slots[i].ext, ext) != 0) {
+        i = (i + 1) & (size - 1);
+    }
+
+    return &slots[i];
+}
+
+// Add a type. An existing type is replaced only if replace is set.
+// Return 0 on OOM.
+static int set_mime_type(const char *ext, size_t len, const char *mime_type,
+                         int replace) {
+    struct mime_slot *slots, *slot;
+    unsigned int i, size;
+
+    // Keep load factor under 1/2, so that probe sequences stay short
+    if (table.count * 2 >= table.size) {
+        size = table.size == 0 ? 128 : table.size * 2;
+        if ((slots = (struct mime_slot *) calloc(size, sizeof(*slots))) == NULL) {
+            return 0;
+        }
+        for (i = 0; i < table.size; i++) {
+            if (table.slots[i].ext[0] != '\0') {
+                *find_slot(slots, size, table.slots[i].ext,
+                           strlen(table.slots[i].ext)) = table.slots[i];
+            }
+        }
+        free(table.slots);
+        table.slots = slots;
+        table.size = size;
+    }
+
+    slot = find_slot(table.slots, table.size, ext, len);
+    if (slot->ext[0] == '\0') {
+        memcpy(slot->ext, ext, len + 1);
+        slot->mime_type = mime_type;
+        table.count++;
+    } else if (replace) {
+        slot->mime_type = mime_type;
+    }
+
+    return 1;
+}
 
-    path_len = strlen(path);
+static void init_table(void) {
+    char ext[MAX_EXT_LEN];
+    size_t i, len;
 
     for (i = 0; builtin_mime_types[i].extension != NULL; i++) {
-        ext = path + (path_len - builtin_mime_types[i].ext_len);
-        if (path_len > builtin_mime_types[i].ext_len &&
-            mg_strcasecmp(ext, builtin_mime_types[i].extension) == 0) {
-            return builtin_mime_types[i].mime_type;
+        len = get_extension(builtin_mime_types[i].extension,
+                            builtin_mime_types[i].ext_len, ext);
+        // Same as the old linear scan, the first match wins
+        if (len > 0) {
+            set_mime_type(ext, len, builtin_mime_types[i].mime_type, 0);
         }
     }
+}
+
+// Add types from a mime.types file: "type ext ext ..." per line, with
+// # comments. These override the builtin types. Return 0 if the file
+// cannot be read.
+int mg_load_mime_types(const char *path) {
+    char line[1024], name[MAX_EXT_LEN + 1], ext[MAX_EXT_LEN];
+    char *mime_type, *word, *save;
+    FILE *fp;
+    size_t len;
+
+    (void) pthread_once(&table_once, init_table);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if ((word = strchr(line, '#')) != NULL) {
+            *word = '\0';
+        }
+        if ((word = strtok_r(line, " \t\r\n", &save)) == NULL ||
+            (mime_type = mg_strdup(word)) == NULL) {
+            continue;
+        }
+        while ((word = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            // get_extension() wants a file name, not a bare extension
+            len = (size_t) mg_snprintf(name, sizeof(name), ".%s", word);
+            if (len < sizeof(name) &&
+                (len = get_extension(name, len, ext)) > 0) {
+                set_mime_type(ext, len, mime_type, 1);
+            }
+        }
+    }
+    fclose(fp);
+
+    return 1;
+}
+
+const char *mg_get_builtin_mime_type(const char *path) {
+    const struct mime_slot *slot;
+    char ext[MAX_EXT_LEN];
+    size_t len;
+
+    (void) pthread_once(&table_once, init_table);
+    if ((len = get_extension(path, strlen(path), ext)) > 0 &&
+        table.size > 0 &&
+        (slot = find_slot(table.slots, table.size, ext, len))->ext[0] != '\0') {
+        return slot->mime_type;
+    }
 
     return "text/plain";
 }
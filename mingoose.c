@@ -18,9 +18,23 @@ struct mg_connection *create_fake_connection(struct mg_context *ctx) {
 
 int mg_stat(const char *path, struct file *filep) {
     struct stat st;
+    struct file_cache_ticket ticket;
+    int found, is_link;
+
+    if (file_cache_lookup(path, filep, &ticket)) {
+        return filep->modification_time != (time_t) 0;
+    }
+
+    // Links are followed, but the watcher only reports changes of the
+    // link itself, not of its target: results for links are not cached.
+    // Paths under a symlinked directory are not covered by the watcher.
+    found = lstat(path, &st) == 0;
+    if ((is_link = found && S_ISLNK(st.st_mode)) != 0) {
+        found = stat(path, &st) == 0;
+    }
 
     filep->modification_time = (time_t) 0;
-    if (stat(path, &st) == 0) {
+    if (found) {
         filep->size = st.st_size;
         filep->modification_time = st.st_mtime;
         filep->is_directory = S_ISDIR(st.st_mode);
@@ -32,11 +46,16 @@ int mg_stat(const char *path, struct file *filep) {
             filep->modification_time = (time_t) 1;
         }
     }
+    if (is_link) {
+        file_cache_abandon(path, &ticket);
+    } else {
+        file_cache_store(path, filep, &ticket);
+    }
 
     return filep->modification_time != (time_t) 0;
 }
 
-static void set_close_on_exec(int fd) {
+void set_close_on_exec(int fd) {
     fcntl(fd, F_SETFD, FD_CLOEXEC);
 }
 
@@ -71,11 +90,6 @@ static int set_non_blocking_mode(SOCKET sock) {
 //-- end of src/unix.c --
 //-- src/mingoose.c --
 
-// Return number of bytes left to read for this connection
-int64_t left_to_read(const struct mg_connection *conn) {
-    return conn->content_len + conn->request_len - conn->num_bytes_read;
-}
-
 int call_user(int type, struct mg_connection *conn, void *p) {
     if (conn != NULL && conn->ctx != NULL) {
         conn->event.user_data = conn->ctx->user_data;
@@ -104,10 +118,10 @@ const char *mg_version(void) {
 // set up, for example if request parsing failed.
 static int should_keep_alive(const struct mg_connection *conn) {
     const char *http_version = conn->request_info.http_version;
-    const char *header = mg_get_header(conn, "Connection");
+    const char *header = mg_get_known_header(conn, MG_HEADER_CONNECTION);
     if (conn->must_close ||
         conn->status_code == 401 ||
-        mg_strcasecmp(conn->ctx->config[op("enable_keep_alive")], "yes") != 0 ||
+        !conn->cfg->enable_keep_alive ||
         (header != NULL && mg_strcasecmp(header, "keep-alive") != 0) ||
         (header == NULL && http_version && strcmp(http_version, "1.1"))) {
         return 0;
@@ -173,41 +187,42 @@ int pull(FILE *fp, struct mg_connection *conn, char *buf, int len) {
 }
 
 
+// Sleep while a throttled connection waits for bandwidth. The worker
+// stays busy meanwhile, see throttle.c. Return 0 if the client went
+// away.
+static int throttle_wait(struct mg_connection *conn, int ms) {
+    struct pollfd pfd;
+
+    pfd.fd = conn->client.sock;
+    pfd.events = 0;     // Errors and hangups are reported anyway
+    pfd.revents = 0;
+    return poll(&pfd, 1, ms) <= 0 || !(pfd.revents & (POLLHUP | POLLERR));
+}
+
 int mg_write(struct mg_connection *conn, const void *buf, int len) {
-    time_t now;
-    int64_t n, total, allowed;
+    int64_t n, total = 0, allowed;
+    int wait_ms;
 
-    if (conn->throttle > 0) {
-        if ((now = time(NULL)) != conn->last_throttle_time) {
-            conn->last_throttle_time = now;
-            conn->last_throttle_bytes = 0;
-        }
-        allowed = conn->throttle - conn->last_throttle_bytes;
-        if (allowed > (int64_t) len) {
-            allowed = len;
-        }
-        if ((total = push(NULL, conn->client.sock, conn->ssl, (const char *) buf,
-                          (int64_t) allowed)) == allowed) {
-            buf = (char *) buf + total;
-            conn->last_throttle_bytes += total;
-            while (total < (int64_t) len && conn->ctx->stop_flag == 0) {
-                allowed = conn->throttle > (int64_t) len - total ?
-                    (int64_t) len - total : conn->throttle;
-                if ((n = push(NULL, conn->client.sock, conn->ssl, (const char *) buf,
-                              (int64_t) allowed)) != allowed) {
-                    break;
-                }
-                sleep(1);
-                conn->last_throttle_bytes = allowed;
-                conn->last_throttle_time = time(NULL);
-                buf = (char *) buf + n;
-                total += n;
+    if (!throttle_is_active(conn)) {
+        return (int) push(NULL, conn->client.sock, conn->ssl,
+                          (const char *) buf, (int64_t) len);
+    }
+
+    while (total < (int64_t) len && conn->ctx->stop_flag == 0) {
+        if ((allowed = throttle_take(conn, (int64_t) len - total,
+                                     &wait_ms)) == 0) {
+            if (!throttle_wait(conn, wait_ms)) {
+                break;
             }
+            continue;
         }
-    } else {
-        total = push(NULL, conn->client.sock, conn->ssl, (const char *) buf,
-                     (int64_t) len);
+        if ((n = push(NULL, conn->client.sock, conn->ssl,
+                      (const char *) buf + total, allowed)) != allowed) {
+            return total > 0 || n > 0 ? (int) (total + (n > 0 ? n : 0)) : (int) n;
+        }
+        total += n;
     }
+
     return (int) total;
 }
 
@@ -344,11 +359,9 @@ void mg_url_encode(const char *src, char *dst, size_t dst_len) {
 }
 
 
+// Passwords file and hide_files_patterns, compiled into one pattern
 int must_hide_file(struct mg_connection *conn, const char *path) {
-    const char *pw_pattern = "**" PASSWORDS_FILE_NAME "$";
-    const char *pattern = conn->ctx->config[op("hide_files_patterns")];
-    return match_prefix(pw_pattern, strlen(pw_pattern), path) > 0 ||
-        (pattern != NULL && match_prefix(pattern, strlen(pattern), path) > 0);
+    return mg_glob_match(conn->cfg->hide_glob, path) > 0;
 }
 
 
@@ -373,144 +386,6 @@ void fclose_on_exec(FILE *fp) {
     }
 }
 
-FILE *mg_upload(struct mg_connection *conn, const char *destination_dir,
-                char *path, int path_len) {
-    const char *content_type_header, *boundary_start;
-    char *buf, fname[1024], boundary[100], *s;
-    int bl, n, i, j, headers_len, boundary_len, eof, buf_len, to_read, len = 0;
-    FILE *fp;
-
-    // Request looks like this:
-    //
-    // POST /upload HTTP/1.1
-    // Host: 127.0.0.1:8080
-    // Content-Length: 244894
-    // Content-Type: multipart/form-data; boundary=----WebKitFormBoundaryRVr
-    //
-    // ------WebKitFormBoundaryRVr
-    // Content-Disposition: form-data; name="file"; filename="accum.png"
-    // Content-Type: image/png
-    //
-    //  <89>PNG
-    //  <PNG DATA>
-    // ------WebKitFormBoundaryRVr
-
-    // Extract boundary string from the Content-Type header
-    if ((content_type_header = mg_get_header(conn, "Content-Type")) == NULL ||
-        (boundary_start = mg_strcasestr(content_type_header,
-                                        "boundary=")) == NULL ||
-        (sscanf(boundary_start, "boundary=\"%99[^\"]\"", boundary) == 0 &&
-         sscanf(boundary_start, "boundary=%99s", boundary) == 0) ||
-        boundary[0] == '\0') {
-        return NULL;
-    }
-
-    boundary_len = strlen(boundary);
-    bl = boundary_len + 4;  // \r\n--<boundary>
-
-    //                     buf
-    // conn->buf            |<--------- buf_len ------>|
-    //    |=================|==========|===============|
-    //    |<--request_len-->|<--len--->|               |
-    //    |<-----------data_len------->|      conn->buf + conn->buf_size
-
-    buf = conn->buf + conn->request_len;
-    buf_len = conn->buf_size - conn->request_len;
-    len = conn->data_len - conn->request_len;
-
-    for (;;) {
-        // Pull in headers
-        assert(len >= 0 && len <= buf_len);
-        to_read = buf_len - len;
-        if (to_read > left_to_read(conn)) {
-            to_read = (int) left_to_read(conn);
-        }
-        while (len < buf_len &&
-               (n = pull(NULL, conn, buf + len, to_read)) > 0) {
-            len += n;
-        }
-        if ((headers_len = get_request_len(buf, len)) <= 0) {
-            break;
-        }
-
-        // Fetch file name.
-        fname[0] = '\0';
-        for (i = j = 0; i < headers_len; i++) {
-            if (buf[i] == '\r' && buf[i + 1] == '\n') {
-                buf[i] = buf[i + 1] = '\0';
-                // TODO(lsm): don't expect filename to be the 3rd field,
-                // parse the header properly instead.
-                sscanf(&buf[j], "Content-Disposition: %*s %*s filename=\"%1023[^\"]",
-                       fname);
-                j = i + 2;
-            }
-        }
-
-        // Give up if the headers are not what we expect
-        if (fname[0] == '\0') {
-            break;
-        }
-
-        // Move data to the beginning of the buffer
-        assert(len >= headers_len);
-        memmove(buf, &buf[headers_len], len - headers_len);
-        len -= headers_len;
-        conn->data_len = conn->request_len + len;
-
-        // We open the file with exclusive lock held. This guarantee us
-        // there is no other thread can save into the same file simultaneously.
-        fp = NULL;
-
-        // Construct destination file name. Do not allow paths to have slashes.
-        if ((s = strrchr(fname, '/')) == NULL &&
-            (s = strrchr(fname, '\\')) == NULL) {
-            s = fname;
-        }
-
-        // Open file in binary mode. TODO: set an exclusive lock.
-        snprintf(path, path_len, "%s/%s", destination_dir, s);
-        if ((fp = fopen(path, "wb")) == NULL) {
-            break;
-        }
-
-        // Read POST data, write into file until boundary is found.
-        eof = n = 0;
-        do {
-            len += n;
-            for (i = 0; i < len - bl; i++) {
-                if (!memcmp(&buf[i], "\r\n--", 4) &&
-                    !memcmp(&buf[i + 4], boundary, boundary_len)) {
-                    // Found boundary, that's the end of file data.
-                    fwrite(buf, 1, i, fp);
-                    eof = 1;
-                    memmove(buf, &buf[i + bl], len - (i + bl));
-                    len -= i + bl;
-                    break;
-                }
-            }
-            if (!eof && len > bl) {
-                fwrite(buf, 1, len - bl, fp);
-                memmove(buf, &buf[len - bl], bl);
-                len = bl;
-            }
-            to_read = buf_len - len;
-            if (to_read > left_to_read(conn)) {
-                to_read = (int) left_to_read(conn);
-            }
-        } while (!eof && (n = pull(NULL, conn, buf + len, to_read)) > 0);
-        conn->data_len = conn->request_len + len;
-
-        if (eof) {
-            rewind(fp);
-            return fp;
-        } else {
-            fclose(fp);
-        }
-    }
-
-    return NULL;
-}
-
 static void close_all_listening_sockets(struct mg_context *ctx) {
     closesocket(ctx->listening_socket_fd);
 }
@@ -652,6 +527,7 @@ static void close_connection(struct mg_connection *conn) {
 
 void mg_close_connection(struct mg_connection *conn) {
     close_connection(conn);
+    free(conn->multipart);
     free(conn);
 }
 
@@ -663,16 +539,21 @@ static int is_valid_uri(const char *uri) {
 
 static void process_new_connection(struct mg_connection *conn) {
     struct mg_request_info *ri = &conn->request_info;
-    int keep_alive_enabled, keep_alive, discard_len;
+    int keep_alive, discard_len;
     char ebuf[100];
 
-    keep_alive_enabled = !strcmp(conn->ctx->config[op("enable_keep_alive")], "yes");
     keep_alive = 0;
 
     // Important: on new connection, reset the receiving buffer. Credit goes
     // to crule42.
+    conn->buf = conn->buf_base;
+    conn->buf_size = MAX_REQUEST_SIZE;
     conn->data_len = 0;
+    conn->ra_window = 0;
     do {
+        // Options stay the same until the request is done
+        conn->cfg = config_acquire(conn->ctx);
+
         if (!getreq(conn, ebuf, sizeof(ebuf))) {
             response_error(conn, 500, "Server Error", "%s", ebuf);
             conn->must_close = 1;
@@ -701,18 +582,30 @@ static void process_new_connection(struct mg_connection *conn) {
         // is using parsed request, which will be invalid after memmove's below.
         // Therefore, memorize should_keep_alive() result now for later use
         // in loop exit condition.
-        keep_alive = conn->ctx->stop_flag == 0 && keep_alive_enabled &&
+        keep_alive = conn->ctx->stop_flag == 0 &&
             conn->content_len >= 0 && should_keep_alive(conn);
 
-        // Discard all buffered data for this request
-        discard_len = conn->content_len >= 0 && conn->request_len > 0 &&
-            conn->request_len + conn->content_len < (int64_t) conn->data_len ?
-            (int) (conn->request_len + conn->content_len) : conn->data_len;
+        // Discard all buffered data for this request. Pipelined data is
+        // not moved, the next request starts where it is. If the end of
+        // a chunked body was not read, the next request is not found.
+        if ((discard_len = body_buffered_len(conn)) < 0) {
+            keep_alive = 0;
+            discard_len = conn->data_len;
+        }
         assert(discard_len >= 0);
-        memmove(conn->buf, conn->buf + discard_len, conn->data_len - discard_len);
         conn->data_len -= discard_len;
+        if (conn->data_len == 0) {
+            conn->buf = conn->buf_base;
+            conn->buf_size = MAX_REQUEST_SIZE;
+        } else {
+            conn->buf += discard_len;
+            conn->buf_size -= discard_len;
+        }
         assert(conn->data_len >= 0);
         assert(conn->data_len <= conn->buf_size);
+
+        config_release(conn->cfg);
+        conn->cfg = NULL;
     } while (keep_alive);
 }
 
@@ -750,12 +643,14 @@ static void *callback_worker_thread(void *thread_func_param) {
     struct mg_context *ctx = (struct mg_context *) thread_func_param;
     struct mg_connection *conn;
 
-    conn = (struct mg_connection *) calloc(1, sizeof(*conn) + MAX_REQUEST_SIZE);
+    // Receive buffer, then the area parsed requests are copied to
+    conn = (struct mg_connection *) calloc(1, sizeof(*conn) + 2 * MAX_REQUEST_SIZE);
     if (conn == NULL) {
         cry(create_fake_connection(ctx), "%s", "Cannot create new connection struct, OOM");
     } else {
         conn->buf_size = MAX_REQUEST_SIZE;
-        conn->buf = (char *) (conn + 1);
+        conn->buf = conn->buf_base = (char *) (conn + 1);
+        conn->request_strings = conn->buf_base + MAX_REQUEST_SIZE;
         conn->ctx = ctx;
         conn->event.user_data = ctx->user_data;
 
@@ -781,6 +676,8 @@ static void *callback_worker_thread(void *thread_func_param) {
             close_connection(conn);
         }
         call_user(MG_THREAD_END, conn, NULL);
+        free(conn->io_buf);
+        free(conn->multipart);
         free(conn);
     }
 
@@ -827,6 +724,7 @@ static int set_sock_timeout(SOCKET sock, int milliseconds) {
 static void accept_new_connection(const SOCKET sock,
                                   struct mg_context *ctx) {
     struct socket so;
+    struct config *cfg;
     socklen_t len = sizeof(so.rsa);
     int on = 1;
 
@@ -845,7 +743,9 @@ static void accept_new_connection(const SOCKET sock,
         // is down and will close the server end.
         // Thanks to Igor Klopov who suggested the patch.
         setsockopt(so.sock, SOL_SOCKET, SO_KEEPALIVE, (void *) &on, sizeof(on));
-        set_sock_timeout(so.sock, atoi(ctx->config[op("request_timeout_ms")]));
+        cfg = config_acquire(ctx);
+        set_sock_timeout(so.sock, cfg->request_timeout_ms);
+        config_release(cfg);
         produce_socket(ctx, &so);
     }
 }
@@ -853,6 +753,7 @@ static void accept_new_connection(const SOCKET sock,
 static void *callback_master_thread(void *thread_func_param) {
     struct mg_context *ctx = (struct mg_context *) thread_func_param;
     struct pollfd *pfd;
+    time_t last_tick = 0;
 
 #if defined(ISSUE_317)
     struct sched_param sched_param;
@@ -864,6 +765,13 @@ static void *callback_master_thread(void *thread_func_param) {
 
     pfd = (struct pollfd *) calloc(1, sizeof(pfd[0]));
     while (pfd != NULL && ctx->stop_flag == 0) {
+            if (time(NULL) != last_tick) {
+                last_tick = time(NULL);
+                if (ctx->archive != NULL) {
+                    mg_archive_check_reload(ctx);
+                }
+                upload_reap(last_tick);
+            }
             pfd[0].fd = ctx->listening_socket_fd;
             pfd[0].events = POLLIN;
 
@@ -921,6 +829,8 @@ void free_context(struct mg_context *ctx) {
         }
     }
 
+    config_release(ctx->cfg);
+
     // Deallocate context itself
     free(ctx);
 }
@@ -950,6 +860,8 @@ static void signal_handler(int sig_num) {
     // fails if SIGCHLD is ignored, making system() non-functional.
     if (sig_num == SIGCHLD) {
         do {} while (waitpid(-1, &sig_num, WNOHANG) > 0);
+    } else if (sig_num == SIGHUP) {
+        reload_flag = 1;
     } else { exit_flag = sig_num; }
 }
 
@@ -1002,6 +914,7 @@ int main(int argc, char *argv[]) {
     signal(SIGTERM, signal_handler);
     signal(SIGINT, signal_handler);
     signal(SIGCHLD, signal_handler);
+    signal(SIGHUP, signal_handler);
 
     // Allocate context and initialize reasonable general case defaults.
     // TODO(lsm): do proper error handling here.
@@ -1012,6 +925,9 @@ int main(int argc, char *argv[]) {
     ctx->user_data = NULL;
 
     set_options(ctx, argv);
+    if (!config_load(ctx)) {
+        die("%s", "Failed to start Mongoose.");
+    }
 
     // NOTE(lsm): order is important here. SSL certificates must
     // be initialized before listening ports. UID must be set last.
@@ -1030,6 +946,35 @@ int main(int argc, char *argv[]) {
     (void) pthread_cond_init(&ctx->cond, NULL);
     (void) pthread_cond_init(&ctx->sq_empty, NULL);
     (void) pthread_cond_init(&ctx->sq_full, NULL);
+    (void) pthread_mutex_init(&ctx->archive_mutex, NULL);
+
+    if (ctx->settings.mime_types_file != NULL &&
+        !mg_load_mime_types(ctx->settings.mime_types_file)) {
+        die("Cannot load mime_types_file [%s]: %s",
+            ctx->settings.mime_types_file, strerror(ERRNO));
+    }
+
+    if (ctx->settings.document_archive != NULL) {
+        mg_archive_check_reload(ctx);
+        if (ctx->archive == NULL) {
+            die("Cannot load document_archive [%s]",
+                ctx->settings.document_archive);
+        }
+    }
+
+    // Listings check directory mtime, the watcher only makes them fresher
+    dir_cache_init();
+
+    // Caches are only enabled if the watcher can keep them fresh
+    if (!mg_strcasecmp(ctx->settings.enable_file_cache, "yes")) {
+        file_cache_init();
+        resolve_cache_init();
+        mg_watch_start(ctx);
+    }
+
+    io_pool_start(ctx);
+    trash_start(ctx);
+    upload_start(ctx);
 
     // Start master (listening) thread
     mg_start_thread(callback_master_thread, ctx);
@@ -1052,6 +997,11 @@ int main(int argc, char *argv[]) {
     //enter into endless loop
     while (exit_flag == 0) {
         sleep(1);
+        if (reload_flag) {
+            reload_flag = 0;
+            printf("%s\n", config_load(ctx) ? "Configuration reloaded" :
+                   "Cannot reload configuration, keeping the current one");
+        }
     }
     printf("Exiting on signal[%d], waiting for all threads to finish...",
            exit_flag);
@@ -19,6 +19,7 @@
 #define  MONGOOSE_HEADER_INCLUDED
 
 #define _XOPEN_SOURCE 600  // For PATH_MAX on linux
+#define _GNU_SOURCE        // For d_type and other Linux extensions
 
 #include <stdio.h>
 #include <stddef.h>
@@ -57,10 +58,35 @@
 
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
 
+// Length-delimited string, not NUL-terminated
+struct vec {
+    const char *ptr;
+    size_t len;
+};
+
+// Request methods, classified by the parser
+enum mg_method {
+    MG_METHOD_UNKNOWN, MG_METHOD_GET, MG_METHOD_HEAD, MG_METHOD_POST,
+    MG_METHOD_PUT, MG_METHOD_DELETE, MG_METHOD_OPTIONS, MG_METHOD_CONNECT
+};
+
+// Headers the server looks at. The parser records the first value of
+// each of them, so they are found without scanning http_headers.
+enum mg_known_header {
+    MG_HEADER_ACCEPT_ENCODING, MG_HEADER_AUTHORIZATION, MG_HEADER_CONNECTION,
+    MG_HEADER_CONTENT_LENGTH, MG_HEADER_CONTENT_RANGE, MG_HEADER_CONTENT_TYPE,
+    MG_HEADER_EXPECT, MG_HEADER_IF_MODIFIED_SINCE, MG_HEADER_IF_NONE_MATCH,
+    MG_HEADER_RANGE, MG_HEADER_REFERER, MG_HEADER_TRANSFER_ENCODING,
+    MG_HEADER_USER_AGENT,
+    MG_NUM_KNOWN_HEADERS
+};
+
 // This structure contains information about the HTTP request.
 struct mg_request_info {
     const char *request_method; // "GET", "POST", etc
+    int method;                 // enum mg_method
     const char *uri;            // URL-decoded URI
+    struct vec raw_uri;         // URI as received, without query string
     const char *http_version;   // E.g. "1.0", "1.1"
     const char *query_string;   // URL part after '?', not including '?', or NULL
     const char *remote_user;    // Authenticated user, or NULL if no auth used
@@ -73,12 +99,14 @@ struct mg_request_info {
         const char *name;         // HTTP header name
         const char *value;        // HTTP header value
     } http_headers[64];         // Maximum 64 headers
+    const char *known_headers[MG_NUM_KNOWN_HEADERS];  // Values, or NULL
 };
 
 int parse_http_message(char *buf, int len, struct mg_request_info *ri);
 int get_request_len(const char *buf, int buf_len);
 
 void mg_strlcpy(register char *dst, register const char *src, size_t n);
+unsigned int mg_hash(const char *s, size_t len);
 char * mg_strndup(const char *ptr, size_t len);
 char * mg_strdup(const char *str);
 
@@ -151,6 +179,14 @@ int mg_modify_passwords_file(const char *passwords_file_name,
                              const char *password);
 int mg_write(struct mg_connection *, const void *buf, int len);
 
+// Read data from the remote end, return number of bytes read.
+// Chunked request bodies are decoded.
+// Return:
+//   0     request body has been read completely
+//   <0    connection closed or malformed body
+//   >0    number of bytes read into the buffer
+int mg_read(struct mg_connection *, void *buf, int len);
+
 // Macros for enabling compiler-specific checks for printf-like arguments.
 #undef PRINTF_FORMAT_STRING
 #define PRINTF_FORMAT_STRING(s) s
@@ -174,6 +210,7 @@ int mg_printf(struct mg_connection *,
 // and if the header is present in the array, returns its value. If it is
 // not present, NULL is returned.
 const char *mg_get_header(const struct mg_connection *, const char *name);
+const char *mg_get_known_header(const struct mg_connection *, int header);
 
 
 // Get a value of particular form variable.
@@ -239,6 +276,34 @@ struct mg_connection *mg_download(const char *host, int port, int use_ssl,
 void mg_close_connection(struct mg_connection *conn);
 
 
+// Part of a multipart/form-data body.
+struct mg_part {
+    const char *name;           // Form field name, or ""
+    const char *filename;       // File name as sent, or NULL
+    const char *content_type;   // Content-Type of the part, or NULL
+    int num_headers;
+    struct mg_header headers[16];
+};
+
+// Callbacks of mg_parse_multipart(). Each returns 1 to go on, or 0 to
+// stop parsing. Any of them may be NULL.
+struct mg_multipart_handler {
+    int (*part_begin)(const struct mg_part *, void *user_data);
+    // Data of the part, in as many slices as it takes
+    int (*part_data)(const struct mg_part *, const char *data, int len,
+                     void *user_data);
+    int (*part_end)(const struct mg_part *, void *user_data);
+};
+
+// Parse multipart/form-data request body, calling the handler for every
+// part. buf_size is the size of the read buffer, 0 for the default.
+// If a callback stops the parsing, the next call for the same request
+// goes on where it stopped, with what the parser had read ahead.
+// Return: number of parts parsed to their end, or -1 on error.
+int mg_parse_multipart(struct mg_connection *conn,
+                       const struct mg_multipart_handler *handler,
+                       void *user_data, int buf_size);
+
 // Read multipart-form-data POST buffer, save uploaded files into
 // destination directory, and return path to the saved filed.
 // This function can be called multiple times for the same connection,
@@ -258,6 +323,9 @@ int mg_start_thread(mg_thread_func_t f, void *p);
 // For unrecognized extensions, "text/plain" is returned.
 const char *mg_get_builtin_mime_type(const char *file_name);
 
+// Add types from a mime.types style file. Return 0 on error.
+int mg_load_mime_types(const char *path);
+
 
 // Return Mongoose version.
 const char *mg_version(void);
@@ -282,6 +350,7 @@ char *mg_md5(char buf[33], ...);
 
 #define MONGOOSE_VERSION "0.0.1"
 #define PASSWORDS_FILE_NAME ".htpasswd"
+#define PUT_TEMP_PREFIX ".mg-put-"     // PUT files being written, hidden
 #define CGI_ENVIRONMENT_SIZE 4096
 #define MAX_CGI_ENVIR_VARS 64
 #define MG_BUF_LEN 8192
@@ -356,11 +425,6 @@ union usa {
 
 
 // Describes a string (chunk of memory).
-struct vec {
-    const char *ptr;
-    size_t len;
-};
-
 struct file {
     int is_directory;
     time_t modification_time;
@@ -382,7 +446,7 @@ struct socket {
 
 
 // NOTE(lsm): this shoulds be in sync with the config_options.
-#define NUM_OPTIONS 17
+#define NUM_OPTIONS 25
 
 int op(const char *);
 
@@ -404,6 +468,59 @@ struct settings {
     char *url_rewrite_patterns;
     char *hide_files_patterns;
     char *request_timeout_ms;
+    char *enable_file_cache;
+    char *document_archive;
+    int  io_threads;
+    char *mime_types_file;
+    char *trash_directory;
+};
+
+// Bandwidth budget, see throttle.c.
+struct token_bucket {
+    pthread_mutex_t mutex;      // Shared buckets only
+    int refs;                   // Shared buckets only, by config snapshots
+    int64_t rate;               // Bytes per second
+    int64_t burst;              // Max tokens
+    double tokens;
+    int64_t refilled;           // Nanoseconds, CLOCK_MONOTONIC
+};
+
+// Compiled glob pattern, see glob.c.
+struct mg_glob;
+
+// Entry of a "pattern=value,..." option, e.g. url_rewrite_patterns.
+struct glob_rule {
+    struct vec pattern;
+    struct vec value;
+    struct mg_glob *glob;
+};
+
+struct config_pair {
+    struct vec name;
+    struct vec value;
+};
+
+// What is synced before a PUT is answered
+enum { PUT_FSYNC_NO, PUT_FSYNC_FILE, PUT_FSYNC_DIR };
+
+// Options used per request, compiled. Immutable once made current.
+struct config {
+    volatile int refs;
+    int enable_keep_alive;
+    int enable_directory_listing;
+    int request_timeout_ms;
+    int put_fsync;                      // PUT_FSYNC_*
+    const char *authentication_domain;
+    const char *put_delete_auth_file;   // Absolute path, or NULL
+    struct vec *index_files;
+    int num_index_files;
+    struct config_pair *protect_uri;    // URI prefix = passwords file
+    int num_protect_uri;
+    struct mg_glob *hide_glob;          // Passwords file and hide_files_patterns
+    struct glob_rule *rewrite_rules;
+    int num_rewrite_rules;
+    struct throttle *throttle;          // See throttle.c
+    char *values[NUM_OPTIONS];          // Option strings the above point into
 };
 
 struct mg_context {
@@ -425,6 +542,18 @@ struct mg_context {
     volatile int sq_tail;      // Tail of the socket queue
     pthread_cond_t sq_full;    // Signaled when socket is produced
     pthread_cond_t sq_empty;   // Signaled when socket is consumed
+
+    struct mg_archive *archive;     // Mapped document_archive, or NULL
+    pthread_mutex_t archive_mutex;  // Protects archive swaps
+
+    char **argv;                    // Command line, for reloads
+    struct config *volatile cfg;    // Current snapshot, see config.c
+    volatile int config_readers;    // Threads taking a snapshot reference
+};
+
+// States of the chunked body decoder
+enum {
+    CHUNK_SIZE = 1, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER, CHUNKS_DONE
 };
 
 struct mg_connection {
@@ -438,7 +567,14 @@ struct mg_connection {
     int64_t num_bytes_sent;     // Total bytes sent to client
     int64_t content_len;        // Content-Length header value
     int64_t num_bytes_read;     // Bytes read from a remote socket
-    char *buf;                  // Buffer for received data
+    int64_t body_read;          // Request body bytes returned by mg_read()
+    int body_consumed;          // Buffered bytes after the headers taken
+    int chunk_state;            // CHUNK_*, 0 if the body is not chunked
+    int64_t chunk_left;         // Bytes left in the current chunk
+    struct multipart *multipart;    // Parser stopped by a callback, or NULL
+    char *buf;                  // Received data, current request first
+    char *buf_base;             // Start of the buffer, buf may be past it
+    char *request_strings;      // Request components, copied from buf
     char *path_info;            // PATH_INFO part of the URL
     int must_close;             // 1 if connection must be closed
     int buf_size;               // Buffer size
@@ -446,8 +582,14 @@ struct mg_connection {
     int data_len;               // Total size of data in a buffer
     int status_code;            // HTTP reply status code, e.g. 200
     int throttle;               // Throttling, bytes/sec. <= 0 means no throttle
-    time_t last_throttle_time;  // Last time throttled data was sent
-    int64_t last_throttle_bytes;// Bytes sent this second
+    struct config *cfg;         // Options of the current request
+    struct token_bucket throttle_tokens;    // Of this connection
+    struct token_bucket *throttle_bucket;   // Shared by a network, or NULL
+    unsigned int ra_file;       // Hash of the file name last sent
+    int64_t ra_next;            // File offset after the last byte sent
+    int ra_window;              // Read size reached sending that file
+    char *io_buf;               // Two file read buffers, or NULL
+    int io_buf_size;            // Size of each of them
 };
 
 // Directory entry
@@ -463,8 +605,6 @@ struct mime_type {
     const char *mime_type;
 };
 
-char *skip_quoted(char **buf, const char *delimiters,
-                  const char *whitespace, char quotechar);
 
 int mg_stat(const char *path, struct file *filep);
 void response_error(struct mg_connection *, int, const char *,
@@ -474,6 +614,7 @@ void cry(struct mg_connection *conn,
          PRINTF_FORMAT_STRING(const char *fmt), ...) PRINTF_ARGS(2, 3);
 int getreq(struct mg_connection *conn, char *ebuf, size_t ebuf_len);
 int exit_flag;
+volatile sig_atomic_t reload_flag;
 struct mg_context *ctx;      // Set by start_mongoose()
 
 int lowercase(const char *s) ;
@@ -524,6 +665,8 @@ void die(const char *fmt, ...) ;
 void show_usage_and_exit(void) ;
 
 void set_options(struct mg_context * ctx, char *argv[]);
+int find_option(const char *name);
+int load_options(struct mg_context *ctx, char **config, char *argv[]);
 struct mg_connection *create_fake_connection(struct mg_context *ctx) ;
 void free_context(struct mg_context *ctx) ;
 const char *mg_get_builtin_mime_type(const char *path) ;
@@ -535,8 +678,8 @@ void gmt_time_string(char *buf, size_t buf_len, time_t *t) ;
 
 void construct_etag(char *buf, size_t buf_len,
                     const struct file *filep);
-void response_file(struct mg_connection *conn, const char *path,
-                   struct file *filep) ;
+struct resolution;
+void response_file(struct mg_connection *conn, const struct resolution *res);
 
 int must_hide_file(struct mg_connection *conn, const char *path) ;
 void mg_url_encode(const char *src, char *dst, size_t dst_len);
@@ -546,7 +689,210 @@ void response_directory_index(struct mg_connection *conn,
                               const char *dir) ;
 
 void dispatch_and_send_response(struct mg_connection *conn);
-int64_t left_to_read(const struct mg_connection *conn) ;
 int64_t push(FILE *fp, SOCKET sock, SSL *ssl, const char *buf, int64_t len);
+void set_close_on_exec(int fd);
+
+// Packed static asset archive, see archive.c and mgpack.c.
+#define MG_ARCHIVE_MAGIC "MGPACK01"
+#define MG_ARCHIVE_BYTE_ORDER 0x01020304U
+#define MG_ARCHIVE_NO_ENTRY 0xffffffffU
+#define MG_ARCHIVE_DIRECTORY 1    // Entry is a directory, no body
+#define MG_ARCHIVE_GZ_ONLY 2      // Entry only has the gzipped body
+
+struct mg_archive_header {
+    char magic[8];              // MG_ARCHIVE_MAGIC
+    uint32_t byte_order;        // MG_ARCHIVE_BYTE_ORDER
+    uint32_t num_entries;
+    uint32_t num_buckets;       // Number of displacement seeds
+    uint32_t num_slots;         // Size of the hash table
+    uint64_t seeds_offset;
+    uint64_t slots_offset;
+    uint64_t entries_offset;
+};
+
+struct mg_archive_entry {
+    uint64_t path_offset;       // URI path, e.g. "/css/main.css"
+    uint64_t mime_offset;       // MIME type
+    uint64_t data_offset;       // Body
+    uint64_t data_size;
+    uint64_t gz_offset;         // Precompressed body, if gz_size > 0
+    uint64_t gz_size;
+    int64_t mtime;
+    uint32_t path_len;
+    uint32_t mime_len;
+    uint32_t flags;             // MG_ARCHIVE_* flags
+    uint32_t reserved;
+    char etag[48];              // Etag of the body, quoted
+    char gz_etag[48];           // Etag of the precompressed body
+    char last_modified[48];     // Pre-rendered Last-Modified value
+};
+
+struct mg_archive {
+    int refs;                   // Protected by ctx->archive_mutex
+    const char *base;           // Mapped archive
+    uint64_t size;
+    const struct mg_archive_header *hdr;
+    const uint32_t *seeds;
+    const uint32_t *slots;
+    const struct mg_archive_entry *entries;
+    dev_t dev;                  // Identity of the mapped file, used to
+    ino_t ino;                  // notice that a new archive is deployed
+    time_t mtime;
+};
+
+uint32_t mg_archive_hash(const char *key, size_t len, uint32_t seed);
+struct mg_archive *mg_archive_open(const char *path);
+void mg_archive_close(struct mg_archive *arc);
+const struct mg_archive_entry *mg_archive_find(const struct mg_archive *arc,
+                                               const char *path, size_t len);
+struct mg_archive *mg_archive_acquire(struct mg_context *ctx);
+void mg_archive_release(struct mg_context *ctx, struct mg_archive *arc);
+void mg_archive_check_reload(struct mg_context *ctx);
+void response_archive(struct mg_connection *conn, struct mg_archive *arc);
+
+// File watcher, see watcher.c. Listeners are called with the changed
+// path, or with NULL if everything must be dropped.
+typedef void (*mg_watch_listener_t)(const char *path);
+int mg_watch_start(struct mg_context *ctx);
+void mg_watch_add_listener(mg_watch_listener_t listener);
+int mg_watch_is_active(void);
+int mg_watch_covers(const char *path, size_t len);
+
+void file_cache_init(void);
+void file_cache_invalidate(const char *path);
+
+// Issued by file_cache_lookup() on a miss, see file_cache_store().
+struct file_cache_ticket {
+    unsigned int generation;    // Cache generation at lookup time
+    int owner;                  // 1 if this thread fills the entry
+};
+
+// Reference counted body of a cached file.
+struct file_content {
+    int refs;
+    int64_t len;
+    char data[1];               // Allocated to hold the whole file
+};
+
+int file_cache_lookup(const char *path, struct file *filep,
+                      struct file_cache_ticket *ticket);
+void file_cache_store(const char *path, const struct file *filep,
+                      const struct file_cache_ticket *ticket);
+void file_cache_abandon(const char *path,
+                        const struct file_cache_ticket *ticket);
+struct file_content *file_cache_get_content(const char *path,
+                                            const struct file *filep);
+void file_content_release(struct file_content *content);
+
+// Snapshot of a directory, see dir_cache.c.
+#define DIR_SORT_ORDERS 8
+struct dir_entry {
+    size_t name_offset;         // Name is at names + name_offset
+    struct file file;
+};
+
+struct dir_listing {
+    int refs;
+    unsigned int hash;          // Hash of path
+    char *path;
+    size_t path_len;
+    dev_t dev;                  // Identity and version of the directory
+    ino_t ino;
+    struct timespec mtime;
+    time_t built;               // When the snapshot was taken
+    int num_entries;
+    struct dir_entry *entries;  // In readdir() order
+    char *names;                // Arena holding all names
+    int *orders[DIR_SORT_ORDERS];  // Sorted entry indices, lazily made
+};
+
+void dir_cache_init(void);
+void dir_cache_invalidate(const char *path);
+struct dir_listing *dir_listing_get(struct mg_connection *conn,
+                                    const char *dir);
+void dir_listing_release(struct dir_listing *l);
+int dir_sort_order(const char *query_string);
+const int *dir_listing_order(struct dir_listing *l, int order);
+
+// File read handed to the I/O pool, see io_pool.c.
+enum { IO_DONE, IO_QUEUED, IO_DEFERRED };
+struct io_request {
+    struct io_request *next;    // Next in the pool queue
+    int fd;
+    char *buf;
+    size_t len;
+    int64_t offset;
+    ssize_t result;             // pread() result, valid in IO_DONE state
+    volatile int state;         // IO_*
+};
+
+void io_pool_start(struct mg_context *ctx);
+void io_read_start(struct io_request *req, int fd, char *buf, size_t len,
+                   int64_t offset);
+ssize_t io_read_finish(struct io_request *req);
+
+// What dispatch_and_send_response() answers with, as far as it depends
+// on the URI and the filesystem only. Cached by resolve_cache.c.
+enum {
+    RESOLVED_NOT_FOUND,         // Missing or hidden file
+    RESOLVED_REDIRECT,          // Directory without trailing slash
+    RESOLVED_LISTING,           // Directory without index file
+    RESOLVED_FILE               // Serve file_path
+};
+
+struct resolution {
+    int kind;                   // RESOLVED_*
+    struct file file;           // Metadata of file_path
+    char path[PATH_MAX];        // File name the URI maps to
+    char file_path[PATH_MAX];   // Index file substituted, if any
+    const char *mime;           // Headers of file_path, for RESOLVED_FILE
+    char etag[64];
+    char last_modified[64];
+};
+
+void resolve_cache_init(void);
+void resolve_cache_invalidate(const char *path);
+int resolve_cache_lookup(const struct vec *raw, int gzip, char *uri,
+                         struct resolution *res, unsigned int *generation);
+void resolve_cache_store(const struct vec *raw, int gzip, const char *uri,
+                         const struct resolution *res,
+                         unsigned int generation);
+
+struct mg_glob *mg_glob_compile(const char *pattern, int len);
+int mg_glob_match(const struct mg_glob *g, const char *str);
+void mg_glob_free(struct mg_glob *g);
+int mg_glob_compile_rules(const char *list, struct glob_rule **rules,
+                          int *num_rules);
+void mg_glob_free_rules(struct glob_rule *rules, int num_rules);
+
+struct throttle *throttle_compile(const char *spec, const char *global,
+                                  const struct throttle *prev);
+void throttle_free(struct throttle *t);
+void set_throttle(struct mg_connection *conn, uint32_t remote_ip,
+                  const char *uri);
+int throttle_is_active(const struct mg_connection *conn);
+int64_t throttle_take(struct mg_connection *conn, int64_t len, int *wait_ms);
+
+int config_load(struct mg_context *ctx);
+struct config *config_acquire(struct mg_context *ctx);
+void config_release(struct config *cfg);
+
+int body_buffered_len(const struct mg_connection *conn);
+int body_splice(struct mg_connection *conn, int fd, int64_t offset);
+int body_expect(struct mg_connection *conn);
+
+int open_temp_file(const char *path, char *tmp, size_t tmp_len);
+int put_commit(struct mg_connection *conn, int fd, const char *tmp,
+               const char *path);
+int upload_parse_range(const char *header, int64_t *first, int64_t *last,
+                       int64_t *total);
+void upload_put(struct mg_connection *conn, const char *path,
+                int64_t first, int64_t last, int64_t total);
+void upload_reap(time_t now);
+void upload_start(struct mg_context *ctx);
+
+int remove_tree(struct mg_context *ctx, const char *path);
+int trash_move(struct mg_context *ctx, const char *path);
+void trash_start(struct mg_context *ctx);
 
 #endif // MONGOOSE_HEADER_INCLUDED
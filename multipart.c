@@ -0,0 +1,413 @@
+#include "mingoose.h"
+
+// Streaming multipart/form-data parser.
+//
+// The body is read with mg_read() into one buffer and parts are handed
+// to callbacks as they are found: headers first, then data in slices
+// pointing into the buffer, then the end of the part. Nothing is copied
+// but the part headers, and only the few bytes that could start a
+// delimiter are kept back when the buffer is refilled.
+//
+// Delimiters ("\r\n--" boundary) are searched with Boyer-Moore-Horspool:
+// the byte under the last delimiter position tells how far to skip, so
+// data is looked at in steps of about the delimiter length instead of
+// byte by byte.
+
+#if !defined(MULTIPART_BUF_SIZE)
+#define MULTIPART_BUF_SIZE 65536    // Default read buffer size
+#endif
+#define MULTIPART_HEADERS_SIZE 4096 // Max size of the headers of a part
+#define MAX_BOUNDARY_LEN 70         // RFC 2046
+
+enum { MP_PREAMBLE, MP_DELIMITER, MP_HEADERS, MP_DATA, MP_DONE };
+
+struct multipart {
+    const struct mg_multipart_handler *handler;
+    void *user_data;
+    unsigned char skip[256];        // Horspool shifts
+    char delim[MAX_BOUNDARY_LEN + 5];
+    int delim_len;
+    int state;
+    int pos, len, size;             // Parsed, buffered and buffer size
+    struct mg_part part;
+    char headers[MULTIPART_HEADERS_SIZE];
+    char buf[1];
+};
+
+// Extract boundary from the Content-Type header. Return 0 if not found.
+static int get_boundary(const struct mg_connection *conn, char *boundary) {
+    const char *content_type = mg_get_known_header(conn, MG_HEADER_CONTENT_TYPE),
+          *start;
+
+    boundary[0] = '\0';
+    if (content_type != NULL &&
+        (start = mg_strcasestr(content_type, "boundary=")) != NULL &&
+        sscanf(start, "boundary=\"%70[^\"]\"", boundary) == 0) {
+        sscanf(start, "boundary=%70[^ ;]", boundary);
+    }
+
+    return boundary[0] != '\0';
+}
+
+static void compile_delimiter(struct multipart *mp, const char *boundary) {
+    int i, last;
+
+    mp->delim_len = mg_snprintf(mp->delim, sizeof(mp->delim), "\r\n--%s",
+                                boundary);
+    last = mp->delim_len - 1;
+    memset(mp->skip, mp->delim_len, sizeof(mp->skip));
+    for (i = 0; i < last; i++) {
+        mp->skip[(unsigned char) mp->delim[i]] = (unsigned char) (last - i);
+    }
+}
+
+// Return offset of the first delimiter at or after pos, or -1.
+static int find_delimiter(const struct multipart *mp, int pos) {
+    const unsigned char *s = (const unsigned char *) mp->buf + pos,
+          *end = (const unsigned char *) mp->buf + mp->len;
+    int last = mp->delim_len - 1;
+    unsigned char c;
+
+    while (end - s > last) {
+        c = s[last];
+        if (c == (unsigned char) mp->delim[last] && !memcmp(s, mp->delim, last)) {
+            return (int) ((const char *) s - mp->buf);
+        }
+        s += mp->skip[c];
+    }
+
+    return -1;
+}
+
+// Return how far data from pos can be passed on when there is no
+// delimiter: a delimiter starting at the end of the buffer begins
+// with '\r' in the last delim_len - 1 bytes.
+static int safe_end(const struct multipart *mp, int pos) {
+    int i = mp->len - (mp->delim_len - 1);
+
+    for (i = i < pos ? pos : i; i < mp->len; i++) {
+        if (mp->buf[i] == '\r') {
+            return i;
+        }
+    }
+
+    return mp->len;
+}
+
+// Get parameter of a header value, e.g. name in
+// form-data; name="file"; filename="a.txt". Value is copied to out.
+// Return NULL if not present.
+static const char *get_param(const char *value, const char *param,
+                             char **out, const char *out_end) {
+    size_t param_len = strlen(param);
+    const char *p = value;
+    char *result = *out;
+    int quoted;
+
+    while (*out < out_end && (p = strchr(p, ';')) != NULL) {
+        for (p++; *p == ' ' || *p == '\t'; p++) {
+        }
+        if (mg_strncasecmp(p, param, param_len) != 0 || p[param_len] != '=') {
+            continue;
+        }
+        p += param_len + 1;
+        if ((quoted = *p == '"') != 0) {
+            p++;
+        }
+        for (; *p != '\0' && (quoted ? *p != '"' : *p != ';' && *p != ' ');
+             p++) {
+            // Only quotes are escaped, IE sends Windows paths as they are
+            if (quoted && p[0] == '\\' && p[1] == '"') {
+                p++;
+            }
+            if (*out < out_end - 1) {
+                *(*out)++ = *p;
+            }
+        }
+        *(*out)++ = '\0';
+        return result;
+    }
+
+    return NULL;
+}
+
+// Parse len bytes of part headers at p. Return 0 if they do not fit.
+static int parse_part_headers(struct multipart *mp, const char *p, int len) {
+    struct mg_part *part = &mp->part;
+    char *s = mp->headers, *end = mp->headers + sizeof(mp->headers), *e, *colon;
+    int i;
+
+    memset(part, 0, sizeof(*part));
+    part->name = "";
+    if (len >= (int) sizeof(mp->headers) / 2) {
+        return 0;
+    }
+
+    // Copy, then split into NUL-terminated lines, names and values
+    memcpy(s, p, len);
+    s[len] = '\0';
+    for (; *s != '\0' && part->num_headers < (int) ARRAY_SIZE(part->headers);
+         s = e + 1) {
+        if ((e = strchr(s, '\n')) == NULL) {
+            break;
+        }
+        *e = '\0';
+        if (e > s && e[-1] == '\r') {
+            e[-1] = '\0';
+        }
+        if ((colon = strchr(s, ':')) == NULL) {
+            continue;
+        }
+        *colon++ = '\0';
+        while (*colon == ' ' || *colon == '\t') {
+            colon++;
+        }
+        part->headers[part->num_headers].name = s;
+        part->headers[part->num_headers++].value = colon;
+    }
+
+    // Parameters go after the copy
+    s = mp->headers + len + 1;
+    for (i = 0; i < part->num_headers; i++) {
+        if (!mg_strcasecmp(part->headers[i].name, "Content-Disposition")) {
+            if ((p = get_param(part->headers[i].value, "name", &s, end)) != NULL) {
+                part->name = p;
+            }
+            part->filename = get_param(part->headers[i].value, "filename",
+                                       &s, end);
+        } else if (!mg_strcasecmp(part->headers[i].name, "Content-Type")) {
+            part->content_type = part->headers[i].value;
+        }
+    }
+
+    return 1;
+}
+
+// Parse what is buffered. Return 1 if more data is needed, 0 when done,
+// -1 on error, -2 if a callback stopped the parsing.
+static int parse(struct multipart *mp, int *num_parts) {
+    const struct mg_multipart_handler *h = mp->handler;
+    const char *p;
+    int n, end;
+
+    for (;;) {
+        switch (mp->state) {
+            case MP_PREAMBLE:
+                if ((n = find_delimiter(mp, mp->pos)) < 0) {
+                    mp->pos = safe_end(mp, mp->pos);
+                    return 1;
+                }
+                mp->pos = n + mp->delim_len;
+                mp->state = MP_DELIMITER;
+                break;
+
+            case MP_DELIMITER:
+                // "--" after the last one, else padding up to the line end
+                if (mp->len - mp->pos < 2) {
+                    return 1;
+                } else if (!memcmp(mp->buf + mp->pos, "--", 2)) {
+                    mp->state = MP_DONE;
+                    return 0;
+                } else if ((p = (const char *) memchr(mp->buf + mp->pos, '\n',
+                                                      mp->len - mp->pos)) == NULL) {
+                    return 1;
+                }
+                mp->pos = (int) (p - mp->buf) + 1;
+                mp->state = MP_HEADERS;
+                break;
+
+            case MP_HEADERS:
+                // Checked like request headers, no control characters
+                p = mp->buf + mp->pos;
+                if (mp->len - mp->pos >= 2 && !memcmp(p, "\r\n", 2)) {
+                    end = mp->pos + 2;
+                } else if ((n = get_request_len(p, mp->len - mp->pos)) > 0) {
+                    end = mp->pos + n;
+                } else if (n < 0 ||
+                           mp->len - mp->pos >= MULTIPART_HEADERS_SIZE / 2) {
+                    return -1;
+                } else {
+                    return 1;
+                }
+                if (!parse_part_headers(mp, mp->buf + mp->pos, end - mp->pos)) {
+                    return -1;
+                }
+                mp->pos = end;
+                mp->state = MP_DATA;
+                if (h->part_begin != NULL &&
+                    !h->part_begin(&mp->part, mp->user_data)) {
+                    return -2;
+                }
+                break;
+
+            case MP_DATA:
+                end = n = find_delimiter(mp, mp->pos);
+                if (n < 0) {
+                    end = safe_end(mp, mp->pos);
+                }
+                if (end > mp->pos && h->part_data != NULL &&
+                    !h->part_data(&mp->part, mp->buf + mp->pos, end - mp->pos,
+                                  mp->user_data)) {
+                    mp->pos = end;
+                    return -2;
+                }
+                mp->pos = end;
+                if (n < 0) {
+                    return 1;
+                }
+                (*num_parts)++;
+                mp->pos = n + mp->delim_len;
+                mp->state = MP_DELIMITER;
+                if (h->part_end != NULL &&
+                    !h->part_end(&mp->part, mp->user_data)) {
+                    return -2;
+                }
+                break;
+
+            default:
+                return 0;
+        }
+    }
+}
+
+// Parse multipart/form-data request body, calling the handler for every
+// part. buf_size is the size of the read buffer, 0 for the default.
+// If a callback returns 0, parsing stops: the parser and what it has
+// read ahead are kept with the connection, and the next call for the
+// same request continues where it stopped.
+// Return number of parts seen to their end, or -1 on error.
+int mg_parse_multipart(struct mg_connection *conn,
+                       const struct mg_multipart_handler *handler,
+                       void *user_data, int buf_size) {
+    struct multipart *mp;
+    char boundary[MAX_BOUNDARY_LEN + 1], scratch[MG_BUF_LEN];
+    int n, rc = 1, num_parts = 0;
+
+    if (buf_size <= 0) {
+        buf_size = MULTIPART_BUF_SIZE;
+    } else if (buf_size < MG_BUF_LEN) {
+        buf_size = MG_BUF_LEN;
+    }
+
+    if ((mp = conn->multipart) != NULL) {
+        conn->multipart = NULL;
+    } else if (!get_boundary(conn, boundary) ||
+               (mp = (struct multipart *) malloc(sizeof(*mp) +
+                                                 buf_size)) == NULL) {
+        return -1;
+    } else {
+        mp->size = buf_size;
+        compile_delimiter(mp, boundary);
+
+        // The body starts with a delimiter without the line break
+        memcpy(mp->buf, "\r\n", 2);
+        mp->len = 2;
+        mp->pos = 0;
+        mp->state = MP_PREAMBLE;
+    }
+    mp->handler = handler;
+    mp->user_data = user_data;
+
+    while ((rc = parse(mp, &num_parts)) == 1) {
+        // Keep what is not parsed yet, at most a part of a delimiter or
+        // of part headers
+        if (mp->pos > 0) {
+            memmove(mp->buf, mp->buf + mp->pos, mp->len - mp->pos);
+            mp->len -= mp->pos;
+            mp->pos = 0;
+        }
+        if (mp->len >= mp->size ||
+            (n = mg_read(conn, mp->buf + mp->len, mp->size - mp->len)) <= 0) {
+            rc = -1;
+            break;
+        }
+        mp->len += n;
+    }
+
+    if (rc == 0) {
+        // Skip the epilogue, so that the connection can be reused
+        while (mg_read(conn, scratch, sizeof(scratch)) > 0) {
+        }
+    }
+
+    // Stopped by a callback, keep the parser for the next call
+    if (rc == -2) {
+        conn->multipart = mp;
+    } else {
+        free(mp);
+    }
+
+    return rc == -1 ? -1 : num_parts;
+}
+
+struct upload {
+    const char *destination_dir;
+    char *path;
+    int path_len;
+    FILE *fp;
+    int done;
+};
+
+static int upload_begin(const struct mg_part *part, void *user_data) {
+    struct upload *u = (struct upload *) user_data;
+    const char *s;
+
+    // Form fields are skipped
+    if (part->filename == NULL || part->filename[0] == '\0') {
+        return 1;
+    }
+
+    // Do not allow paths to have slashes
+    if ((s = strrchr(part->filename, '/')) != NULL ||
+        (s = strrchr(part->filename, '\\')) != NULL) {
+        s++;
+    } else {
+        s = part->filename;
+    }
+    snprintf(u->path, u->path_len, "%s/%s", u->destination_dir, s);
+    if ((u->fp = fopen(u->path, "wb+")) != NULL) {
+        fclose_on_exec(u->fp);
+    }
+
+    return u->fp != NULL;
+}
+
+static int upload_data(const struct mg_part *part, const char *data, int len,
+                       void *user_data) {
+    struct upload *u = (struct upload *) user_data;
+
+    (void) part;
+    return u->fp == NULL || (int) fwrite(data, 1, len, u->fp) == len;
+}
+
+// Stop after each file, it is handed back to the caller
+static int upload_end(const struct mg_part *part, void *user_data) {
+    struct upload *u = (struct upload *) user_data;
+
+    (void) part;
+    u->done = u->fp != NULL;
+    return !u->done;
+}
+
+FILE *mg_upload(struct mg_connection *conn, const char *destination_dir,
+                char *path, int path_len) {
+    static const struct mg_multipart_handler handler = {
+        upload_begin, upload_data, upload_end
+    };
+    struct upload u;
+
+    memset(&u, 0, sizeof(u));
+    u.destination_dir = destination_dir;
+    u.path = path;
+    u.path_len = path_len;
+
+    if (mg_parse_multipart(conn, &handler, &u, 0) < 0 || !u.done) {
+        if (u.fp != NULL) {
+            fclose(u.fp);
+        }
+        return NULL;
+    }
+    rewind(u.fp);
+
+    return u.fp;
+}
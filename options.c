@@ -21,11 +21,20 @@ const char *config_options[] = {
   "url_rewrite_patterns",
   "hide_files_patterns",
   "request_timeout_ms",
+  "enable_file_cache",
+  "document_archive",
+  "io_threads",
+  "mime_types_file",
+  "global_throttle",
+  "put_fsync",
+  "trash_directory",
+  "config_file",
   NULL
 };
 
 
-int op(const char *name) {
+// Return index of the option, or -1 if there is no such option.
+int find_option(const char *name) {
   int i;
 
   for (i = 0; config_options[i] != NULL; i++) {
@@ -34,9 +43,17 @@ int op(const char *name) {
     }
   }
 
-  die("invalid option key:%s", name);
-  
-  return -1; // not found
+  return -1;
+}
+
+int op(const char *name) {
+  int i;
+
+  if ((i = find_option(name)) == -1) {
+    die("invalid option key:%s", name);
+  }
+
+  return i;
 }
 
 
@@ -99,44 +116,103 @@ char * get_absolute_path(char *relpath,
   return sdup(abs);
 }
 
-void set_options(struct mg_context * ctx, char *argv[]) {
+static void set_default_options(char **config) {
+    config[op("authentication_domain")]  = mg_strdup("mydomain.com");
+    config[op("enable_directory_listing")]  = mg_strdup("yes");
+    config[op("index_files")]  = mg_strdup("index.html,index.htm,index.shtml,index.php,index.lp");
+    config[op("enable_keep_alive")]  = mg_strdup("no");
+    config[op("listening_ports")] = mg_strdup("8080");
+    config[op("num_threads")] = mg_strdup("5");
+    config[op("request_timeout_ms")] = mg_strdup("30000");
+    config[op("enable_file_cache")] = mg_strdup("no");
+    config[op("io_threads")] = mg_strdup("4");
+    config[op("put_fsync")] = mg_strdup("no");
+
+    // set default document_root
+    config[op("document_root")] = mg_strdup(".");
+}
+
+static void set_option(char **config, int i, const char *value) {
+    free(config[i]);
+    config[i] = mg_strdup(value);
+}
+
+// Read "name value" lines of the config file. Empty lines and lines
+// starting with '#' are ignored. Return 0 on error.
+static int read_config_file(struct mg_context *ctx, const char *path,
+                            char **config) {
+    char line[PATH_MAX + 256], name[100], *value, *end;
+    int i, line_no = 0, ok = 1;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        cry(create_fake_connection(ctx), "Cannot open config file %s: %s",
+            path, strerror(ERRNO));
+        return 0;
+    }
+
+    while (ok && fgets(line, sizeof(line), fp) != NULL) {
+        line_no++;
+        value = line + strspn(line, " \t\r\n");
+        if (*value == '\0' || *value == '#') {
+            continue;
+        }
+        for (end = value + strlen(value);
+             end > value && isspace(* (unsigned char *) (end - 1)); end--) {
+        }
+        *end = '\0';
+
+        if (sscanf(value, "%99s", name) != 1 ||
+            (i = find_option(name)) == -1 || i == op("config_file")) {
+            cry(create_fake_connection(ctx), "%s line %d: invalid option",
+                path, line_no);
+            ok = 0;
+        } else {
+            value += strlen(name);
+            set_option(config, i, value + strspn(value, " \t"));
+        }
+    }
+    (void) fclose(fp);
+
+    return ok;
+}
+
+// Fill config with defaults, then config_file, then command line
+// options. Return 0 on error.
+int load_options(struct mg_context *ctx, char **config, char *argv[]) {
     int i;
-    const char *name, *value;
 
-    ctx->config[op("authentication_domain")]  = mg_strdup("mydomain.com");
-    ctx->config[op("enable_directory_listing")]  = mg_strdup("yes");
-    ctx->config[op("index_files")]  = mg_strdup("index.html,index.htm,index.shtml,index.php,index.lp");
-    ctx->config[op("enable_keep_alive")]  = mg_strdup("no");
-    ctx->config[op("listening_ports")] = mg_strdup("8080");
-    ctx->config[op("num_threads")] = mg_strdup("5");
-    ctx->config[op("request_timeout_ms")] = mg_strdup("30000");
+    set_default_options(config);
 
-    // set default document_root
-    ctx->config[op("document_root")] = mg_strdup(".");
+    for (i = 1; argv[i] != NULL && argv[i + 1] != NULL; i += 2) {
+        if (!strcmp(argv[i], "-config_file") &&
+            !read_config_file(ctx, argv[i + 1], config)) {
+            return 0;
+        }
+    }
 
-    // Handle command line flags.
-    // They override config file and default settings.
+    // Command line flags override config file and default settings.
     for (i = 1; argv[i] != NULL; i += 2) {
         if (argv[i][0] != '-' || argv[i + 1] == NULL) {
             show_usage_and_exit();
         }
-        name =  &argv[i][1];
-        value = argv[i + 1];
-
-        if (op(name) == -1) {
-            cry(create_fake_connection(ctx), "Invalid option: %s", name);
-            free_context(ctx);
-            die("%s", "Failed to start Mongoose.");
+        if (find_option(&argv[i][1]) == -1) {
+            cry(create_fake_connection(ctx), "Invalid option: %s", &argv[i][1]);
+            return 0;
         }
 
-        ctx->config[op(name)] = mg_strdup(value);
-        DEBUG_TRACE(("[%s] -> [%s]", name, value));
+        set_option(config, find_option(&argv[i][1]), argv[i + 1]);
+        DEBUG_TRACE(("[%s] -> [%s]", &argv[i][1], argv[i + 1]));
     }
 
-    /* dump ctx->config
-    */
-    for (i=0;config_options[i] != NULL; i++) {
-        //fprintf(stderr, "%s, ctx->config[%d]=%s\n", config_options[i], i, ctx->config[i]);
+    return 1;
+}
+
+void set_options(struct mg_context * ctx, char *argv[]) {
+    ctx->argv = argv;
+    if (!load_options(ctx, ctx->config, argv)) {
+        free_context(ctx);
+        die("%s", "Failed to start Mongoose.");
     }
 
     ctx->settings.put_delete_auth_file = ctx->config[op("put_delete_auth_file")];
@@ -146,12 +222,20 @@ void set_options(struct mg_context * ctx, char *argv[]) {
     ctx->settings.ports  = ctx->config[op("listening_ports")];
     ctx->settings.num_threads  = atoi(ctx->config[op("num_threads")]);
     ctx->settings.global_passwords_file = ctx->config[op("global_auth_file")];
+    ctx->settings.enable_file_cache = ctx->config[op("enable_file_cache")];
+    ctx->settings.document_archive = ctx->config[op("document_archive")];
+    ctx->settings.io_threads = atoi(ctx->config[op("io_threads")]);
+    ctx->settings.mime_types_file = ctx->config[op("mime_types_file")];
+    ctx->settings.trash_directory = ctx->config[op("trash_directory")];
 
     ctx->settings.document_root = get_absolute_path(ctx->settings.document_root, argv[0]);
     ctx->settings.put_delete_auth_file = get_absolute_path(ctx->settings.put_delete_auth_file,argv[0]);
     ctx->settings.access_log_file = get_absolute_path(ctx->settings.access_log_file,argv[0]);
     ctx->settings.error_log_file = get_absolute_path(ctx->settings.error_log_file,argv[0]);
     ctx->settings.global_passwords_file = get_absolute_path(ctx->settings.global_passwords_file,argv[0]);
+    ctx->settings.document_archive = get_absolute_path(ctx->settings.document_archive,argv[0]);
+    ctx->settings.mime_types_file = get_absolute_path(ctx->settings.mime_types_file,argv[0]);
+    ctx->settings.trash_directory = get_absolute_path(ctx->settings.trash_directory,argv[0]);
 
     // Make extra verification for certain options
     verify_document_root(ctx->settings.document_root);
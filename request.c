@@ -1,157 +1,278 @@
 #include "mingoose.h"
 
-// Skip the characters until one of the delimiters characters found.
-// 0-terminate resulting word. Skip the delimiter and following whitespaces.
-// Advance pointer to buffer to the next word. Return found 0-terminated word.
-// Delimiters can be quoted with quotechar.
-char *skip_quoted(char **buf, const char *delimiters,
-                         const char *whitespace, char quotechar) {
-  char *p, *begin_word, *end_word, *end_whitespace;
-
-  begin_word = *buf;
-  end_word = begin_word + strcspn(begin_word, delimiters);
-
-  // Check for quotechar
-  if (end_word > begin_word) {
-    p = end_word - 1;
-    while (*p == quotechar) {
-      // If there is anything beyond end_word, copy it
-      if (*end_word == '\0') {
-        *p = '\0';
-        break;
-      } else {
-        size_t end_off = strcspn(end_word + 1, delimiters);
-        memmove (p, end_word, end_off + 1);
-        p += end_off; // p must correspond to end_word - 1
-        end_word += end_off + 1;
-      }
-    }
-    for (p++; p < end_word; p++) {
-      *p = '\0';
+// In enum mg_known_header order
+static const char *known_header_names[MG_NUM_KNOWN_HEADERS] = {
+  "Accept-Encoding", "Authorization", "Connection", "Content-Length",
+  "Content-Range", "Content-Type", "Expect", "If-Modified-Since",
+  "If-None-Match", "Range", "Referer", "Transfer-Encoding", "User-Agent"
+};
+
+// Return enum mg_known_header of the header name, or -1. Only names
+// with the same first letter are compared.
+static int known_header(const char *name) {
+  int i, c = lowercase(name);
+
+  for (i = 0; i < MG_NUM_KNOWN_HEADERS; i++) {
+    if (lowercase(known_header_names[i]) == c &&
+        !mg_strcasecmp(name, known_header_names[i])) {
+      return i;
     }
   }
 
-  if (*end_word == '\0') {
-    *buf = end_word;
-  } else {
-    end_whitespace = end_word + 1 + strspn(end_word + 1, whitespace);
+  return -1;
+}
 
-    for (p = end_word; p < end_whitespace; p++) {
-      *p = '\0';
-    }
+// Copy len bytes at p to *out, NUL-terminated, and advance *out. The
+// strings area may be the parsed buffer itself, as long as it stays
+// behind p.
+static char *copy_string(char **out, const char *p, size_t len) {
+  char *s = *out;
 
-    *buf = end_whitespace;
-  }
+  memmove(s, p, len);
+  s[len] = '\0';
+  *out += len + 1;
 
-  return begin_word;
+  return s;
 }
 
-// Parse HTTP headers from the given buffer, advance buffer to the point
-// where parsing stopped.
-static void parse_http_headers(char **buf, struct mg_request_info *ri) {
-  int i;
+// End of the line starting at p, not including the line break.
+static const char *line_end(const char *p, const char *end, const char **next) {
+  const char *e = (const char *) memchr(p, '\n', end - p);
 
-  for (i = 0; i < (int) ARRAY_SIZE(ri->http_headers); i++) {
-    ri->http_headers[i].name = skip_quoted(buf, ":", " ", 0);
-    ri->http_headers[i].value = skip_quoted(buf, "\r\n", "\r\n", 0);
-    if (ri->http_headers[i].name[0] == '\0')
+  *next = e == NULL ? end : e + 1;
+  if (e == NULL) {
+    e = end;
+  }
+  return e > p && e[-1] == '\r' ? e - 1 : e;
+}
+
+// Parse HTTP headers between p and end, copy names and values to out.
+static void parse_http_headers(const char *p, const char *end, char *out,
+                               struct mg_request_info *ri) {
+  const char *e, *colon, *next;
+  int i, id;
+
+  for (i = 0; i < (int) ARRAY_SIZE(ri->http_headers) && p < end; i++, p = next) {
+    e = line_end(p, end, &next);
+    if ((colon = (const char *) memchr(p, ':', e - p)) == NULL || colon == p)
       break;
+    ri->http_headers[i].name = copy_string(&out, p, colon - p);
+    for (colon++; colon < e && *colon == ' '; colon++) {
+    }
+    ri->http_headers[i].value = copy_string(&out, colon, e - colon);
     ri->num_headers = i + 1;
+
+    // First one wins, as with a scan of http_headers
+    if ((id = known_header(ri->http_headers[i].name)) >= 0 &&
+        ri->known_headers[id] == NULL) {
+      ri->known_headers[id] = ri->http_headers[i].value;
+    }
   }
 }
 
-// Check whether full request is buffered. Return:
-//   -1  if request is malformed
-//    0  if request is not yet fully buffered
-//   >0  actual request length, including last \r\n\r\n
-int get_request_len(const char *buf, int buf_len) {
-  int i;
+// Control characters are not allowed in headers but >=128 is. The scan
+// only stops at line breaks and bad characters: a vector kernel finds
+// them 16 or 32 bytes at a time, then check_special() looks at each.
+// Return -1 if buf[i] is not allowed, the request length if it ends the
+// headers, 0 if it is a line break inside them.
+static int check_special(const char *buf, int buf_len, int i) {
+  if (buf[i] != '\r' && buf[i] != '\n') {
+    return -1;
+  } else if (buf[i] == '\n' && i + 1 < buf_len && buf[i + 1] == '\n') {
+    return i + 2;
+  } else if (buf[i] == '\n' && i + 2 < buf_len && buf[i + 1] == '\r' &&
+             buf[i + 2] == '\n') {
+    return i + 3;
+  }
+  return 0;
+}
 
-  for (i = 0; i < buf_len; i++) {
-    // Control characters are not allowed but >=128 is.
-    // Abort scan as soon as one malformed character is found;
-    // don't let subsequent \r\n\r\n win us over anyhow
-    if (!isprint(* (const unsigned char *) &buf[i]) && buf[i] != '\r' &&
-        buf[i] != '\n' && * (const unsigned char *) &buf[i] < 128) {
-      return -1;
-    } else if (buf[i] == '\n' && i + 1 < buf_len && buf[i + 1] == '\n') {
-      return i + 2;
-    } else if (buf[i] == '\n' && i + 2 < buf_len && buf[i + 1] == '\r' &&
-               buf[i + 2] == '\n') {
-      return i + 3;
+static int is_special(unsigned char c) {
+  return c < 0x20 || c == 0x7f;
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+// Scan 16 bytes at a time from *pos, leave *pos where the scalar scan
+// has to take over. Return as check_special() does.
+static int scan_sse2(const char *buf, int buf_len, int *pos) {
+  __m128i v, ctl, del;
+  unsigned int mask;
+  int i, n;
+
+  for (i = *pos; i + 16 <= buf_len; i += 16) {
+    v = _mm_loadu_si128((const __m128i *) (buf + i));
+    ctl = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v);
+    del = _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f));
+    mask = (unsigned int) _mm_movemask_epi8(_mm_or_si128(ctl, del));
+    for (; mask != 0; mask &= mask - 1) {
+      if ((n = check_special(buf, buf_len, i + __builtin_ctz(mask))) != 0) {
+        return n;
+      }
+    }
+  }
+  *pos = i;
+
+  return 0;
+}
+
+// AVX2 is used if the CPU has it, -DNO_AVX2 to leave it out
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NO_AVX2)
+#include <immintrin.h>
+#define HAVE_AVX2_SCAN
+
+__attribute__((target("avx2")))
+static int scan_avx2(const char *buf, int buf_len, int *pos) {
+  __m256i v, ctl, del;
+  unsigned int mask;
+  int i, n;
+
+  for (i = *pos; i + 32 <= buf_len; i += 32) {
+    v = _mm256_loadu_si256((const __m256i *) (buf + i));
+    ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1f)), v);
+    del = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f));
+    mask = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(ctl, del));
+    for (; mask != 0; mask &= mask - 1) {
+      if ((n = check_special(buf, buf_len, i + __builtin_ctz(mask))) != 0) {
+        return n;
+      }
     }
   }
+  *pos = i;
 
   return 0;
 }
+#endif
+#endif
+
+// Same as get_request_len(), for a buffer whose first "from" bytes
+// have already been scanned without finding the end of the request.
+static int scan_request(const char *buf, int from, int buf_len) {
+  int i = from, n = 0;
+
+  // Abort scan as soon as one malformed character is found;
+  // don't let subsequent \r\n\r\n win us over anyhow
+#if defined(HAVE_AVX2_SCAN)
+  if (__builtin_cpu_supports("avx2")) {
+    n = scan_avx2(buf, buf_len, &i);
+  }
+#endif
+#if defined(__SSE2__)
+  if (n == 0) {
+    n = scan_sse2(buf, buf_len, &i);
+  }
+#endif
+
+  for (; n == 0 && i < buf_len; i++) {
+    if (is_special(* (const unsigned char *) &buf[i])) {
+      n = check_special(buf, buf_len, i);
+    }
+  }
 
-static int is_valid_http_method(const char *method) {
-  return !strcmp(method, "GET") || !strcmp(method, "POST") ||
-    !strcmp(method, "HEAD") || !strcmp(method, "CONNECT") ||
-    !strcmp(method, "PUT") || !strcmp(method, "DELETE") ||
-    !strcmp(method, "OPTIONS")
-      ;
+  return n;
+}
+
+// Check whether full request is buffered. Return:
+//   -1  if request is malformed
+//    0  if request is not yet fully buffered
+//   >0  actual request length, including last \r\n\r\n
+int get_request_len(const char *buf, int buf_len) {
+  return scan_request(buf, 0, buf_len);
+}
+
+// Return enum mg_method of the method, which is case sensitive.
+static int http_method(const char *method) {
+  switch (method[0]) {
+    case 'G': return !strcmp(method, "GET") ? MG_METHOD_GET : MG_METHOD_UNKNOWN;
+    case 'H': return !strcmp(method, "HEAD") ? MG_METHOD_HEAD : MG_METHOD_UNKNOWN;
+    case 'P':
+      return !strcmp(method, "POST") ? MG_METHOD_POST :
+        !strcmp(method, "PUT") ? MG_METHOD_PUT : MG_METHOD_UNKNOWN;
+    case 'D':
+      return !strcmp(method, "DELETE") ? MG_METHOD_DELETE : MG_METHOD_UNKNOWN;
+    case 'O':
+      return !strcmp(method, "OPTIONS") ? MG_METHOD_OPTIONS : MG_METHOD_UNKNOWN;
+    case 'C':
+      return !strcmp(method, "CONNECT") ? MG_METHOD_CONNECT : MG_METHOD_UNKNOWN;
+    default: return MG_METHOD_UNKNOWN;
+  }
 }
 
 
-// Parse HTTP request, fill in mg_request_info structure.
-// This function modifies the buffer by NUL-terminating
-// HTTP request components, header names and header values.
+// Parse HTTP request of known length, fill in mg_request_info structure.
+// The buffer is only read: components are copied, NUL-terminated, to the
+// out area, which must be as large as the request. The URI is split from
+// the query string, raw_uri points to it in the buffer.
 // @return -1 on error
-int parse_http_message(char *buf, int len, struct mg_request_info *ri) {
-  int is_request, request_length = get_request_len(buf, len);
+static int parse_request(const char *buf, int request_length,
+                         struct mg_request_info *ri, char *out) {
+  const char *end = buf + request_length, *e, *p, *q, *next;
+
   if (request_length > 0) {
     // Reset attributes. DO NOT TOUCH is_ssl, remote_ip, remote_port
     ri->remote_user = ri->request_method = ri->uri = ri->http_version = NULL;
+    ri->query_string = NULL;
+    ri->raw_uri.ptr = NULL;
+    ri->raw_uri.len = 0;
+    ri->method = MG_METHOD_UNKNOWN;
     ri->num_headers = 0;
-
-    buf[request_length - 1] = '\0';
+    memset(ri->known_headers, 0, sizeof(ri->known_headers));
 
     // RFC says that all initial whitespaces should be ingored
-    while (*buf != '\0' && isspace(* (unsigned char *) buf)) {
+    while (buf < end && isspace(* (const unsigned char *) buf)) {
       buf++;
     }
 
-    char *p;
-    p = strchr(buf, ' ');
-    *p = '\0';
-    ri->request_method = buf;
-
-    buf = p + 1;
-    p = strchr(buf, ' ');
-    *p = '\0';
-    ri->uri = buf;
-
-    buf = p + 1;
-    p = strchr(buf , '\r');
-    *p = '\0';
-    ri->http_version = buf;
-    buf = p + 2;
+    // Request line is "<method> <uri> HTTP/<version>"
+    e = line_end(buf, end, &next);
+    if ((p = (const char *) memchr(buf, ' ', e - buf)) == NULL ||
+        (q = (const char *) memchr(p + 1, ' ', e - p - 1)) == NULL) {
+      return -1;
+    }
+    ri->request_method = copy_string(&out, buf, p - buf);
 
     // HTTP message could be either HTTP request or HTTP response, e.g.
     // "GET / HTTP/1.0 ...." or  "HTTP/1.0 200 OK ..."
-    is_request = is_valid_http_method(ri->request_method);
-    if (!is_request) {
+    ri->method = http_method(ri->request_method);
+    if (ri->method == MG_METHOD_UNKNOWN) {
       return -1;
     }
 
-    if (memcmp(ri->http_version, "HTTP/", 5) != 0) {
+    if (e - q - 1 < 5 || memcmp(q + 1, "HTTP/", 5) != 0) {
       return -1;
     }
 
-    ri->http_version += 5;
-    parse_http_headers(&buf, ri);
+    ri->raw_uri.ptr = ++p;
+    ri->raw_uri.len = q - p;
+    if ((p = (const char *) memchr(p, '?', q - p)) != NULL) {
+      ri->raw_uri.len = p - ri->raw_uri.ptr;
+    }
+    ri->uri = copy_string(&out, ri->raw_uri.ptr, ri->raw_uri.len);
+    if (p != NULL) {
+      ri->query_string = copy_string(&out, p + 1, q - p - 1);
+    }
+    ri->http_version = copy_string(&out, q + 6, e - q - 6);
 
+    parse_http_headers(next, end, out, ri);
   }
   return request_length;
 }
 
+// Same, for a buffer that can be modified: strings are copied in place.
+int parse_http_message(char *buf, int len, struct mg_request_info *ri) {
+  return parse_request(buf, get_request_len(buf, len), ri, buf);
+}
+
 
 // Return HTTP header value, or NULL if not found.
 static const char *get_header(const struct mg_request_info *ri,
                               const char *name) {
   int i;
 
+  if ((i = known_header(name)) >= 0)
+    return ri->known_headers[i];
+
   for (i = 0; i < ri->num_headers; i++)
     if (!mg_strcasecmp(name, ri->http_headers[i].name))
       return ri->http_headers[i].value;
@@ -163,24 +284,37 @@ const char *mg_get_header(const struct mg_connection *conn, const char *name) {
   return get_header(&conn->request_info, name);
 }
 
+// Same for a header of enum mg_known_header, without looking at the name.
+const char *mg_get_known_header(const struct mg_connection *conn, int header) {
+  return conn->request_info.known_headers[header];
+}
+
 
-// Keep reading the input (either opened file descriptor fd, or socket sock,
-// or SSL descriptor ssl) into buffer buf, until \r\n\r\n appears in the
-// buffer (which marks the end of HTTP request). Buffer buf may already
-// have some data. The length of the data is stored in nread.
-// Upon every read operation, increase nread by the number of bytes read.
-static int read_request(FILE *fp, struct mg_connection *conn,
-                        char *buf, int bufsiz, int *nread) {
-  int request_len, n = 0;
-
-  request_len = get_request_len(buf, *nread);
-  while (conn->ctx->stop_flag == 0 &&
-         *nread < bufsiz &&
-         request_len == 0 &&
-         (n = pull(fp, conn, buf + *nread, bufsiz - *nread)) > 0) {
-    *nread += n;
-    assert(*nread <= bufsiz);
-    request_len = get_request_len(buf, *nread);
+// Keep reading the input into conn->buf until \r\n\r\n appears in the
+// buffer (which marks the end of HTTP request). The buffer may already
+// have some data, e.g. a pipelined request. Every read only scans the
+// new bytes, plus the two before them that may start the terminator.
+static int read_request(struct mg_connection *conn) {
+  int request_len, scanned, n = 0;
+
+  request_len = get_request_len(conn->buf, conn->data_len);
+  while (conn->ctx->stop_flag == 0 && request_len == 0) {
+    // Previous requests are skipped, not moved. Move the pending data
+    // to the start of the buffer only once it has run out of room.
+    if (conn->data_len == conn->buf_size && conn->buf != conn->buf_base) {
+      memmove(conn->buf_base, conn->buf, conn->data_len);
+      conn->buf_size += (int) (conn->buf - conn->buf_base);
+      conn->buf = conn->buf_base;
+    }
+    if (conn->data_len == conn->buf_size ||
+        (n = pull(NULL, conn, conn->buf + conn->data_len,
+                  conn->buf_size - conn->data_len)) <= 0) {
+      break;
+    }
+    scanned = conn->data_len > 2 ? conn->data_len - 2 : 0;
+    conn->data_len += n;
+    assert(conn->data_len <= conn->buf_size);
+    request_len = scan_request(conn->buf, scanned, conn->data_len);
   }
 
   return request_len <= 0 && n <= 0 ? -1 : request_len;
@@ -191,23 +325,27 @@ static void reset_per_request_attributes(struct mg_connection *conn) {
   conn->num_bytes_sent = conn->num_bytes_read = 0;
   conn->status_code = -1;
   conn->must_close = conn->request_len = conn->throttle = 0;
+  conn->throttle_bucket = NULL;
+  conn->body_read = conn->chunk_left = 0;
+  conn->body_consumed = conn->chunk_state = 0;
+  free(conn->multipart);
+  conn->multipart = NULL;
 }
 
 int getreq(struct mg_connection *conn, char *ebuf, size_t ebuf_len) {
-  const char *cl;
+  const char *cl, *te;
 
   ebuf[0] = '\0';
   reset_per_request_attributes(conn);
-  conn->request_len = read_request(NULL, conn, conn->buf, conn->buf_size,
-                                   &conn->data_len);
+  conn->request_len = read_request(conn);
   assert(conn->request_len < 0 || conn->data_len >= conn->request_len);
 
   if (conn->request_len == 0 && conn->data_len == conn->buf_size) {
     snprintf(ebuf, ebuf_len, "%s", "Request Too Large");
   } else if (conn->request_len <= 0) {
     snprintf(ebuf, ebuf_len, "%s", "Client closed connection");
-  } else if (parse_http_message(conn->buf, conn->buf_size,
-                                &conn->request_info) <= 0) {
+  } else if (parse_request(conn->buf, conn->request_len,
+                           &conn->request_info, conn->request_strings) <= 0) {
     snprintf(ebuf, ebuf_len, "Bad request: [%.*s]", conn->data_len, conn->buf);
   } else {
     // Request is valid. Set content_len attribute by parsing Content-Length
@@ -219,12 +357,19 @@ int getreq(struct mg_connection *conn, char *ebuf, size_t ebuf_len) {
     // want mg_read() to hang waiting until socket is timed out.
     // See https://github.com/cesanta/mongoose/pull/121 for more.
     conn->content_len = INT64_MAX;
-    if (!mg_strcasecmp(conn->request_info.request_method, "GET")) {
+    if (conn->request_info.method == MG_METHOD_GET) {
       conn->content_len = 0;
     }
-    if ((cl = get_header(&conn->request_info, "Content-Length")) != NULL) {
+    if ((cl = mg_get_known_header(conn, MG_HEADER_CONTENT_LENGTH)) != NULL) {
       conn->content_len = strtoll(cl, NULL, 10);
     }
+    // Transfer-Encoding overrides Content-Length, and the body is read
+    // with mg_read() until the last chunk
+    if ((te = mg_get_known_header(conn, MG_HEADER_TRANSFER_ENCODING)) != NULL &&
+        mg_strcasestr(te, "chunked") != NULL) {
+      conn->content_len = INT64_MAX;
+      conn->chunk_state = CHUNK_SIZE;
+    }
     conn->birth_time = time(NULL);
   }
   return ebuf[0] == '\0';
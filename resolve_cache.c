@@ -0,0 +1,206 @@
+#include "mingoose.h"
+
+// Request resolution cache.
+//
+// Maps a raw request URI, as it came from the client, to everything
+// dispatch_and_send_response() works out from it before answering:
+// the decoded URI, the file name after rewrites, the index file, the
+// metadata and pre-rendered headers, and whether the answer is a file,
+// a redirect, a listing or a 404. A hit skips URL decoding, rewrite and
+// hide pattern matching, all stat() calls and header formatting.
+//
+// A resolution may depend on any file of the directory (index files, .gz
+// siblings), so every change reported by the watcher drops all entries.
+// Entries are only kept while the watcher is active.
+
+#if !defined(RESOLVE_CACHE_SIZE)
+#define RESOLVE_CACHE_SIZE 16384    // Max number of cached resolutions
+#endif
+#define RESOLVE_CACHE_BUCKETS 4096
+
+struct resolve_cache_entry {
+    struct resolve_cache_entry *next;
+    unsigned int hash;
+    unsigned int generation;        // Cache generation the entry belongs to
+    int gzip;                       // Client accepts gzip
+    int kind;                       // RESOLVED_*
+    struct file file;
+    const char *mime;               // Pre-rendered headers
+    char etag[64];
+    char last_modified[64];
+    size_t raw_len;                 // Lengths of the strings in data
+    size_t uri_len;
+    size_t path_len;
+    size_t file_path_len;
+    char data[1];                   // Raw URI, URI, path and file path
+};
+
+static struct {
+    volatile int enabled;
+    pthread_mutex_t mutex;          // Protects everything below
+    unsigned int generation;        // Bumped on every invalidation
+    int num_entries;
+    struct resolve_cache_entry *buckets[RESOLVE_CACHE_BUCKETS];
+} cache = { 0, PTHREAD_MUTEX_INITIALIZER, 0, 0, { NULL } };
+
+static struct resolve_cache_entry **find(const char *raw, size_t len,
+                                         unsigned int hash, int gzip) {
+    struct resolve_cache_entry **pp =
+        &cache.buckets[hash % RESOLVE_CACHE_BUCKETS];
+
+    while (*pp != NULL && ((*pp)->hash != hash || (*pp)->gzip != gzip ||
+                           (*pp)->raw_len != len ||
+                           memcmp((*pp)->data, raw, len) != 0)) {
+        pp = &(*pp)->next;
+    }
+
+    return pp;
+}
+
+// Must be called with mutex held.
+static void drop(struct resolve_cache_entry **pp) {
+    struct resolve_cache_entry *e = *pp;
+
+    *pp = e->next;
+    free(e);
+    cache.num_entries--;
+}
+
+// Must be called with mutex held.
+static void flush(void) {
+    int i;
+
+    for (i = 0; i < RESOLVE_CACHE_BUCKETS; i++) {
+        while (cache.buckets[i] != NULL) {
+            drop(&cache.buckets[i]);
+        }
+    }
+}
+
+// Forget all resolutions. Entries of old generations are dropped lazily
+// when they are looked up, so invalidation is cheap however often files
+// change.
+void resolve_cache_invalidate(const char *path) {
+    (void) path;
+    if (cache.enabled) {
+        (void) pthread_mutex_lock(&cache.mutex);
+        cache.generation++;
+        (void) pthread_mutex_unlock(&cache.mutex);
+    }
+}
+
+// Return 1 if the raw URI is cached: the decoded URI is copied to uri,
+// which must have room for raw->len + 1 bytes, and res is filled.
+// Otherwise, the generation to pass to resolve_cache_store() is returned
+// in generation.
+int resolve_cache_lookup(const struct vec *raw, int gzip, char *uri,
+                         struct resolution *res, unsigned int *generation) {
+    struct resolve_cache_entry *e, **pp;
+    size_t len;
+    unsigned int hash;
+    int found = 0;
+
+    if (!cache.enabled || !mg_watch_is_active()) {
+        return 0;
+    }
+
+    len = raw->len;
+    hash = mg_hash(raw->ptr, len);
+
+    (void) pthread_mutex_lock(&cache.mutex);
+    *generation = cache.generation;
+    if ((e = *(pp = find(raw->ptr, len, hash, gzip))) == NULL) {
+        // Miss
+    } else if (e->generation != cache.generation) {
+        drop(pp);
+    } else {
+        // Decoded URI is never longer than the raw one
+        memcpy(uri, e->data + e->raw_len, e->uri_len + 1);
+        memcpy(res->path, e->data + e->raw_len + e->uri_len + 1,
+               e->path_len + 1);
+        memcpy(res->file_path,
+               e->data + e->raw_len + e->uri_len + e->path_len + 2,
+               e->file_path_len + 1);
+        res->kind = e->kind;
+        res->file = e->file;
+        res->mime = e->mime;
+        memcpy(res->etag, e->etag, sizeof(res->etag));
+        memcpy(res->last_modified, e->last_modified,
+               sizeof(res->last_modified));
+        found = 1;
+    }
+    (void) pthread_mutex_unlock(&cache.mutex);
+
+    return found;
+}
+
+// Remember resolution of the raw URI, unless anything changed since
+// resolve_cache_lookup() returned the generation.
+void resolve_cache_store(const struct vec *raw, int gzip, const char *uri,
+                         const struct resolution *res,
+                         unsigned int generation) {
+    struct resolve_cache_entry *e, **pp;
+    size_t raw_len, uri_len, path_len, file_path_len;
+    unsigned int hash;
+    char *p;
+
+    // Only files the watcher reports changes for can be cached
+    if (!cache.enabled || !mg_watch_is_active() || raw->len == 0 ||
+        !mg_watch_covers(res->path, strlen(res->path)) ||
+        !mg_watch_covers(res->file_path, strlen(res->file_path))) {
+        return;
+    }
+
+    raw_len = raw->len;
+    uri_len = strlen(uri);
+    path_len = strlen(res->path);
+    file_path_len = strlen(res->file_path);
+    hash = mg_hash(raw->ptr, raw_len);
+
+    if ((e = (struct resolve_cache_entry *)
+         malloc(sizeof(*e) + raw_len + uri_len + path_len +
+                file_path_len + 3)) == NULL) {
+        return;
+    }
+    e->hash = hash;
+    e->generation = generation;
+    e->gzip = gzip;
+    e->kind = res->kind;
+    e->file = res->file;
+    e->mime = res->mime;
+    memcpy(e->etag, res->etag, sizeof(e->etag));
+    memcpy(e->last_modified, res->last_modified, sizeof(e->last_modified));
+    e->raw_len = raw_len;
+    e->uri_len = uri_len;
+    e->path_len = path_len;
+    e->file_path_len = file_path_len;
+    p = e->data;
+    memcpy(p, raw->ptr, raw_len);
+    p += raw_len;
+    memcpy(p, uri, uri_len + 1);
+    p += uri_len + 1;
+    memcpy(p, res->path, path_len + 1);
+    p += path_len + 1;
+    memcpy(p, res->file_path, file_path_len + 1);
+
+    (void) pthread_mutex_lock(&cache.mutex);
+    if (generation != cache.generation) {
+        free(e);
+    } else {
+        if (cache.num_entries >= RESOLVE_CACHE_SIZE) {
+            flush();
+        }
+        if (*(pp = find(raw->ptr, raw_len, hash, gzip)) != NULL) {
+            drop(pp);
+        }
+        e->next = *pp;
+        *pp = e;
+        cache.num_entries++;
+    }
+    (void) pthread_mutex_unlock(&cache.mutex);
+}
+
+void resolve_cache_init(void) {
+    cache.enabled = 1;
+    mg_watch_add_listener(resolve_cache_invalidate);
+}
@@ -0,0 +1,221 @@
+#include "mingoose.h"
+
+// Serving of the document_archive. Everything needed to answer a request
+// is in the mapped archive, so no filesystem calls are made at all.
+
+// Return referenced archive, or NULL if document_archive is not used.
+struct mg_archive *mg_archive_acquire(struct mg_context *ctx) {
+    struct mg_archive *arc;
+
+    if (ctx->settings.document_archive == NULL) {
+        return NULL;
+    }
+
+    (void) pthread_mutex_lock(&ctx->archive_mutex);
+    if ((arc = ctx->archive) != NULL) {
+        arc->refs++;
+    }
+    (void) pthread_mutex_unlock(&ctx->archive_mutex);
+
+    return arc;
+}
+
+void mg_archive_release(struct mg_context *ctx, struct mg_archive *arc) {
+    int refs;
+
+    (void) pthread_mutex_lock(&ctx->archive_mutex);
+    refs = --arc->refs;
+    (void) pthread_mutex_unlock(&ctx->archive_mutex);
+
+    if (refs == 0) {
+        mg_archive_close(arc);
+    }
+}
+
+// Called periodically by the master thread. If the archive file has been
+// replaced, e.g. a new build was renamed over it, map the new one.
+// Requests in flight keep using the old archive until they finish.
+void mg_archive_check_reload(struct mg_context *ctx) {
+    const char *path = ctx->settings.document_archive;
+    struct mg_archive *arc, *old;
+    struct stat st;
+
+    if (path == NULL || stat(path, &st) != 0 ||
+        ((old = ctx->archive) != NULL && st.st_dev == old->dev &&
+         st.st_ino == old->ino && st.st_mtime == old->mtime &&
+         (uint64_t) st.st_size == old->size)) {
+        return;
+    }
+
+    if ((arc = mg_archive_open(path)) == NULL) {
+        cry(create_fake_connection(ctx), "%s: cannot load %s: %s",
+            __func__, path, strerror(ERRNO));
+        return;
+    }
+
+    (void) pthread_mutex_lock(&ctx->archive_mutex);
+    old = ctx->archive;
+    ctx->archive = arc;
+    (void) pthread_mutex_unlock(&ctx->archive_mutex);
+
+    if (old != NULL) {
+        mg_archive_release(ctx, old);
+    }
+    DEBUG_TRACE(("loaded %s, %u entries", path, arc->hdr->num_entries));
+}
+
+// For a directory URI, return the first index file from index_files.
+static const struct mg_archive_entry *find_index_file(
+    struct mg_connection *conn, const struct mg_archive *arc,
+    const char *uri, size_t uri_len) {
+    const struct mg_archive_entry *e = NULL;
+    const struct vec *filename_vec;
+    char path[PATH_MAX];
+    int i;
+
+    for (i = 0; e == NULL && i < conn->cfg->num_index_files; i++) {
+        filename_vec = &conn->cfg->index_files[i];
+        if (uri_len + filename_vec->len + 1 > sizeof(path)) {
+            continue;
+        }
+        memcpy(path, uri, uri_len);
+        memcpy(path + uri_len, filename_vec->ptr, filename_vec->len);
+        if ((e = mg_archive_find(arc, path, uri_len + filename_vec->len)) != NULL &&
+            (e->flags & MG_ARCHIVE_DIRECTORY)) {
+            e = NULL;
+        }
+    }
+
+    return e;
+}
+
+static int accepts_gzip(const struct mg_connection *conn) {
+    const char *accept_encoding = mg_get_known_header(conn, MG_HEADER_ACCEPT_ENCODING);
+    return accept_encoding != NULL && strstr(accept_encoding, "gzip") != NULL;
+}
+
+// Return True if we should reply 304 Not Modified.
+static int is_not_modified(const struct mg_connection *conn,
+                           const struct mg_archive_entry *e, const char *etag) {
+    const char *ims = mg_get_known_header(conn, MG_HEADER_IF_MODIFIED_SINCE);
+    const char *inm = mg_get_known_header(conn, MG_HEADER_IF_NONE_MATCH);
+    return (inm != NULL && !mg_strcasecmp(etag, inm)) ||
+        (ims != NULL && (time_t) e->mtime <= parse_date_string(ims));
+}
+
+void response_archive(struct mg_connection *conn, struct mg_archive *arc) {
+    const struct mg_archive_entry *e;
+    const char *uri = conn->request_info.uri, *msg = "OK", *hdr, *mime, *body;
+    const char *etag, *encoding = "";
+    char date[64], range[128];
+    size_t uri_len = strlen(uri);
+    time_t curtime = time(NULL);
+    int64_t cl, size, r1, r2;
+    int n, chunk;
+
+    e = mg_archive_find(arc, uri, uri_len);
+    if (e != NULL && (e->flags & MG_ARCHIVE_DIRECTORY) &&
+        uri[uri_len - 1] != '/') {
+        mg_printf(conn, "HTTP/1.1 301 Moved Permanently\r\n"
+                  "Location: %s/\r\n\r\n", uri);
+        return;
+    } else if (uri[uri_len - 1] == '/') {
+        if (e == NULL && uri_len > 1) {
+            // Directories are stored without the trailing slash
+            e = mg_archive_find(arc, uri, uri_len - 1);
+        }
+        if (uri_len == 1 || (e != NULL && (e->flags & MG_ARCHIVE_DIRECTORY))) {
+            if ((e = find_index_file(conn, arc, uri, uri_len)) == NULL) {
+                response_error(conn, 403, "Directory Listing Denied",
+                               "Directory listing denied");
+                return;
+            }
+        } else {
+            e = NULL;
+        }
+    }
+
+    if (e == NULL || (e->flags & MG_ARCHIVE_DIRECTORY) ||
+        must_hide_file(conn, uri) ||
+        ((e->flags & MG_ARCHIVE_GZ_ONLY) && !accepts_gzip(conn))) {
+        response_error(conn, 404, "Not Found", "%s", "File not found");
+        return;
+    }
+
+    // Serve precompressed body if the client takes it, same as for
+    // .gz files on disk. Range requests always get the plain body.
+    hdr = mg_get_known_header(conn, MG_HEADER_RANGE);
+    if ((e->flags & MG_ARCHIVE_GZ_ONLY) ||
+        (e->gz_size > 0 && hdr == NULL && accepts_gzip(conn))) {
+        body = arc->base + e->gz_offset;
+        size = (int64_t) e->gz_size;
+        etag = e->gz_etag;
+        encoding = "Content-Encoding: gzip\r\n";
+    } else {
+        body = arc->base + e->data_offset;
+        size = (int64_t) e->data_size;
+        etag = e->etag;
+    }
+
+    if (is_not_modified(conn, e, etag)) {
+        response_error(conn, 304, "Not Modified", "%s", "");
+        return;
+    }
+
+    mime = arc->base + e->mime_offset;
+    cl = size;
+    r1 = r2 = 0;
+    range[0] = '\0';
+    conn->status_code = 200;
+    if (hdr != NULL && (n = parse_range_header(hdr, &r1, &r2)) > 0 &&
+        r1 >= 0 && r2 >= 0) {
+        if (e->flags & MG_ARCHIVE_GZ_ONLY) {
+            response_error(conn, 501, "Not Implemented",
+                           "range requests in gzipped files are not supported");
+            return;
+        }
+        if (r1 > size) {
+            r1 = size;
+        }
+        conn->status_code = 206;
+        cl = n == 2 ? (r2 >= size ? size - 1 : r2) - r1 + 1 : size - r1;
+        if (cl < 0) {
+            cl = 0;
+        }
+        mg_snprintf(range, sizeof(range),
+                    "Content-Range: bytes "
+                    "%" INT64_FMT "-%"
+                    INT64_FMT "/%" INT64_FMT "\r\n",
+                    r1, r1 + cl - 1, size);
+        msg = "Partial Content";
+    }
+
+    gmt_time_string(date, sizeof(date), &curtime);
+    (void) mg_printf(conn,
+                     "HTTP/1.1 %d %s\r\n"
+                     "Date: %s\r\n"
+                     "Last-Modified: %s\r\n"
+                     "Etag: %s\r\n"
+                     "Content-Type: %.*s\r\n"
+                     "Content-Length: %" INT64_FMT "\r\n"
+                     "Connection: %s\r\n"
+                     "Accept-Ranges: bytes\r\n"
+                     "%s%s%s\r\n",
+                     conn->status_code, msg, date, e->last_modified, etag,
+                     (int) e->mime_len, mime, cl,
+                     suggest_connection_header(conn), range, encoding,
+                     EXTRA_HTTP_HEADERS);
+
+    if (conn->request_info.method != MG_METHOD_HEAD) {
+        body += r1;
+        while (cl > 0) {
+            chunk = cl > INT_MAX ? INT_MAX : (int) cl;
+            if ((n = mg_write(conn, body, chunk)) != chunk) {
+                break;
+            }
+            conn->num_bytes_sent += n;
+            body += n;
+            cl -= n;
+        }
+    }
+}
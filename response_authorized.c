@@ -7,7 +7,7 @@ void send_authorization_request(struct mg_connection *conn) {
             "Content-Length: 0\r\n"
             "WWW-Authenticate: Digest qop=\"auth\", "
             "realm=\"%s\", nonce=\"%lu\"\r\n\r\n",
-            conn->ctx->config[op("authentication_domain")],
+            conn->cfg->authentication_domain,
             (unsigned long) time(NULL));
 }
 
@@ -1,112 +1,145 @@
 #include "mingoose.h"
-struct dir_scan_data {
-    struct de *entries;
-    int num_entries;
-    int arr_size;
+
+#if !defined(LISTING_CHUNK_SIZE)
+#define LISTING_CHUNK_SIZE (256 * 1024)  // Send listings bigger than this chunked
+#endif
+#define LISTING_HEADER_ROOM 256          // Room for headers before the body
+
+// Listing output. Rows are formatted straight into one growing buffer,
+// which is sent with Content-Length in a single write if the whole
+// listing fits in LISTING_CHUNK_SIZE, or in chunks of that size if not.
+// Headers and chunk sizes go to the room left in front of the body, so
+// that every piece is one mg_write().
+struct listing_buf {
+    struct mg_connection *conn;
+    char *data;
+    size_t len;                 // Including the LISTING_HEADER_ROOM
+    size_t size;
+    const char *content_type;
+    int chunked;                // Headers are sent, body goes in chunks
+    int failed;                 // OOM or write error, stop producing
 };
 
+static int listing_reserve(struct listing_buf *lb, size_t n) {
+    size_t size = lb->size;
+    char *p;
 
-// Behaves like realloc(), but frees original pointer on failure
-static void *realloc2(void *ptr, size_t size) {
-    void *new_ptr = realloc(ptr, size);
-    if (new_ptr == NULL) {
-        free(ptr);
+    while (lb->len + n > size) {
+        size *= 2;
+    }
+    if (size != lb->size) {
+        if ((p = (char *) realloc(lb->data, size)) == NULL) {
+            lb->failed = 1;
+            return 0;
+        }
+        lb->data = p;
+        lb->size = size;
     }
-    return new_ptr;
+
+    return 1;
 }
 
+static void listing_printf(struct listing_buf *lb, const char *fmt, ...) {
+    va_list ap;
+    int n;
 
-static void dir_scan_callback(struct de *de, void *data) {
-    struct dir_scan_data *dsd = (struct dir_scan_data *) data;
+    if (lb->failed) {
+        return;
+    }
+
+    // One formatting pass, unless the row does not fit
+    va_start(ap, fmt);
+    n = vsnprintf(lb->data + lb->len, lb->size - lb->len, fmt, ap);
+    va_end(ap);
 
-    if (dsd->entries == NULL || dsd->num_entries >= dsd->arr_size) {
-        dsd->arr_size *= 2;
-        dsd->entries = (struct de *) realloc2(dsd->entries, dsd->arr_size *
-                                              sizeof(dsd->entries[0]));
+    if (n >= 0 && (size_t) n >= lb->size - lb->len &&
+        listing_reserve(lb, (size_t) n + 1)) {
+        va_start(ap, fmt);
+        n = vsnprintf(lb->data + lb->len, lb->size - lb->len, fmt, ap);
+        va_end(ap);
     }
-    if (dsd->entries == NULL) {
-        // TODO(lsm): propagate an error to the caller
-        dsd->num_entries = 0;
-    } else {
-        dsd->entries[dsd->num_entries].file_name = mg_strdup(de->file_name);
-        dsd->entries[dsd->num_entries].file = de->file;
-        dsd->entries[dsd->num_entries].conn = de->conn;
-        dsd->num_entries++;
+    if (n > 0 && !lb->failed) {
+        lb->len += n;
     }
 }
 
-static int scan_directory(struct mg_connection *conn, const char *dir,
-                          void *data, void (*cb)(struct de *, void *)) {
-    char path[PATH_MAX];
-    struct dirent *dp;
-    DIR *dirp;
-    struct de de;
+// Send the buffered part of the body as a chunk, sending the headers
+// first if needed.
+static void listing_send_chunk(struct listing_buf *lb) {
+    struct mg_connection *conn = lb->conn;
+    char hdr[LISTING_HEADER_ROOM];
+    size_t body_len = lb->len - LISTING_HEADER_ROOM;
+    int n = 0;
 
-    if ((dirp = opendir(dir)) == NULL) {
-        return 0;
-    } else {
-        de.conn = conn;
-
-        while ((dp = readdir(dirp)) != NULL) {
-            // Do not show current dir and hidden files
-            if (!strcmp(dp->d_name, ".") ||
-                !strcmp(dp->d_name, "..") ||
-                must_hide_file(conn, dp->d_name)) {
-                continue;
-            }
+    if (!lb->chunked) {
+        // HTTP/1.0 has no chunked encoding: end of body is the close
+        if (!strcmp(conn->request_info.http_version, "1.0")) {
+            conn->must_close = 1;
+        }
+        lb->chunked = conn->must_close ? 2 : 1;
+        n = mg_snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\n"
+                        "Content-Type: %s\r\n"
+                        "%s"
+                        "Connection: %s\r\n\r\n", lb->content_type,
+                        lb->chunked == 1 ? "Transfer-Encoding: chunked\r\n" : "",
+                        suggest_connection_header(conn));
+    }
+    if (lb->chunked == 1) {
+        n += mg_snprintf(hdr + n, sizeof(hdr) - n, "%lX\r\n",
+                         (unsigned long) body_len);
+    }
+    if (lb->chunked == 1 && listing_reserve(lb, 2)) {
+        memcpy(lb->data + lb->len, "\r\n", 2);
+        lb->len += 2;
+    }
 
-            mg_snprintf(path, sizeof(path), "%s%c%s", dir, '/', dp->d_name);
+    memcpy(lb->data + LISTING_HEADER_ROOM - n, hdr, n);
+    if (!lb->failed &&
+        mg_write(conn, lb->data + LISTING_HEADER_ROOM - n,
+                 lb->len - LISTING_HEADER_ROOM + n) !=
+        (int) (lb->len - LISTING_HEADER_ROOM + n)) {
+        lb->failed = 1;
+    }
+    conn->num_bytes_sent += body_len;
+    lb->len = LISTING_HEADER_ROOM;
+}
 
-            // If we don't memset stat structure to zero, mtime will have
-            // garbage and strftime() will segfault later on in
-            // print_dir_entry(). memset is required only if mg_stat()
-            // fails. For more details, see
-            // http://code.google.com/p/mongoose/issues/detail?id=79
-            memset(&de.file, 0, sizeof(de.file));
-            mg_stat(path, &de.file);
+// Send everything that is left, and finish the response.
+static void listing_finish(struct listing_buf *lb) {
+    struct mg_connection *conn = lb->conn;
+    char hdr[LISTING_HEADER_ROOM];
+    size_t body_len = lb->len - LISTING_HEADER_ROOM;
+    int n, is_head = conn->request_info.method == MG_METHOD_HEAD;
 
-            de.file_name = dp->d_name;
-            cb(&de, data);
+    if (lb->failed) {
+        conn->must_close = 1;
+    } else if (!lb->chunked) {
+        // Whole listing is in the buffer: send it in one go
+        n = mg_snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\n"
+                        "Content-Type: %s\r\n"
+                        "Content-Length: %lu\r\n"
+                        "Connection: %s\r\n\r\n",
+                        lb->content_type, (unsigned long) body_len,
+                        suggest_connection_header(conn));
+        memcpy(lb->data + LISTING_HEADER_ROOM - n, hdr, n);
+        mg_write(conn, lb->data + LISTING_HEADER_ROOM - n,
+                 is_head ? (size_t) n : (size_t) n + body_len);
+        conn->num_bytes_sent += is_head ? 0 : body_len;
+    } else {
+        if (body_len > 0) {
+            listing_send_chunk(lb);
+        }
+        if (lb->chunked == 1) {
+            mg_write(conn, "0\r\n\r\n", 5);
         }
-        (void) closedir(dirp);
     }
-    return 1;
-}
-
-// This function is called from send_directory() and used for
-// sorting directory entries by size, or name, or modification time.
-// On windows, __cdecl specification is needed in case if project is built
-// with __stdcall convention. qsort always requires __cdels callback.
-static int compare_dir_entries(const void *p1, const void *p2) {
-    const struct de *a = (const struct de *) p1, *b = (const struct de *) p2;
-    const char *query_string = a->conn->request_info.query_string;
-    int cmp_result = 0;
-
-    if (query_string == NULL) {
-        query_string = "na";
-    }
-
-    if (a->file.is_directory && !b->file.is_directory) {
-        return -1;  // Always put directories on top
-    } else if (!a->file.is_directory && b->file.is_directory) {
-        return 1;   // Always put directories on top
-    } else if (*query_string == 'n') {
-        cmp_result = strcmp(a->file_name, b->file_name);
-    } else if (*query_string == 's') {
-        cmp_result = a->file.size == b->file.size ? 0 :
-            a->file.size > b->file.size ? 1 : -1;
-    } else if (*query_string == 'd') {
-        cmp_result = a->file.modification_time == b->file.modification_time ? 0 :
-            a->file.modification_time > b->file.modification_time ? 1 : -1;
-    }
-
-    return query_string[1] == 'd' ? -cmp_result : cmp_result;
+    free(lb->data);
 }
 
-
-static void print_dir_entry(const struct de *de) {
+static void print_dir_entry(struct listing_buf *lb, const struct de *de) {
     char size[64], mod[64], href[PATH_MAX * 3];
     const char *slash = de->file.is_directory ? "/" : "";
+    struct tm tm;
 
     if (de->file.is_directory) {
         mg_snprintf(size, sizeof(size), "%s", "[DIRECTORY]");
@@ -127,63 +160,306 @@ static void print_dir_entry(const struct de *de) {
         }
     }
     strftime(mod, sizeof(mod), "%d-%b-%Y %H:%M",
-             localtime(&de->file.modification_time));
+             localtime_r(&de->file.modification_time, &tm));
     mg_url_encode(de->file_name, href, sizeof(href));
-    de->conn->num_bytes_sent += mg_chunked_printf(de->conn,
-                                                  "<tr><td><a href=\"%s%s%s\">%s%s</a></td>"
-                                                  "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
-                                                  de->conn->request_info.uri, href, slash, de->file_name, slash, mod, size);
+    listing_printf(lb, "<tr><td><a href=\"%s%s%s\">%s%s</a></td>"
+                   "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
+                   de->conn->request_info.uri, href, slash, de->file_name,
+                   slash, mod, size);
+}
+
+// Flush the buffer as a chunk if it has grown big. HEAD is answered
+// with the Content-Length, so its body is never sent in chunks.
+static void listing_maybe_flush(struct listing_buf *lb) {
+    if (lb->len - LISTING_HEADER_ROOM >= LISTING_CHUNK_SIZE &&
+        lb->conn->request_info.method != MG_METHOD_HEAD) {
+        listing_send_chunk(lb);
+    }
+}
+
+// Append s as a JSON string, quotes included.
+static void listing_json_string(struct listing_buf *lb, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned char c;
+
+    if (!listing_reserve(lb, strlen(s) * 6 + 2)) {
+        return;
+    }
+    lb->data[lb->len++] = '"';
+    for (; (c = * (const unsigned char *) s) != '\0'; s++) {
+        if (c == '"' || c == '\\') {
+            lb->data[lb->len++] = '\\';
+            lb->data[lb->len++] = c;
+        } else if (c < 0x20) {
+            memcpy(lb->data + lb->len, "\\u00", 4);
+            lb->data[lb->len + 4] = hex[c >> 4];
+            lb->data[lb->len + 5] = hex[c & 15];
+            lb->len += 6;
+        } else {
+            lb->data[lb->len++] = c;
+        }
+    }
+    lb->data[lb->len++] = '"';
+}
+
+#if !defined(LISTING_DEFAULT_LIMIT)
+#define LISTING_DEFAULT_LIMIT 1000      // Entries per page of the API
+#endif
+#if !defined(LISTING_MAX_LIMIT)
+#define LISTING_MAX_LIMIT 100000
+#endif
+
+// Page of a machine readable listing, parsed from the query string:
+// ?format=json|ndjson&sort=name|size|mtime&order=asc|desc&limit=N&cursor=C
+struct listing_query {
+    const struct dir_listing *l;
+    int key;                    // 0 name, 1 size, 2 mtime
+    int desc;
+    int limit;
+    int has_cursor;
+    int64_t cursor_value;       // Cursor is the last entry of the previous
+    const char *cursor_name;    // page: "value/name", or "name" for names
+};
+
+static int64_t entry_value(const struct dir_entry *e, int key) {
+    return key == 1 ? e->file.size :
+        key == 2 ? (int64_t) e->file.modification_time : 0;
+}
+
+// Total order of the page: by key, then by name, which is unique.
+static int compare_value_name(const struct listing_query *q,
+                              int64_t va, const char *na,
+                              int64_t vb, const char *nb) {
+    int cmp = va < vb ? -1 : va > vb ? 1 : strcmp(na, nb);
+    return q->desc ? -cmp : cmp;
+}
+
+static int compare_page_entries(const void *p1, const void *p2, void *arg) {
+    const struct listing_query *q = (const struct listing_query *) arg;
+    const struct dir_entry *a = &q->l->entries[* (const int *) p1];
+    const struct dir_entry *b = &q->l->entries[* (const int *) p2];
+    return compare_value_name(q, entry_value(a, q->key),
+                              q->l->names + a->name_offset,
+                              entry_value(b, q->key),
+                              q->l->names + b->name_offset);
+}
+
+// Restore max-heap order below index i, the root being the entry that
+// comes last in the page.
+static void sift_down(int *heap, int n, int i, struct listing_query *q) {
+    int child, tmp;
+
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n &&
+            compare_page_entries(&heap[child + 1], &heap[child], q) > 0) {
+            child++;
+        }
+        if (compare_page_entries(&heap[child], &heap[i], q) <= 0) {
+            break;
+        }
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
+
+static void sift_up(int *heap, int i, struct listing_query *q) {
+    int parent, tmp;
+
+    while (i > 0 &&
+           compare_page_entries(&heap[i], &heap[parent = (i - 1) / 2], q) > 0) {
+        tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+static void parse_listing_query(struct mg_connection *conn,
+                                struct listing_query *q, char *cursor,
+                                size_t cursor_len) {
+    const char *qs = conn->request_info.query_string;
+    size_t qs_len = strlen(qs);
+    char buf[32], *end;
+
+    q->key = 0;
+    if (mg_get_var(qs, qs_len, "sort", buf, sizeof(buf)) > 0) {
+        q->key = !strcmp(buf, "size") ? 1 : !strcmp(buf, "mtime") ? 2 : 0;
+    }
+    q->desc = mg_get_var(qs, qs_len, "order", buf, sizeof(buf)) > 0 &&
+        !strcmp(buf, "desc");
+    q->limit = LISTING_DEFAULT_LIMIT;
+    if (mg_get_var(qs, qs_len, "limit", buf, sizeof(buf)) > 0) {
+        q->limit = atoi(buf);
+    }
+    if (q->limit <= 0 || q->limit > LISTING_MAX_LIMIT) {
+        q->limit = LISTING_MAX_LIMIT;
+    }
+
+    q->has_cursor = mg_get_var(qs, qs_len, "cursor", cursor, cursor_len) > 0;
+    q->cursor_value = 0;
+    q->cursor_name = cursor;
+    if (q->has_cursor && q->key != 0) {
+        q->cursor_value = strtoll(cursor, &end, 10);
+        q->cursor_name = *end == '/' ? end + 1 : end;
+    }
+}
+
+// Machine readable listing. Only the page is sorted: entries after the
+// cursor go through a max-heap of limit entries, O(n log limit).
+static void send_listing_page(struct mg_connection *conn,
+                              struct dir_listing *listing,
+                              struct listing_buf *lb, int ndjson) {
+    struct listing_query q;
+    const struct dir_entry *e;
+    char cursor[PATH_MAX];
+    int *heap, i, n = 0, more = 0;
+
+    q.l = listing;
+    parse_listing_query(conn, &q, cursor, sizeof(cursor));
+    if ((heap = (int *) malloc(((size_t) (q.limit < listing->num_entries ?
+                                          q.limit : listing->num_entries) + 1) *
+                               sizeof(int))) == NULL) {
+        lb->failed = 1;
+        return;
+    }
+
+    for (i = 0; i < listing->num_entries; i++) {
+        e = &listing->entries[i];
+        if (q.has_cursor &&
+            compare_value_name(&q, entry_value(e, q.key),
+                               listing->names + e->name_offset,
+                               q.cursor_value, q.cursor_name) <= 0) {
+            continue;
+        } else if (n < q.limit) {
+            heap[n] = i;
+            sift_up(heap, n++, &q);
+        } else {
+            more = 1;
+            if (compare_page_entries(&i, &heap[0], &q) < 0) {
+                heap[0] = i;
+                sift_down(heap, n, 0, &q);
+            }
+        }
+    }
+    qsort_r(heap, (size_t) n, sizeof(heap[0]), compare_page_entries, &q);
+
+    if (!ndjson) {
+        listing_printf(lb, "%s", "{\"entries\":[");
+    }
+    for (i = 0; i < n && !lb->failed; i++) {
+        e = &listing->entries[heap[i]];
+        listing_printf(lb, "%s{\"name\":", i > 0 && !ndjson ? "," : "");
+        listing_json_string(lb, listing->names + e->name_offset);
+        listing_printf(lb, ",\"type\":\"%s\",\"size\":%" INT64_FMT
+                       ",\"mtime\":%" INT64_FMT "}%s",
+                       e->file.is_directory ? "dir" : "file", e->file.size,
+                       (int64_t) e->file.modification_time,
+                       ndjson ? "\n" : "");
+        listing_maybe_flush(lb);
+    }
+
+    // Cursor is the last entry sent, pass it back to get the next page
+    if (more && n > 0) {
+        e = &listing->entries[heap[n - 1]];
+        if (q.key == 0) {
+            mg_snprintf(cursor, sizeof(cursor), "%s",
+                        listing->names + e->name_offset);
+        } else {
+            mg_snprintf(cursor, sizeof(cursor), "%" INT64_FMT "/%s",
+                        entry_value(e, q.key), listing->names + e->name_offset);
+        }
+        listing_printf(lb, "%s\"next_cursor\":", ndjson ? "{" : "],");
+        listing_json_string(lb, cursor);
+        listing_printf(lb, "}\n");
+    } else if (!ndjson) {
+        listing_printf(lb, "%s", "],\"next_cursor\":null}\n");
+    }
+    free(heap);
 }
 
 void response_directory_index(struct mg_connection *conn,
                                      const char *dir) {
     int i, sort_direction;
-    struct dir_scan_data data = { NULL, 0, 128 };
+    struct dir_listing *listing;
+    struct listing_buf lb;
+    const int *order;
+    char format[16];
+    struct de de;
 
-    if (!scan_directory(conn, dir, &data, dir_scan_callback)) {
+    // Snapshot is shared with other requests for the same directory
+    if ((listing = dir_listing_get(conn, dir)) == NULL) {
         response_error(conn, 500, "Cannot open directory",
                         "Error: opendir(%s): %s", dir, strerror(ERRNO));
         return;
+    } else if ((lb.data = (char *) malloc(MG_BUF_LEN * 4)) == NULL) {
+        dir_listing_release(listing);
+        response_error(conn, 500, http_500_error, "%s", "Out of memory");
+        return;
+    }
+
+    lb.conn = conn;
+    lb.len = LISTING_HEADER_ROOM;
+    lb.size = MG_BUF_LEN * 4;
+    lb.content_type = "text/html; charset=utf-8";
+    lb.chunked = lb.failed = 0;
+    conn->status_code = 200;
+
+    // ?format=json or ?format=ndjson asks for a machine readable page,
+    // picked from the unsorted entries
+    if (conn->request_info.query_string != NULL &&
+        mg_get_var(conn->request_info.query_string,
+                   strlen(conn->request_info.query_string), "format",
+                   format, sizeof(format)) > 0 &&
+        (!strcmp(format, "json") || !strcmp(format, "ndjson"))) {
+        lb.content_type = format[0] == 'j' ? "application/json" :
+            "application/x-ndjson";
+        send_listing_page(conn, listing, &lb, format[0] == 'n');
+        dir_listing_release(listing);
+        listing_finish(&lb);
+        return;
+    }
+
+    // The HTML page lists everything, in the full sort order
+    if ((order = dir_listing_order(listing, dir_sort_order(
+        conn->request_info.query_string))) == NULL) {
+        dir_listing_release(listing);
+        free(lb.data);
+        response_error(conn, 500, http_500_error, "%s", "Out of memory");
+        return;
     }
 
     sort_direction = conn->request_info.query_string != NULL &&
         conn->request_info.query_string[1] == 'd' ? 'a' : 'd';
 
-    conn->must_close = 1;
-    mg_printf(conn, "%s",
-              "HTTP/1.1 200 OK\r\n"
-              "Transfer-Encoding: Chunked\r\n"
-              "Content-Type: text/html; charset=utf-8\r\n\r\n");
-
-    conn->num_bytes_sent += mg_chunked_printf(conn,
-                                              "<html><head><title>Index of %s</title>"
-                                              "<style>th {text-align: left;}</style></head>"
-                                              "<body><h1>Index of %s</h1><pre><table cellpadding=\"0\">"
-                                              "<tr><th><a href=\"?n%c\">Name</a></th>"
-                                              "<th><a href=\"?d%c\">Modified</a></th>"
-                                              "<th><a href=\"?s%c\">Size</a></th></tr>"
-                                              "<tr><td colspan=\"3\"><hr></td></tr>",
-                                              conn->request_info.uri, conn->request_info.uri,
-                                              sort_direction, sort_direction, sort_direction);
+    listing_printf(&lb,
+                   "<html><head><title>Index of %s</title>"
+                   "<style>th {text-align: left;}</style></head>"
+                   "<body><h1>Index of %s</h1><pre><table cellpadding=\"0\">"
+                   "<tr><th><a href=\"?n%c\">Name</a></th>"
+                   "<th><a href=\"?d%c\">Modified</a></th>"
+                   "<th><a href=\"?s%c\">Size</a></th></tr>"
+                   "<tr><td colspan=\"3\"><hr></td></tr>",
+                   conn->request_info.uri, conn->request_info.uri,
+                   sort_direction, sort_direction, sort_direction);
 
     // Print first entry - link to a parent directory
-    conn->num_bytes_sent += mg_chunked_printf(conn,
-                                              "<tr><td><a href=\"%s%s\">%s</a></td>"
-                                              "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
-                                              conn->request_info.uri, "..", "Parent directory", "-", "-");
-
-    // Sort and print directory entries
-    qsort(data.entries, (size_t) data.num_entries, sizeof(data.entries[0]),
-          compare_dir_entries);
-    for (i = 0; i < data.num_entries; i++) {
-        print_dir_entry(&data.entries[i]);
-        free(data.entries[i].file_name);
-    }
-    free(data.entries);
-
-    conn->num_bytes_sent += mg_chunked_printf(conn, "%s",
-                                              "</table></body></html>");
-    conn->num_bytes_sent += mg_write(conn, "0\r\n\r\n", 5);
-    conn->status_code = 200;
-}
+    listing_printf(&lb,
+                   "<tr><td><a href=\"%s%s\">%s</a></td>"
+                   "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
+                   conn->request_info.uri, "..", "Parent directory", "-", "-");
 
+    // Print directory entries
+    de.conn = conn;
+    for (i = 0; i < listing->num_entries && !lb.failed; i++) {
+        de.file_name = listing->names + listing->entries[order[i]].name_offset;
+        de.file = listing->entries[order[i]].file;
+        print_dir_entry(&lb, &de);
+        listing_maybe_flush(&lb);
+    }
+    dir_listing_release(listing);
+
+    listing_printf(&lb, "%s", "</table></body></html>");
+    listing_finish(&lb);
+}
@@ -1,85 +1,175 @@
 #include "mingoose.h"
-// Look at the "path" extension and figure what mime type it has.
-// Store mime type in the vector.
-static void get_mime_type(const char *path,
-                          struct vec *vec) {
 
-    vec->ptr = mg_get_builtin_mime_type(path);
-    vec->len = strlen(vec->ptr);
-}
+#if !defined(MAX_READ_WINDOW)
+#define MAX_READ_WINDOW (512 * 1024)  // Largest read size for big files
+#endif
+
+// Make sure conn->io_buf holds two buffers of at least size bytes.
+// Return the size of each buffer, which may be smaller on OOM.
+static int reserve_io_buf(struct mg_connection *conn, int size) {
+    char *p;
 
-// Send len bytes from the opened file to the client.
-static void send_file_data(struct mg_connection *conn, FILE *fp,
-                           int64_t offset, int64_t len) {
-    char buf[MG_BUF_LEN];
-    int num_read, num_written, to_read;
+    if (conn->io_buf_size < size &&
+        (p = (char *) malloc(2 * (size_t) size)) != NULL) {
+        free(conn->io_buf);
+        conn->io_buf = p;
+        conn->io_buf_size = size;
+    }
 
-    // If offset is beyond file boundaries, don't send anything
-    if (offset > 0 && fseeko(fp, offset, SEEK_SET) != 0) {
+    return conn->io_buf_size;
+}
+
+// Send len bytes from the opened file to the client. Chunks not in the
+// page cache are read by the I/O pool, and the next chunk is read while
+// the current one is being sent.
+//
+// Reads start at MG_BUF_LEN and double while access stays sequential, up
+// to MAX_READ_WINDOW. The window is kept per connection, so that a client
+// fetching a video with consecutive Range requests keeps it growing.
+static void send_file_data(struct mg_connection *conn, const char *path,
+                           int fd, int64_t offset, int64_t len) {
+    char stack_buf[2][MG_BUF_LEN], *buf[2];
+    struct io_request req;
+    unsigned int file_id = mg_hash(path, strlen(path));
+    int cur = 0, num_written, window, max_window;
+    ssize_t num_read;
+    size_t to_read;
+
+    if (len <= 0) {
         return;
     }
 
+    // Continue where the previous request on this connection stopped?
+    if (file_id == conn->ra_file && offset == conn->ra_next &&
+        conn->ra_window > 0) {
+        window = conn->ra_window;
+    } else {
+        window = MG_BUF_LEN;
+    }
+
+    // Big reads do not make throttled connections any faster
+    max_window = len < MAX_READ_WINDOW ? (int) len : MAX_READ_WINDOW;
+    if (conn->throttle > 0 && conn->throttle < max_window) {
+        max_window = conn->throttle;
+    }
+    if (max_window < MG_BUF_LEN) {
+        max_window = MG_BUF_LEN;
+    }
+    if (window > max_window) {
+        window = max_window;
+    }
+
+    if (max_window > MG_BUF_LEN &&
+        (max_window = reserve_io_buf(conn, max_window)) >= MG_BUF_LEN) {
+        buf[0] = conn->io_buf;
+        buf[1] = conn->io_buf + max_window;
+        // Let the kernel read ahead aggressively, this is a big transfer
+        (void) posix_fadvise(fd, offset, len, POSIX_FADV_SEQUENTIAL);
+    } else {
+        buf[0] = stack_buf[0];
+        buf[1] = stack_buf[1];
+        max_window = window = MG_BUF_LEN;
+    }
+
+    to_read = len < window ? (size_t) len : (size_t) window;
+    io_read_start(&req, fd, buf[cur], to_read, offset);
     while (len > 0) {
-        // Calculate how much to read from the file in the buffer
-        to_read = sizeof(buf);
-        if ((int64_t) to_read > len) {
-            to_read = (int) len;
+        // Exit the loop on error, or if offset is beyond file boundaries
+        if ((num_read = io_read_finish(&req)) <= 0) {
+            break;
+        }
+        offset += num_read;
+
+        // Full chunk read, access is sequential: read more at once. Ask
+        // the kernel to start on the chunk after the next one.
+        if ((size_t) num_read == to_read && window < max_window) {
+            window = window * 2 > max_window ? max_window : window * 2;
+            (void) posix_fadvise(fd, offset + window, window,
+                                 POSIX_FADV_WILLNEED);
         }
 
-        // Read from file, exit the loop on error
-        if ((num_read = fread(buf, 1, (size_t) to_read, fp)) <= 0) {
-            break;
+        // Prefetch the next chunk into the other buffer
+        if (len - num_read > 0) {
+            to_read = len - num_read < window ?
+                (size_t) (len - num_read) : (size_t) window;
+            io_read_start(&req, fd, buf[!cur], to_read, offset);
         }
 
-        // Send read bytes to the client, exit the loop on error
-        if ((num_written = mg_write(conn, buf, (size_t) num_read)) != num_read) {
+        // Send read bytes to the client, exit the loop on error.
+        // In-flight prefetch is picked up below, buf must outlive it.
+        if ((num_written = mg_write(conn, buf[cur], (size_t) num_read)) != num_read) {
+            if (len - num_read > 0) {
+                (void) io_read_finish(&req);
+            }
             break;
         }
 
         // Both read and were successful, adjust counters
         conn->num_bytes_sent += num_written;
         len -= num_written;
+        cur = !cur;
     }
+
+    conn->ra_file = file_id;
+    conn->ra_next = offset;
+    conn->ra_window = window;
 }
 
+// Send len bytes of the cached file body to the client.
+static void send_content_data(struct mg_connection *conn,
+                              const struct file_content *content,
+                              int64_t offset, int64_t len) {
+    if (offset < 0 || offset >= content->len) {
+        return;
+    } else if (len > content->len - offset) {
+        len = content->len - offset;
+    }
+    if (len > 0) {
+        conn->num_bytes_sent += mg_write(conn, content->data + offset, (int) len);
+    }
+}
 
-void response_file(struct mg_connection *conn, const char *path,
-                                struct file *filep) {
-    char date[64], lm[64], etag[64], range[64];
-    const char *msg = "OK", *hdr;
+
+// Serve the resolved file. MIME type, Etag and Last-Modified come
+// pre-rendered with the resolution, and HEAD requests never touch the
+// file, so both can be answered from the resolution cache alone.
+void response_file(struct mg_connection *conn, const struct resolution *res) {
+    const struct file *filep = &res->file;
+    const char *path = res->file_path, *msg = "OK", *hdr;
+    char date[64], range[64];
     time_t curtime = time(NULL);
     int64_t cl, r1, r2;
-    struct vec mime_vec;
-    int n;
+    int n, is_head = conn->request_info.method == MG_METHOD_HEAD;
     char gz_path[PATH_MAX];
     char const* encoding = "";
-    FILE *fp;
+    struct file_content *content = NULL;
+    int fd = -1;
 
-    get_mime_type(path, &mime_vec);
     cl = filep->size;
     conn->status_code = 200;
     range[0] = '\0';
 
-    // if this file is in fact a pre-gzipped file, rewrite its filename
-    // it's important to rewrite the filename after resolving
-    // the mime type from it, to preserve the actual file's type
+    // if this file is in fact a pre-gzipped file, rewrite its filename.
+    // MIME type has been resolved from the original name.
     if (filep->gzipped) {
-        snprintf(gz_path, sizeof(gz_path), "%s.gz", path);
+        mg_snprintf(gz_path, sizeof(gz_path), "%s.gz", path);
         path = gz_path;
         encoding = "Content-Encoding: gzip\r\n";
     }
 
-    if ((fp = fopen(path, "rb")) == NULL) {
-        response_error(conn, 500, http_500_error,
-                        "fopen(%s): %s", path, strerror(ERRNO));
-        return;
+    // Small files are served from memory. If another thread is reading
+    // this file right now, this waits for it instead of reading it again.
+    if (!is_head && (content = file_cache_get_content(path, filep)) == NULL) {
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+            response_error(conn, 500, http_500_error,
+                            "open(%s): %s", path, strerror(ERRNO));
+            return;
+        }
     }
 
-    fclose_on_exec(fp);
-
     // If Range: header specified, act accordingly
     r1 = r2 = 0;
-    hdr = mg_get_header(conn, "Range");
+    hdr = mg_get_known_header(conn, MG_HEADER_RANGE);
     if (hdr != NULL && (n = parse_range_header(hdr, &r1, &r2)) > 0 &&
         r1 >= 0 && r2 >= 0) {
         // actually, range requests don't play well with a pre-gzipped
@@ -87,6 +177,10 @@ void response_file(struct mg_connection *conn, const char *path,
         if (filep->gzipped) {
             response_error(conn, 501, "Not Implemented",
                             "range requests in gzipped files are not supported");
+            file_content_release(content);
+            if (fd >= 0) {
+                close(fd);
+            }
             return;
         }
         conn->status_code = 206;
@@ -99,28 +193,29 @@ void response_file(struct mg_connection *conn, const char *path,
         msg = "Partial Content";
     }
 
-    // Prepare Etag, Date, Last-Modified headers. Must be in UTC, according to
+    // Date must be in UTC, according to
     // http://www.w3.org/Protocols/rfc2616/rfc2616-sec3.html#sec3.3
     gmt_time_string(date, sizeof(date), &curtime);
-    gmt_time_string(lm, sizeof(lm), &filep->modification_time);
-    construct_etag(etag, sizeof(etag), filep);
 
     (void) mg_printf(conn,
                      "HTTP/1.1 %d %s\r\n"
                      "Date: %s\r\n"
                      "Last-Modified: %s\r\n"
                      "Etag: %s\r\n"
-                     "Content-Type: %.*s\r\n"
+                     "Content-Type: %s\r\n"
                      "Content-Length: %" INT64_FMT "\r\n"
                      "Connection: %s\r\n"
                      "Accept-Ranges: bytes\r\n"
                      "%s%s%s\r\n",
-                     conn->status_code, msg, date, lm, etag, (int) mime_vec.len,
-                     mime_vec.ptr, cl, suggest_connection_header(conn), range, encoding,
-                     EXTRA_HTTP_HEADERS);
-
-    if (strcmp(conn->request_info.request_method, "HEAD") != 0) {
-        send_file_data(conn, fp, r1, cl);
+                     conn->status_code, msg, date, res->last_modified,
+                     res->etag, res->mime, cl, suggest_connection_header(conn),
+                     range, encoding, EXTRA_HTTP_HEADERS);
+
+    if (content != NULL) {
+        send_content_data(conn, content, r1, cl);
+        file_content_release(content);
+    } else if (fd >= 0) {
+        send_file_data(conn, path, fd, r1, cl);
+        close(fd);
     }
-    fclose(fp);
 }
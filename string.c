@@ -13,6 +13,17 @@ void mg_strlcpy(register char *dst, register const char *src, size_t n) {
   *dst = '\0';
 }
 
+// FNV-1a hash of the given memory chunk.
+unsigned int mg_hash(const char *s, size_t len) {
+  unsigned int hash = 2166136261U;
+
+  while (len-- > 0) {
+    hash = (hash ^ * (const unsigned char *) s++) * 16777619U;
+  }
+
+  return hash;
+}
+
 char * mg_strndup(const char *ptr, size_t len) {
   char *p;
 
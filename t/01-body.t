@@ -0,0 +1,7 @@
+#!/usr/bin/env perl
+# Request body unit tests, see body_test.c
+use strict;
+use warnings;
+use FindBin;
+
+exec "$FindBin::Bin/body_test" or die "Cannot run body_test: $!";
@@ -0,0 +1,110 @@
+#!/usr/bin/env perl
+# Chunked request bodies over a real connection: chunks split across
+# reads, extensions and trailers, and a request pipelined after the body.
+use strict;
+use warnings;
+use Test::More;
+use FindBin;
+use File::Temp qw(tempdir);
+use IO::Socket::INET;
+use Digest::MD5 qw(md5_hex);
+use Time::HiRes qw(sleep);
+
+my $port = 18089;
+my $root = tempdir(CLEANUP => 1);
+my $passwords = File::Temp->new;
+open my $fh, '>', "$passwords" or die;
+print $fh "joe:dom:" . md5_hex("joe:dom:pw") . "\n";
+close $fh;
+
+my $pid = fork;
+if ($pid == 0) {
+    open STDOUT, '>', '/dev/null';
+    open STDERR, '>', '/dev/null';
+    exec "$FindBin::Bin/../mingoose", '-document_root', $root,
+        '-listening_ports', $port, '-enable_keep_alive', 'yes',
+        '-authentication_domain', 'dom',
+        '-put_delete_auth_file', "$passwords";
+    exit 1;
+}
+
+my $sock;
+for (1 .. 50) {
+    last if $sock = IO::Socket::INET->new("127.0.0.1:$port");
+    sleep 0.1;
+}
+ok $sock, 'server is up';
+
+# Digest authorization, the server does not check the nonce age
+sub authorization {
+    my ($method, $uri) = @_;
+    my $response = md5_hex(join ':', md5_hex("joe:dom:pw"), '1', '00000001',
+                           'c', 'auth', md5_hex("$method:$uri"));
+    return qq{Authorization: Digest username="joe", realm="dom", } .
+        qq{nonce="1", uri="$uri", nc=00000001, cnonce="c", qop=auth, } .
+        qq{response="$response"\r\n};
+}
+
+sub read_all {
+    my ($s) = @_;
+    local $/;
+    return scalar <$s> // '';
+}
+
+my $body = "hello, chunked world " x 100;
+my $chunked = sprintf("5;name=value\r\n%s\r\n", substr($body, 0, 5)) .
+    sprintf("%x ; ext\r\n%s\r\n", length($body) - 5, substr($body, 5)) .
+    "0\r\nX-Trailer: 1\r\n\r\n";
+my $request = "PUT /c.txt HTTP/1.1\r\n" . authorization('PUT', '/c.txt') .
+    "Transfer-Encoding: chunked\r\n\r\n" . $chunked .
+    "GET /c.txt HTTP/1.1\r\nConnection: close\r\n\r\n";
+
+# Small writes, so that chunk lines and data straddle reads
+for (my $i = 0; $i < length $request; $i += 7) {
+    print $sock substr($request, $i, 7);
+    sleep 0.001;
+}
+my $reply = read_all($sock);
+like $reply, qr{^HTTP/1.1 201 }, 'chunked PUT created the file';
+like $reply, qr{\r\n\r\nHTTP/1.1 200 OK\r\n}, 'pipelined GET answered';
+ok substr($reply, -length $body) eq $body, 'file has the decoded body';
+
+# Pipelined request in the same packet as the end of the body
+$sock = IO::Socket::INET->new("127.0.0.1:$port");
+print $sock "PUT /d.txt HTTP/1.1\r\n" . authorization('PUT', '/d.txt') .
+    "Transfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n0\r\n\r\n" .
+    "GET /d.txt HTTP/1.1\r\nConnection: close\r\n\r\n";
+$reply = read_all($sock);
+like $reply, qr{^HTTP/1.1 201 .*\r\n\r\nHTTP/1.1 200 OK\r\n.*\r\n\r\nabc$}s,
+    'request pipelined in the same packet';
+
+# A chunked request pipelined after one that filled the receive buffer:
+# its chunk size line starts in the last byte of the buffer
+$sock = IO::Socket::INET->new("127.0.0.1:$port");
+my $put = "PUT /f.txt HTTP/1.1\r\n" . authorization('PUT', '/f.txt') .
+    "Transfer-Encoding: chunked\r\n\r\n";
+my $get = "GET /d.txt HTTP/1.1\r\nX-Pad: \r\n\r\n";
+my $pad = 16384 - length($get) - length($put) - 1;
+$get =~ s/X-Pad: /'X-Pad: ' . ('a' x $pad)/e;
+print $sock $get . $put . '1';
+sleep 0.3;
+print $sock "0\r\n0123456789abcdef\r\n0\r\n\r\n" .
+    "GET /f.txt HTTP/1.1\r\nConnection: close\r\n\r\n";
+$reply = read_all($sock);
+like $reply, qr{^HTTP/1.1 200 .*\r\n\r\nabcHTTP/1.1 201 }s,
+    'chunked request at the end of the buffer';
+like $reply, qr{\r\n\r\n0123456789abcdef$}, 'its body is complete';
+
+# A malformed chunk closes the connection, nothing after it is served
+$sock = IO::Socket::INET->new("127.0.0.1:$port");
+print $sock "PUT /e.txt HTTP/1.1\r\n" . authorization('PUT', '/e.txt') .
+    "Transfer-Encoding: chunked\r\n\r\nzz\r\nabc\r\n0\r\n\r\n" .
+    "GET /c.txt HTTP/1.1\r\n\r\n";
+$reply = read_all($sock);
+unlike $reply, qr{^HTTP/1.1 20}, 'malformed chunk is refused';
+unlike $reply, qr{HTTP/1.1 200 OK}, 'connection closed after it';
+
+kill 'TERM', $pid;
+waitpid $pid, 0;
+
+done_testing();
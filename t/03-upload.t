@@ -0,0 +1,118 @@
+#!/usr/bin/env perl
+# Resumable uploads: pieces out of order and overlapping, status queries,
+# conflicting sizes and the commit of the complete file.
+use strict;
+use warnings;
+use Test::More;
+use FindBin;
+use File::Temp qw(tempdir);
+use IO::Socket::INET;
+use Digest::MD5 qw(md5_hex);
+use Time::HiRes qw(sleep);
+
+my $port = 18090;
+my $root = tempdir(CLEANUP => 1);
+my $passwords = File::Temp->new;
+open my $fh, '>', "$passwords" or die;
+print $fh "joe:dom:" . md5_hex("joe:dom:pw") . "\n";
+close $fh;
+
+my $pid = fork;
+if ($pid == 0) {
+    open STDOUT, '>', '/dev/null';
+    open STDERR, '>', '/dev/null';
+    exec "$FindBin::Bin/../mingoose", '-document_root', $root,
+        '-listening_ports', $port,
+        '-authentication_domain', 'dom',
+        '-put_delete_auth_file', "$passwords";
+    exit 1;
+}
+
+my $sock;
+for (1 .. 50) {
+    last if $sock = IO::Socket::INET->new("127.0.0.1:$port");
+    sleep 0.1;
+}
+ok $sock, 'server is up';
+close $sock if $sock;
+
+# Digest authorization, the server does not check the nonce age
+sub authorization {
+    my ($method, $uri) = @_;
+    my $response = md5_hex(join ':', md5_hex("joe:dom:pw"), '1', '00000001',
+                           'c', 'auth', md5_hex("$method:$uri"));
+    return qq{Authorization: Digest username="joe", realm="dom", } .
+        qq{nonce="1", uri="$uri", nc=00000001, cnonce="c", qop=auth, } .
+        qq{response="$response"\r\n};
+}
+
+sub request {
+    my ($request) = @_;
+    my $s = IO::Socket::INET->new("127.0.0.1:$port") or return '';
+    print $s $request;
+    local $/;
+    return scalar <$s> // '';
+}
+
+my $data = join '', 'a' .. 'z', 0 .. 9;
+my $total = length $data;
+
+# Send bytes first to last of the file, or a status query without them
+sub piece {
+    my ($first, $last, $size) = @_;
+    my $range = defined $first ? "$first-$last" : '*';
+    my $body = defined $first ? substr($data, $first, $last - $first + 1) : '';
+    return request("PUT /u.bin HTTP/1.1\r\n" . authorization('PUT', '/u.bin') .
+                   "Content-Range: bytes $range/" . ($size // $total) .
+                   "\r\nContent-Length: " . length($body) .
+                   "\r\nConnection: close\r\n\r\n$body");
+}
+
+sub missing {
+    my ($reply) = @_;
+    return $reply =~ /^HTTP\/1.1 202 .*\r\nX-Missing-Ranges: (\S*)\r\n/s ?
+        $1 : "not 202: $reply";
+}
+
+is missing(piece(20, 35)), 'bytes=0-19', 'last piece first';
+is missing(piece(5, 12)), 'bytes=0-4,13-19', 'piece in the middle';
+is missing(piece(undef)), 'bytes=0-4,13-19', 'status query';
+like piece(0, 3, $total + 1), qr{^HTTP/1.1 409 }, 'other size conflicts';
+is missing(piece(10, 22)), 'bytes=0-4', 'overlapping piece';
+like request("GET /u.bin HTTP/1.1\r\nConnection: close\r\n\r\n"),
+    qr{^HTTP/1.1 404 }, 'file is not there before it is complete';
+
+like piece(0, 7), qr{^HTTP/1.1 201 }, 'piece that completes it commits it';
+my $reply = request("GET /u.bin HTTP/1.1\r\nConnection: close\r\n\r\n");
+ok substr($reply, -$total) eq $data, 'file has all pieces in place';
+is missing(piece(undef)), "bytes=0-" . ($total - 1),
+    'session is gone after the commit';
+
+opendir my $dir, $root or die;
+is_deeply [grep /^\.mg-put-/, readdir $dir], [], 'no temporary file left';
+closedir $dir;
+
+# Pieces of a new upload sent at once over several connections
+my @socks;
+for my $i (0 .. 3) {
+    my ($first, $last) = ($i * 9, $i * 9 + 8);
+    my $s = IO::Socket::INET->new("127.0.0.1:$port") or die;
+    print $s "PUT /v.bin HTTP/1.1\r\n" . authorization('PUT', '/v.bin') .
+        "Content-Range: bytes $first-$last/$total\r\nContent-Length: 9\r\n" .
+        "Connection: close\r\n\r\n" . substr($data, $first, 9);
+    push @socks, $s;
+}
+my @codes = sort map {
+    local $/;
+    (scalar(<$_>) // '') =~ m{^HTTP/1.1 (\d+)};
+} @socks;
+is "@codes", '201 202 202 202', 'parallel pieces, one commits';
+$reply = request("GET /v.bin HTTP/1.1\r\nConnection: close\r\n\r\n");
+ok substr($reply, -$total) eq $data, 'file has the parallel pieces';
+
+like piece(0, 0, 1 << 50), qr{^HTTP/1.1 413 }, 'too large upload refused';
+
+kill 'TERM', $pid;
+waitpid $pid, 0;
+
+done_testing();
@@ -0,0 +1,275 @@
+// Request body tests: chunked decoding and multipart parsing, with the
+// body arriving in reads of chosen sizes. Prints TAP, run by t/01-body.t.
+
+#include "../mingoose.h"
+
+static const char *input;       // What the client sends after the buffer
+static int input_len, input_pos;
+static int read_size;           // Max bytes per read, to split the body
+static const char *content_type;
+static int num_tests, num_failed;
+
+int pull(FILE *fp, struct mg_connection *conn, char *buf, int len) {
+    (void) fp;
+    (void) conn;
+    if (len > read_size) {
+        len = read_size;
+    }
+    if (len > input_len - input_pos) {
+        len = input_len - input_pos;
+    }
+    memcpy(buf, input + input_pos, len);
+    input_pos += len;
+    return len;
+}
+
+int mg_printf(struct mg_connection *conn, const char *fmt, ...) {
+    (void) conn;
+    (void) fmt;
+    return 0;
+}
+
+void response_error(struct mg_connection *conn, int status,
+                    const char *reason, const char *fmt, ...) {
+    (void) conn;
+    (void) status;
+    (void) reason;
+    (void) fmt;
+}
+
+void fclose_on_exec(FILE *fp) {
+    (void) fp;
+}
+
+static void ok(int cond, const char *name, int arg) {
+    num_tests++;
+    if (!cond) {
+        num_failed++;
+    }
+    printf("%sok %d - %s %d\n", cond ? "" : "not ", num_tests, name, arg);
+}
+
+// Set up a connection whose receive buffer holds the request headers and
+// the first buffered bytes of data, the rest coming from pull().
+static struct mg_connection *new_conn(const char *data, int buffered,
+                                      int data_len, int chunked) {
+    static char mem[sizeof(struct mg_connection) + MAX_REQUEST_SIZE];
+    static const char headers[] = "PUT /x HTTP/1.1\r\n\r\n";
+    struct mg_connection *conn = (struct mg_connection *) mem;
+
+    memset(mem, 0, sizeof(mem));
+    conn->buf = conn->buf_base = mem + sizeof(*conn);
+    conn->buf_size = MAX_REQUEST_SIZE;
+    conn->request_len = (int) sizeof(headers) - 1;
+    memcpy(conn->buf, headers, conn->request_len);
+    memcpy(conn->buf + conn->request_len, data, buffered);
+    conn->data_len = conn->request_len + buffered;
+    conn->content_len = chunked ? INT64_MAX : data_len;
+    conn->chunk_state = chunked ? CHUNK_SIZE : 0;
+    conn->request_info.known_headers[MG_HEADER_CONTENT_TYPE] = content_type;
+
+    input = data + buffered;
+    input_len = data_len - buffered;
+    input_pos = 0;
+
+    return conn;
+}
+
+// Read the whole body. Return its length, or -1 on error.
+static int read_body(struct mg_connection *conn, char *buf, int size) {
+    int n, len = 0;
+
+    while ((n = mg_read(conn, buf + len, size - len)) > 0) {
+        len += n;
+    }
+    return n < 0 ? -1 : len;
+}
+
+static void test_chunked(void) {
+    static const char body[] =
+        "5;name=value\r\nhello\r\n"
+        "1A\r\nabcdefghijklmnopqrstuvwxyz\r\n"
+        "3 ; ext\r\n123\r\n"
+        "0\r\nX-Trailer: 1\r\nX-Other: 2\r\n\r\n";
+    static const char next[] = "GET /next HTTP/1.1\r\n\r\n";
+    static const char expected[] = "helloabcdefghijklmnopqrstuvwxyz123";
+    char data[256], out[256];
+    struct mg_connection *conn;
+    int data_len, buffered, len, end, ok_all = 1;
+
+    data_len = mg_snprintf(data, sizeof(data), "%s%s", body, next);
+
+    // Every split of the body between the buffer and the socket, with
+    // reads of every size: chunk lines and delimiters straddle reads
+    for (read_size = 1; read_size <= 8; read_size++) {
+        for (buffered = 0; buffered <= data_len; buffered++) {
+            conn = new_conn(data, buffered, data_len, 1);
+            len = read_body(conn, out, sizeof(out));
+            end = body_buffered_len(conn);
+            if (len != (int) sizeof(expected) - 1 ||
+                memcmp(out, expected, len) != 0 ||
+                conn->chunk_state != CHUNKS_DONE || end < 0 ||
+                conn->data_len - end > (int) sizeof(next) - 1 ||
+                memcmp(conn->buf + end, next, conn->data_len - end) != 0 ||
+                memcmp(next + (conn->data_len - end), input + input_pos,
+                       input_len - input_pos) != 0) {
+                ok_all = 0;
+            }
+        }
+    }
+    ok(ok_all, "chunked body with extensions and trailers, read sizes up to",
+       8);
+
+    // Pipelined request stays in the buffer once the body is read
+    read_size = MAX_REQUEST_SIZE;
+    conn = new_conn(data, data_len, data_len, 1);
+    len = read_body(conn, out, sizeof(out));
+    end = body_buffered_len(conn);
+    ok(len == (int) sizeof(expected) - 1 && end >= 0 &&
+       conn->data_len - end == (int) sizeof(next) - 1 &&
+       !memcmp(conn->buf + end, next, sizeof(next) - 1),
+       "pipelined request after chunked body at offset", end);
+
+    // Unfinished body: the next request is not known
+    conn = new_conn(data, 10, data_len, 1);
+    ok(body_buffered_len(conn) < 0, "unfinished chunked body", 0);
+
+    conn = new_conn("5\r\nhelloX\r\n0\r\n\r\n", 16, 16, 1);
+    ok(read_body(conn, out, sizeof(out)) < 0 && conn->must_close,
+       "missing chunk data end", 0);
+
+    conn = new_conn("zz\r\n", 4, 4, 1);
+    ok(read_body(conn, out, sizeof(out)) < 0, "malformed chunk size", 0);
+
+    conn = new_conn("1234567890123456\r\n", 18, 18, 1);
+    ok(read_body(conn, out, sizeof(out)) < 0, "too large chunk size", 0);
+}
+
+struct parts {
+    char out[65536];
+    int len;
+};
+
+static int part_begin(const struct mg_part *part, void *user_data) {
+    struct parts *p = (struct parts *) user_data;
+
+    p->len += mg_snprintf(p->out + p->len, sizeof(p->out) - p->len, "[%s]",
+                          part->name);
+    return 1;
+}
+
+static int part_data(const struct mg_part *part, const char *data, int len,
+                     void *user_data) {
+    struct parts *p = (struct parts *) user_data;
+
+    (void) part;
+    memcpy(p->out + p->len, data, len);
+    p->len += len;
+    return 1;
+}
+
+static int part_end(const struct mg_part *part, void *user_data) {
+    struct parts *p = (struct parts *) user_data;
+
+    (void) part;
+    p->out[p->len++] = '$';
+    return 1;
+}
+
+static void test_multipart(void) {
+    static const struct mg_multipart_handler handler = {
+        part_begin, part_data, part_end
+    };
+    static const char body[] =
+        "--XyZ\r\nContent-Disposition: form-data; name=\"a\"\r\n\r\n"
+        "one\r\n-\r\n--X\r\n--XyZ\r\n"
+        "Content-Disposition: form-data; name=\"b\"\r\n\r\n"
+        "two\r\n--XyZ--\r\n";
+    static const char expected[] = "[a]one\r\n-\r\n--X$[b]two$";
+    static const char bad_headers[] =
+        "--XyZ\r\nContent-Disposition: form-data; name=\"a\x01\"\r\n\r\n"
+        "one\r\n--XyZ--\r\n";
+    struct parts p;
+    struct mg_connection *conn;
+    int split, ok_all = 1, len = (int) sizeof(body) - 1;
+
+    content_type = "multipart/form-data; boundary=XyZ";
+
+    // Reads of every size, every delimiter straddles a read boundary
+    for (split = 1; split <= len; split++) {
+        read_size = split;
+        conn = new_conn(body, 0, len, 0);
+        p.len = 0;
+        if (mg_parse_multipart(conn, &handler, &p, 0) != 2 ||
+            p.len != (int) sizeof(expected) - 1 ||
+            memcmp(p.out, expected, p.len) != 0) {
+            ok_all = 0;
+        }
+        free(conn->multipart);
+    }
+    ok(ok_all, "multipart delimiters across reads, bytes", len);
+
+    // Part headers are checked like request headers
+    read_size = MAX_REQUEST_SIZE;
+    conn = new_conn(bad_headers, 0, sizeof(bad_headers) - 1, 0);
+    p.len = 0;
+    ok(mg_parse_multipart(conn, &handler, &p, 0) == -1,
+       "control character in part headers refused", 0);
+    free(conn->multipart);
+}
+
+// Two files larger than the receive buffer, one mg_upload() call each
+static void test_upload(void) {
+    static char body[3 * MAX_REQUEST_SIZE], file[20000], saved[sizeof(file)];
+    char dir[] = "/tmp/mg-body-test-XXXXXX", path[PATH_MAX];
+    struct mg_connection *conn;
+    FILE *fp;
+    int i, n, len = 0;
+
+    for (i = 0; i < (int) sizeof(file); i++) {
+        file[i] = "ab\r\n-"[i % 5];
+    }
+    for (i = 0; i < 2; i++) {
+        len += mg_snprintf(body + len, sizeof(body) - len,
+                           "--b0undary\r\nContent-Disposition: form-data; "
+                           "name=\"f\"; filename=\"f%d\"\r\n\r\n", i);
+        memcpy(body + len, file, sizeof(file));
+        len += sizeof(file);
+        len += mg_snprintf(body + len, sizeof(body) - len, "\r\n");
+    }
+    len += mg_snprintf(body + len, sizeof(body) - len, "--b0undary--\r\n");
+
+    content_type = "multipart/form-data; boundary=b0undary";
+    // The socket hands over all that has arrived, the parser reads ahead
+    read_size = sizeof(body);
+    conn = new_conn(body, 1000, len, 0);
+    if (mkdtemp(dir) == NULL) {
+        ok(0, "mkdtemp", 0);
+        return;
+    }
+
+    for (i = 0; i < 2; i++) {
+        fp = mg_upload(conn, dir, path, sizeof(path));
+        n = fp == NULL ? -1 : (int) fread(saved, 1, sizeof(saved), fp);
+        ok(n == (int) sizeof(file) && !memcmp(saved, file, n),
+           "mg_upload of file larger than the buffer, number", i + 1);
+        if (fp != NULL) {
+            fclose(fp);
+            remove(path);
+        }
+    }
+    ok(mg_upload(conn, dir, path, sizeof(path)) == NULL,
+       "mg_upload after the last file", 3);
+    ok(input_pos == input_len, "body read to the end", input_pos);
+    free(conn->multipart);
+    rmdir(dir);
+}
+
+int main(void) {
+    test_chunked();
+    test_multipart();
+    test_upload();
+    printf("1..%d\n", num_tests);
+
+    return num_failed > 0;
+}
@@ -0,0 +1,378 @@
+#include "mingoose.h"
+
+// Throttle rules and bandwidth shaping.
+//
+// The throttle option is parsed once at startup. Network rules go into a
+// binary trie keyed by the address bits, URI rules are compiled globs,
+// so finding the rate of a request costs at most 32 trie steps plus the
+// URI rules that come after the best network rule.
+//
+// As before, when several rules match, the last one in the option wins:
+// "*=1k,10.0.0.0/8=0" leaves the local network unthrottled.
+//
+// A network rule starting with '@' makes its network share one bucket:
+// with "@10.0.0.0/8=1m", all connections from 10.x.x.x together get
+// 1 megabyte per second, instead of each of them getting it. The
+// global_throttle option limits all connections together.
+//
+// On reload, a shared network rule or global_throttle whose rate did
+// not change keeps its bucket: connections served by the old and the
+// new snapshot take from the same one, so the limit holds across it.
+//
+// Limits are token buckets refilled continuously, holding at most an
+// eighth of a second worth of data. A write takes tokens from the
+// buckets of every level it is subject to: global, shared network or
+// connection. When any of them is short, the writer waits just long
+// enough for it to refill, so data goes out evenly instead of in
+// one-second bursts, and connections sharing a bucket take turns.
+//
+// Throttling does not free worker threads. The server has one thread per
+// connection and no event loop, so a throttled client holds a worker for
+// its whole transfer, sleeping in poll() between grants: a few slow
+// downloads can still take the whole pool. num_threads must allow for
+// them. A worker is only freed early if the client hangs up.
+
+#if !defined(THROTTLE_MIN_GRANT)
+#define THROTTLE_MIN_GRANT 1024     // Do not wake up for less than that
+#endif
+
+struct throttle_rule {
+    int rate;                   // Bytes per second, 0 means unthrottled
+    struct mg_glob *glob;       // URI rules only
+    struct token_bucket *bucket;    // Shared network rules only
+    uint32_t net;                   // Network rules only
+    int prefix_len;
+};
+
+struct throttle_node {
+    struct throttle_node *child[2];
+    int rule;                   // Rule of this exact prefix, or -1
+};
+
+struct throttle {
+    struct throttle_rule *rules;    // In option order
+    int num_rules;
+    int all_rule;                   // Last "*" rule, or -1
+    int *uri_rules;                 // Indices of URI rules
+    int num_uri_rules;
+    struct throttle_node *root;
+    struct token_bucket *global;    // global_throttle, or NULL
+};
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Start full, the first burst goes out right away
+static void bucket_init(struct token_bucket *b, int64_t rate) {
+    b->rate = rate;
+    b->burst = rate / 8 > MG_BUF_LEN ? rate / 8 :
+        rate < MG_BUF_LEN ? rate : MG_BUF_LEN;
+    b->tokens = (double) b->burst;
+    b->refilled = now_ns();
+}
+
+// Return a shared bucket: prev if it has that rate, else a new one.
+static struct token_bucket *new_bucket(int64_t rate,
+                                       struct token_bucket *prev) {
+    struct token_bucket *b;
+
+    if (prev != NULL && prev->rate == rate) {
+        __sync_add_and_fetch(&prev->refs, 1);
+        return prev;
+    } else if ((b = (struct token_bucket *) calloc(1, sizeof(*b))) != NULL) {
+        (void) pthread_mutex_init(&b->mutex, NULL);
+        bucket_init(b, rate);
+        b->refs = 1;
+    }
+    return b;
+}
+
+static void free_bucket(struct token_bucket *b) {
+    if (b != NULL && __sync_sub_and_fetch(&b->refs, 1) == 0) {
+        (void) pthread_mutex_destroy(&b->mutex);
+        free(b);
+    }
+}
+
+static void refill(struct token_bucket *b, int64_t now) {
+    if (now > b->refilled) {
+        b->tokens += (double) (now - b->refilled) * b->rate / 1e9;
+        if (b->tokens > b->burst) {
+            b->tokens = (double) b->burst;
+        }
+        b->refilled = now;
+    }
+}
+
+// Parse "<number>[k|m]" rate in bytes per second, 0 meaning unthrottled.
+// Return -1 if malformed, or if it is below 1 byte per second: such a
+// bucket would never refill.
+static int parse_rate(const char *s) {
+    char mult = ',';
+    double v;
+
+    if (s == NULL || sscanf(s, "%lf%c", &v, &mult) < 1 || v < 0 ||
+        (lowercase(&mult) != 'k' && lowercase(&mult) != 'm' && mult != ',')) {
+        return -1;
+    }
+    v *= lowercase(&mult) == 'k' ? 1024 : lowercase(&mult) == 'm' ? 1048576 : 1;
+
+    return v == 0 ? 0 : v < 1 ? -1 : v > INT_MAX ? INT_MAX : (int) v;
+}
+
+static int isbyte(int n) {
+    return n >= 0 && n <= 255;
+}
+
+static int parse_net(const char *spec, uint32_t *net, int *prefix_len) {
+    int n, a, b, c, d, slash = 32, len = 0;
+
+    if ((sscanf(spec, "%d.%d.%d.%d/%d%n", &a, &b, &c, &d, &slash, &n) == 5 ||
+         sscanf(spec, "%d.%d.%d.%d%n", &a, &b, &c, &d, &n) == 4) &&
+        isbyte(a) && isbyte(b) && isbyte(c) && isbyte(d) &&
+        slash >= 0 && slash < 33) {
+        len = n;
+        *net = ((uint32_t)a << 24) | ((uint32_t)b << 16) | ((uint32_t)c << 8) | d;
+        *prefix_len = slash;
+    }
+
+    return len;
+}
+
+static void free_node(struct throttle_node *node) {
+    if (node != NULL) {
+        free_node(node->child[0]);
+        free_node(node->child[1]);
+        free(node);
+    }
+}
+
+static struct throttle_node *new_node(void) {
+    struct throttle_node *node;
+
+    if ((node = (struct throttle_node *) calloc(1, sizeof(*node))) != NULL) {
+        node->rule = -1;
+    }
+    return node;
+}
+
+// Return 0 on OOM.
+static int insert_net(struct throttle *t, uint32_t net, int prefix_len,
+                      int rule) {
+    struct throttle_node **pp = &t->root;
+    int i = 0, bit;
+
+    for (;;) {
+        if (*pp == NULL && (*pp = new_node()) == NULL) {
+            return 0;
+        } else if (i == prefix_len) {
+            // Same network twice, the later rule wins
+            (*pp)->rule = rule;
+            return 1;
+        }
+        bit = (net >> (31 - i++)) & 1;
+        pp = &(*pp)->child[bit];
+    }
+}
+
+void throttle_free(struct throttle *t) {
+    int i;
+
+    if (t != NULL) {
+        for (i = 0; i < t->num_rules; i++) {
+            mg_glob_free(t->rules[i].glob);
+            free_bucket(t->rules[i].bucket);
+        }
+        free_bucket(t->global);
+        free(t->rules);
+        free(t->uri_rules);
+        free_node(t->root);
+        free(t);
+    }
+}
+
+// Return the bucket of the shared rule of network net/prefix_len in t,
+// or NULL.
+static struct token_bucket *find_bucket(const struct throttle *t,
+                                        uint32_t net, int prefix_len) {
+    int i;
+
+    for (i = t == NULL ? 0 : t->num_rules - 1; i >= 0; i--) {
+        if (t->rules[i].bucket != NULL && t->rules[i].net == net &&
+            t->rules[i].prefix_len == prefix_len) {
+            return t->rules[i].bucket;
+        }
+    }
+    return NULL;
+}
+
+// Compile the throttle and global_throttle options, keeping the shared
+// buckets of prev that are unchanged. Malformed rules and rates are
+// ignored. Return NULL on OOM.
+struct throttle *throttle_compile(const char *spec, const char *global,
+                                  const struct throttle *prev) {
+    struct throttle *t;
+    struct throttle_rule *rule;
+    struct vec vec, val;
+    const char *list;
+    uint32_t net;
+    int n = 0, prefix_len, shared, v;
+
+    for (list = spec; (list = next_vector_eq(list, &vec, &val)) != NULL; n++) {
+    }
+    if ((t = (struct throttle *) calloc(1, sizeof(*t))) == NULL ||
+        (t->rules = (struct throttle_rule *)
+         calloc(n + 1, sizeof(t->rules[0]))) == NULL ||
+        (t->uri_rules = (int *) calloc(n + 1, sizeof(int))) == NULL ||
+        ((v = parse_rate(global)) > 0 &&
+         (t->global = new_bucket(v, prev == NULL ? NULL :
+                                 prev->global)) == NULL)) {
+        throttle_free(t);
+        return NULL;
+    }
+    t->all_rule = -1;
+
+    while ((spec = next_vector_eq(spec, &vec, &val)) != NULL) {
+        if ((v = parse_rate(val.ptr)) < 0) {
+            continue;
+        }
+
+        rule = &t->rules[t->num_rules];
+        rule->rate = v;
+        shared = vec.len > 1 && vec.ptr[0] == '@';
+        if (vec.len == 1 && vec.ptr[0] == '*') {
+            t->all_rule = t->num_rules;
+        } else if (parse_net(vec.ptr + shared, &net, &prefix_len) > 0) {
+            rule->net = prefix_len ? net & (0xffffffffU << (32 - prefix_len)) : 0;
+            rule->prefix_len = prefix_len;
+            if (shared && rule->rate > 0 &&
+                (rule->bucket = new_bucket(rule->rate,
+                                           find_bucket(prev, rule->net,
+                                                       prefix_len))) == NULL) {
+                throttle_free(t);
+                return NULL;
+            }
+            if (!insert_net(t, rule->net, prefix_len, t->num_rules)) {
+                throttle_free(t);
+                return NULL;
+            }
+        } else if ((rule->glob = mg_glob_compile(vec.ptr, (int) vec.len)) == NULL) {
+            throttle_free(t);
+            return NULL;
+        } else {
+            t->uri_rules[t->num_uri_rules++] = t->num_rules;
+        }
+        t->num_rules++;
+    }
+
+    return t;
+}
+
+// Set throttle of the request from the last matching rule.
+void set_throttle(struct mg_connection *conn, uint32_t remote_ip,
+                  const char *uri) {
+    const struct throttle *t = conn->cfg->throttle;
+    const struct throttle_node *node;
+    int i, best;
+
+    conn->throttle = 0;
+    conn->throttle_bucket = NULL;
+    if (t == NULL || t->num_rules == 0) {
+        return;
+    }
+
+    // Every node on the path of the address is a network containing it
+    best = t->all_rule;
+    for (node = t->root, i = 0; node != NULL; i++) {
+        if (node->rule > best) {
+            best = node->rule;
+        }
+        node = i < 32 ? node->child[(remote_ip >> (31 - i)) & 1] : NULL;
+    }
+
+    // Only URI rules coming later can override it
+    for (i = t->num_uri_rules - 1; i >= 0 && t->uri_rules[i] > best; i--) {
+        if (mg_glob_match(t->rules[t->uri_rules[i]].glob, uri) > 0) {
+            best = t->uri_rules[i];
+            break;
+        }
+    }
+
+    if (best >= 0) {
+        conn->throttle = t->rules[best].rate;
+        conn->throttle_bucket = t->rules[best].bucket;
+        if (conn->throttle > 0 && conn->throttle_bucket == NULL) {
+            bucket_init(&conn->throttle_tokens, conn->throttle);
+        }
+    }
+}
+
+// Return 1 if writes to the connection are shaped.
+int throttle_is_active(const struct mg_connection *conn) {
+    return conn->throttle > 0 || conn->cfg->throttle->global != NULL;
+}
+
+// Return how many of len bytes may be sent now. If none, return 0 and
+// the time to wait for the buckets to refill in wait_ms.
+int64_t throttle_take(struct mg_connection *conn, int64_t len, int *wait_ms) {
+    struct token_bucket *levels[3], *b;
+    int64_t now, grant = len, min_grant = THROTTLE_MIN_GRANT, wait = 0, w;
+    int i, n = 0, num_shared;
+
+    // Shared buckets come first and are locked in a fixed order
+    if (conn->throttle_bucket != NULL) {
+        levels[n++] = conn->throttle_bucket;
+    }
+    if (conn->cfg->throttle->global != NULL) {
+        levels[n++] = conn->cfg->throttle->global;
+    }
+    num_shared = n;
+    if (conn->throttle_bucket == NULL && conn->throttle > 0) {
+        levels[n++] = &conn->throttle_tokens;
+    }
+    for (i = 0; i < num_shared; i++) {
+        (void) pthread_mutex_lock(&levels[i]->mutex);
+    }
+
+    now = now_ns();
+    for (i = 0; i < n; i++) {
+        b = levels[i];
+        refill(b, now);
+        if ((int64_t) b->tokens < grant) {
+            grant = (int64_t) b->tokens;
+        }
+        if (b->burst < min_grant) {
+            min_grant = b->burst;
+        }
+    }
+    if (len < min_grant) {
+        min_grant = len;
+    }
+
+    if (grant < min_grant) {
+        // Wait for the slowest bucket to have min_grant tokens
+        for (i = 0; i < n; i++) {
+            b = levels[i];
+            w = (int64_t) ((min_grant - b->tokens) * 1000 / b->rate) + 1;
+            if (b->tokens < min_grant && w > wait) {
+                wait = w;
+            }
+        }
+        grant = 0;
+    } else {
+        for (i = 0; i < n; i++) {
+            levels[i]->tokens -= grant;
+        }
+    }
+
+    for (i = num_shared - 1; i >= 0; i--) {
+        (void) pthread_mutex_unlock(&levels[i]->mutex);
+    }
+    *wait_ms = (int) wait;
+
+    return grant;
+}
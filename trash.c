@@ -0,0 +1,185 @@
+#include "mingoose.h"
+
+// Directory removal.
+//
+// remove_tree() walks the tree with openat() and fdopendir() and removes
+// entries with unlinkat(), relative to the descriptor of their directory:
+// no path is built, and d_type tells directories apart, so a file costs
+// one unlinkat() and no stat(). Symbolic links are removed, never
+// followed.
+//
+// With trash_directory set, DELETE of a directory renames it into the
+// trash and answers at once, whatever the size of the tree. A reclaimer
+// thread removes what is in the trash in the background, including what
+// was left there when the server last stopped. The trash must be on the
+// same file system as document_root, and outside of it: if the rename
+// fails, the tree is removed by the request as without trash.
+
+static struct {
+    pthread_mutex_t mutex;          // Protects everything below
+    pthread_cond_t queued;          // Signaled when a tree is moved in
+    int pending;                    // Trees moved in since the last sweep
+    int running;                    // Reclaimer is up
+} trash = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+
+static int remove_at(int dir_fd, const char *name, const volatile int *stop);
+
+// Remove directory entry, whatever it is. Return 0 on error.
+static int remove_entry(int dir_fd, const struct dirent *dp,
+                        const volatile int *stop) {
+    if (dp->d_type == DT_DIR) {
+        return remove_at(dir_fd, dp->d_name, stop);
+    } else if (unlinkat(dir_fd, dp->d_name, 0) == 0) {
+        return 1;
+    }
+
+    // Without d_type, unlinkat() tells: it refuses directories
+    return dp->d_type == DT_UNKNOWN && (errno == EISDIR || errno == EPERM) &&
+        remove_at(dir_fd, dp->d_name, stop);
+}
+
+// Remove directory name in dir_fd and all it contains. Stop early if
+// *stop becomes set. Return 0 if something could not be removed.
+static int remove_at(int dir_fd, const char *name, const volatile int *stop) {
+    struct dirent *dp;
+    DIR *dirp;
+    int fd, ok = 1, pass;
+
+    if ((fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                     O_CLOEXEC)) < 0) {
+        return 0;
+    } else if ((dirp = fdopendir(fd)) == NULL) {
+        close(fd);
+        return 0;
+    }
+
+    // Some file systems skip entries when others are removed while
+    // reading, so read again if the directory is not empty then
+    for (pass = 0; ok && *stop == 0 && pass < 2; pass++) {
+        rewinddir(dirp);
+        while (*stop == 0 && (dp = readdir(dirp)) != NULL) {
+            if (strcmp(dp->d_name, ".") && strcmp(dp->d_name, "..") &&
+                !remove_entry(fd, dp, stop)) {
+                ok = 0;
+            }
+        }
+        if (unlinkat(dir_fd, name, AT_REMOVEDIR) == 0) {
+            (void) closedir(dirp);
+            return 1;
+        } else if (errno != ENOTEMPTY && errno != EEXIST) {
+            ok = 0;
+        }
+    }
+    (void) closedir(dirp);
+
+    return 0;
+}
+
+// Remove directory path and its content. Return 0 on error.
+int remove_tree(struct mg_context *ctx, const char *path) {
+    return remove_at(AT_FDCWD, path, &ctx->stop_flag);
+}
+
+// Move directory path into the trash, to be removed in the background.
+// Return 0 if there is no trash or the move fails.
+int trash_move(struct mg_context *ctx, const char *path) {
+    static volatile int counter;
+    const char *name = strrchr(path, '/');
+    char dest[PATH_MAX];
+
+    if (!trash.running) {
+        return 0;
+    }
+    mg_snprintf(dest, sizeof(dest), "%s/%s.%d.%d",
+                ctx->settings.trash_directory, name == NULL ? path : name + 1,
+                (int) getpid(), __sync_add_and_fetch(&counter, 1));
+    if (rename(path, dest) != 0) {
+        return 0;
+    }
+
+    (void) pthread_mutex_lock(&trash.mutex);
+    trash.pending++;
+    (void) pthread_cond_signal(&trash.queued);
+    (void) pthread_mutex_unlock(&trash.mutex);
+
+    return 1;
+}
+
+// Remove everything in the trash.
+static void sweep(struct mg_context *ctx) {
+    struct dirent *dp;
+    DIR *dirp;
+    int fd;
+
+    if ((fd = open(ctx->settings.trash_directory,
+                   O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return;
+    } else if ((dirp = fdopendir(fd)) == NULL) {
+        close(fd);
+        return;
+    }
+
+    while (ctx->stop_flag == 0 && (dp = readdir(dirp)) != NULL) {
+        if (strcmp(dp->d_name, ".") && strcmp(dp->d_name, "..") &&
+            !remove_entry(fd, dp, &ctx->stop_flag) && ctx->stop_flag == 0) {
+            cry(create_fake_connection(ctx), "Cannot reclaim %s/%s",
+                ctx->settings.trash_directory, dp->d_name);
+        }
+    }
+    (void) closedir(dirp);
+}
+
+static void *reclaimer_thread(void *param) {
+    struct mg_context *ctx = (struct mg_context *) param;
+    struct timespec deadline;
+
+    (void) pthread_mutex_lock(&trash.mutex);
+    trash.pending = 1;
+    while (ctx->stop_flag == 0) {
+        if (trash.pending > 0) {
+            trash.pending = 0;
+            (void) pthread_mutex_unlock(&trash.mutex);
+            sweep(ctx);
+            (void) pthread_mutex_lock(&trash.mutex);
+        } else {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec++;
+            (void) pthread_cond_timedwait(&trash.queued, &trash.mutex,
+                                          &deadline);
+        }
+    }
+
+    // Whatever is left is reclaimed on next start
+    trash.running = 0;
+    (void) pthread_mutex_unlock(&trash.mutex);
+
+    (void) pthread_mutex_lock(&ctx->mutex);
+    ctx->num_threads--;
+    (void) pthread_cond_signal(&ctx->cond);
+    (void) pthread_mutex_unlock(&ctx->mutex);
+
+    DEBUG_TRACE(("exiting"));
+    return NULL;
+}
+
+// Start the reclaimer if trash_directory is set.
+void trash_start(struct mg_context *ctx) {
+    const char *dir = ctx->settings.trash_directory;
+
+    if (dir == NULL) {
+        return;
+    } else if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        cry(create_fake_connection(ctx), "Cannot create trash %s: %s",
+            dir, strerror(ERRNO));
+        return;
+    }
+
+    trash.running = 1;
+    if (mg_start_thread(reclaimer_thread, ctx) != 0) {
+        cry(create_fake_connection(ctx), "Cannot start reclaimer thread: %ld",
+            (long) ERRNO);
+        trash.running = 0;
+    } else {
+        ctx->num_threads++;
+    }
+}
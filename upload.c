@@ -0,0 +1,529 @@
+#include "mingoose.h"
+
+// PUT files and resumable upload sessions.
+//
+// A PUT body is written to a temporary file next to the destination,
+// which put_commit() renames over it once complete: readers see the old
+// file or the new one, never a partly written one.
+//
+// A PUT with "Content-Range: bytes <first>-<last>/<total>" is a piece of
+// a larger upload. The first piece opens a session for the path: a
+// temporary file of the total size is preallocated, and pieces coming
+// from any number of connections, in any order, are written at their
+// offsets with pwrite(). Received ranges are tracked, and the piece that
+// completes the file commits it. Until then each piece is answered
+// 202 Accepted with the ranges still missing:
+//
+//   X-Missing-Ranges: bytes=0-1048575,3145728-4194303
+//
+// A PUT with "Content-Range: bytes */<total>" and no body asks for the
+// same answer, so an interrupted client resumes instead of restarting.
+// Pieces must come with a Content-Length, and uploads be at most
+// MAX_UPLOAD_SIZE bytes. Sessions live in memory,
+// an idle one is dropped after UPLOAD_SESSION_TIMEOUT seconds by the
+// master thread. Temporary files left by a server that is gone are
+// removed in the background at startup.
+
+#if !defined(UPLOAD_SESSION_TIMEOUT)
+#define UPLOAD_SESSION_TIMEOUT 3600
+#endif
+#if !defined(MAX_UPLOAD_SESSIONS)
+#define MAX_UPLOAD_SESSIONS 64
+#endif
+#if !defined(MAX_UPLOAD_SIZE)
+#define MAX_UPLOAD_SIZE ((int64_t) 4 << 30)     // Disk space a session takes
+#endif
+#define MISSING_RANGES_LEN 512      // Longer lists are cut
+
+struct upload_range {
+    int64_t start, end;             // Received bytes, end excluded
+};
+
+struct upload_session {
+    struct upload_session *next;
+    int refs;                       // Pieces being written, plus the list
+    int ready;                      // 0 while the file is made, -1 if failed
+    int error;                      // errno if making the file failed
+    int fd;
+    int64_t total;
+    time_t last_used;
+    struct upload_range *ranges;    // Sorted, never adjacent
+    int num_ranges;
+    int ranges_size;
+    char tmp[PATH_MAX];
+    char path[PATH_MAX];
+};
+
+static struct {
+    pthread_mutex_t mutex;          // Protects everything below
+    pthread_cond_t made;            // Signaled when a session is ready
+    struct upload_session *list;
+    int num_sessions;
+} sessions = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0 };
+
+// Create a temporary file in the directory of path, named after it.
+// Return its descriptor, or -1 on error.
+int open_temp_file(const char *path, char *tmp, size_t tmp_len) {
+    static volatile int counter;
+    const char *name = strrchr(path, '/');
+
+    name = name == NULL ? path : name + 1;
+    mg_snprintf(tmp, tmp_len, "%.*s" PUT_TEMP_PREFIX "%s.%d.%d",
+                (int) (name - path), path, name, (int) getpid(),
+                __sync_add_and_fetch(&counter, 1));
+
+    return open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+}
+
+static int fsync_dir(const char *path) {
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    int fd, ok;
+
+    mg_snprintf(dir, sizeof(dir), "%.*s",
+                slash == NULL ? 1 : (int) (slash - path + 1),
+                slash == NULL ? "." : path);
+    if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return 0;
+    }
+    ok = fsync(fd) == 0;
+    close(fd);
+
+    return ok;
+}
+
+// Sync the written temporary file as put_fsync says and rename it to
+// path. Return 0 after answering with an error, the file is removed.
+int put_commit(struct mg_connection *conn, int fd, const char *tmp,
+               const char *path) {
+    if (conn->cfg->put_fsync != PUT_FSYNC_NO && fsync(fd) != 0) {
+        response_error(conn, 500, http_500_error,
+                        "fsync(%s): %s", tmp, strerror(ERRNO));
+    } else if (rename(tmp, path) != 0) {
+        response_error(conn, 500, http_500_error,
+                        "rename(%s): %s", path, strerror(ERRNO));
+    } else {
+        if (conn->cfg->put_fsync == PUT_FSYNC_DIR) {
+            (void) fsync_dir(path);
+        }
+
+        // Do not wait for the watcher, next request must see the file
+        file_cache_invalidate(path);
+        resolve_cache_invalidate(path);
+        return 1;
+    }
+    unlink(tmp);
+
+    return 0;
+}
+
+// Parse "bytes <first>-<last>/<total>", or "bytes */<total>" in which
+// case first is -1. Return 0 if the header is not of that form.
+int upload_parse_range(const char *header, int64_t *first, int64_t *last,
+                       int64_t *total) {
+    int n = 0;
+
+    *first = *last = -1;
+    if (sscanf(header, "bytes */%" INT64_FMT "%n", total, &n) != 1 &&
+        sscanf(header, "bytes %" INT64_FMT "-%" INT64_FMT "/%" INT64_FMT "%n",
+               first, last, total, &n) != 3) {
+        return 0;
+    }
+
+    return header[n] == '\0';
+}
+
+static void release(struct upload_session *s) {
+    if (__sync_sub_and_fetch(&s->refs, 1) == 0) {
+        if (s->fd >= 0) {
+            close(s->fd);
+        }
+        free(s->ranges);
+        free(s);
+    }
+}
+
+// Called with the mutex held.
+static void unlink_session(struct upload_session **pp) {
+    struct upload_session *s = *pp;
+
+    *pp = s->next;
+    sessions.num_sessions--;
+    release(s);
+}
+
+// Remove s from the list, if it still is there. Called with the mutex
+// held. Return 0 if it was not.
+static int remove_session(struct upload_session *s) {
+    struct upload_session **pp;
+
+    for (pp = &sessions.list; *pp != NULL && *pp != s; pp = &(*pp)->next) {
+    }
+    if (*pp == NULL) {
+        return 0;
+    }
+    unlink_session(pp);
+
+    return 1;
+}
+
+// Find the session of path. Called with the mutex held.
+static struct upload_session *find(const char *path) {
+    struct upload_session *s;
+
+    for (s = sessions.list; s != NULL && strcmp(s->path, path); s = s->next) {
+    }
+
+    return s;
+}
+
+// Drop sessions idle for longer than UPLOAD_SESSION_TIMEOUT, and their
+// files. Called periodically by the master thread.
+void upload_reap(time_t now) {
+    struct upload_session **pp, *s;
+
+    (void) pthread_mutex_lock(&sessions.mutex);
+    for (pp = &sessions.list; (s = *pp) != NULL;) {
+        if (s->refs == 1 && now - s->last_used > UPLOAD_SESSION_TIMEOUT) {
+            unlink(s->tmp);
+            unlink_session(pp);
+        } else {
+            pp = &s->next;
+        }
+    }
+    (void) pthread_mutex_unlock(&sessions.mutex);
+}
+
+// Add a session for path, its file is made by make_file(). Called with
+// the mutex held. Return NULL on error, errno is set.
+static struct upload_session *new_session(const char *path, int64_t total) {
+    struct upload_session *s;
+
+    if (sessions.num_sessions >= MAX_UPLOAD_SESSIONS) {
+        errno = EAGAIN;
+        return NULL;
+    } else if ((s = (struct upload_session *) calloc(1, sizeof(*s))) == NULL) {
+        return NULL;
+    }
+
+    mg_strlcpy(s->path, path, sizeof(s->path));
+    s->fd = -1;
+    s->total = total;
+    s->refs = 1;
+    s->next = sessions.list;
+    sessions.list = s;
+    sessions.num_sessions++;
+
+    return s;
+}
+
+// Create the temporary file of a new session and reserve the whole of
+// it at once, pieces then fill it in place. Called without the mutex,
+// that may take a while. Return 0 on error, errno is set.
+static int make_file(struct upload_session *s) {
+    struct stat st;
+    int error;
+
+    if ((s->fd = open_temp_file(s->path, s->tmp, sizeof(s->tmp))) < 0) {
+        return 0;
+    } else if ((stat(s->path, &st) == 0 &&
+                fchmod(s->fd, st.st_mode & 07777) != 0) ||
+               ftruncate(s->fd, s->total) != 0) {
+        error = errno;
+        close(s->fd);
+        s->fd = -1;
+        unlink(s->tmp);
+        errno = error;
+        return 0;
+    }
+#if defined(FALLOC_FL_KEEP_SIZE)
+    (void) fallocate(s->fd, 0, 0, s->total);
+#endif
+
+    return 1;
+}
+
+// Merge [start, end) into the received ranges. Called with the mutex
+// held. Return 0 on OOM.
+static int add_range(struct upload_session *s, int64_t start, int64_t end) {
+    struct upload_range *r;
+    int i, j;
+
+    // First range that is not entirely before, and first entirely after
+    for (i = 0; i < s->num_ranges && s->ranges[i].end < start; i++) {
+    }
+    for (j = i; j < s->num_ranges && s->ranges[j].start <= end; j++) {
+    }
+
+    if (i < j) {
+        // Overlapping or adjacent ones collapse into ranges[i]
+        if (s->ranges[i].start < start) {
+            start = s->ranges[i].start;
+        }
+        if (s->ranges[j - 1].end > end) {
+            end = s->ranges[j - 1].end;
+        }
+        memmove(&s->ranges[i + 1], &s->ranges[j],
+                (s->num_ranges - j) * sizeof(s->ranges[0]));
+        s->num_ranges -= j - i - 1;
+    } else {
+        if (s->num_ranges >= s->ranges_size) {
+            if ((r = (struct upload_range *)
+                 realloc(s->ranges, (s->ranges_size * 2 + 8) *
+                         sizeof(*r))) == NULL) {
+                return 0;
+            }
+            s->ranges = r;
+            s->ranges_size = s->ranges_size * 2 + 8;
+        }
+        memmove(&s->ranges[i + 1], &s->ranges[i],
+                (s->num_ranges - i) * sizeof(s->ranges[0]));
+        s->num_ranges++;
+    }
+    s->ranges[i].start = start;
+    s->ranges[i].end = end;
+
+    return 1;
+}
+
+// List the gaps between received ranges, as many as fit. Called with
+// the mutex held, s may be NULL.
+static void missing_ranges(const struct upload_session *s, int64_t total,
+                           char *buf, size_t buf_len) {
+    char gap[64];
+    int64_t start = 0, end;
+    size_t len = 0;
+    int i, k, n = s == NULL ? 0 : s->num_ranges;
+
+    buf[0] = '\0';
+    for (i = 0; i <= n; i++) {
+        end = i < n ? s->ranges[i].start : total;
+        if (end > start) {
+            k = mg_snprintf(gap, sizeof(gap), "%s%" INT64_FMT "-%" INT64_FMT,
+                            len == 0 ? "bytes=" : ",", start, end - 1);
+            if (len + k >= buf_len) {
+                break;
+            }
+            memcpy(buf + len, gap, k + 1);
+            len += k;
+        }
+        if (i < n) {
+            start = s->ranges[i].end;
+        }
+    }
+}
+
+// Write the body at offset. Return 0 on error.
+static int write_at(struct mg_connection *conn, int fd, int64_t offset) {
+    char buf[MG_BUF_LEN];
+    int n, ok;
+
+    // Straight from the socket to the file, if possible
+    if ((ok = body_splice(conn, fd, offset)) < 0) {
+        while ((n = mg_read(conn, buf, sizeof(buf))) > 0 &&
+               pwrite(fd, buf, n, offset) == n) {
+            offset += n;
+        }
+        ok = n == 0;
+    }
+
+    return ok;
+}
+
+// Handle a PUT of bytes first to last of a file of total bytes, or a
+// status query if first is -1. The status code is 201 if the file is
+// new, 200 if not.
+void upload_put(struct mg_connection *conn, const char *path,
+                int64_t first, int64_t last, int64_t total) {
+    char missing[MISSING_RANGES_LEN];
+    struct upload_session *s;
+    time_t now = time(NULL);
+    int complete = 0, created, ok;
+
+    if (total <= 0 || (first >= 0 && (first > last || last >= total)) ||
+        conn->chunk_state != 0 ||
+        conn->content_len != (first < 0 ? 0 : last - first + 1)) {
+        response_error(conn, 416, "Requested Range Not Satisfiable",
+                        "Bad Content-Range or Content-Length");
+        return;
+    } else if (total > MAX_UPLOAD_SIZE) {
+        response_error(conn, 413, "Request Entity Too Large",
+                        "Uploads are limited to %" INT64_FMT " bytes",
+                        (int64_t) MAX_UPLOAD_SIZE);
+        return;
+    }
+
+    (void) pthread_mutex_lock(&sessions.mutex);
+    s = find(path);
+    if (s != NULL && s->total != total) {
+        (void) pthread_mutex_unlock(&sessions.mutex);
+        response_error(conn, 409, "Conflict",
+                        "Upload of %" INT64_FMT " bytes in progress", s->total);
+        return;
+    } else if (first < 0) {
+        missing_ranges(s, total, missing, sizeof(missing));
+        (void) pthread_mutex_unlock(&sessions.mutex);
+        conn->status_code = 202;
+        mg_printf(conn, "HTTP/1.1 202 Accepted\r\nContent-Length: 0\r\n"
+                  "X-Missing-Ranges: %s\r\n\r\n", missing);
+        return;
+    } else if ((created = s == NULL) &&
+               (s = new_session(path, total)) == NULL) {
+        (void) pthread_mutex_unlock(&sessions.mutex);
+        response_error(conn, errno == EAGAIN ? 503 : 500,
+                        errno == EAGAIN ? "Service Unavailable" : http_500_error,
+                        "upload(%s): %s", path, strerror(ERRNO));
+        return;
+    }
+    __sync_add_and_fetch(&s->refs, 1);
+    s->last_used = now;
+
+    // The file is made unlocked, other pieces of the upload wait for it
+    if (created) {
+        (void) pthread_mutex_unlock(&sessions.mutex);
+        ok = make_file(s);
+        (void) pthread_mutex_lock(&sessions.mutex);
+        if ((s->ready = ok ? 1 : -1) < 0) {
+            s->error = errno;
+            (void) remove_session(s);
+        }
+        (void) pthread_cond_broadcast(&sessions.made);
+    }
+    while (s->ready == 0) {
+        (void) pthread_cond_wait(&sessions.made, &sessions.mutex);
+    }
+    (void) pthread_mutex_unlock(&sessions.mutex);
+
+    // Pieces are written unlocked, each at its own offset
+    if (s->ready < 0) {
+        response_error(conn, 500, http_500_error,
+                        "upload(%s): %s", path, strerror(s->error));
+        release(s);
+        return;
+    } else if (!body_expect(conn)) {
+        release(s);
+        return;
+    } else if (!write_at(conn, s->fd, first)) {
+        response_error(conn, 577, http_500_error, "%s", "");
+        release(s);
+        return;
+    }
+
+    (void) pthread_mutex_lock(&sessions.mutex);
+    ok = add_range(s, first, last + 1);
+    s->last_used = time(NULL);
+
+    // The piece that completes the file commits it, once
+    if (ok && s->num_ranges == 1 && s->ranges[0].start == 0 &&
+        s->ranges[0].end == total) {
+        complete = remove_session(s);
+    }
+    missing_ranges(s, total, missing, sizeof(missing));
+    (void) pthread_mutex_unlock(&sessions.mutex);
+
+    if (!ok) {
+        response_error(conn, 500, http_500_error, "%s", "OOM");
+    } else if (!complete) {
+        conn->status_code = 202;
+        mg_printf(conn, "HTTP/1.1 202 Accepted\r\nContent-Length: 0\r\n"
+                  "X-Missing-Ranges: %s\r\n\r\n", missing);
+    } else if (put_commit(conn, s->fd, s->tmp, path)) {
+        mg_printf(conn, "HTTP/1.1 %d OK\r\nContent-Length: 0\r\n\r\n",
+                  conn->status_code);
+    }
+    release(s);
+}
+
+// Return 1 if name is a temporary file from open_temp_file() that no
+// server writes anymore: its process is gone, or it is idle for longer
+// than a session may be.
+static int is_leftover(int dir_fd, const char *name, time_t now) {
+    const char *p = name + strlen(name);
+    struct stat st;
+    int pid;
+
+    if (strncmp(name, PUT_TEMP_PREFIX, sizeof(PUT_TEMP_PREFIX) - 1)) {
+        return 0;
+    }
+
+    // Name ends with ".<pid>.<counter>"
+    while (p > name && *--p != '.') {
+    }
+    while (p > name && *--p != '.') {
+    }
+    if ((pid = atoi(p + 1)) <= 0 || pid == (int) getpid()) {
+        return 0;
+    }
+
+    return (kill(pid, 0) != 0 && errno == ESRCH) ||
+        (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+         now - st.st_mtime > UPLOAD_SESSION_TIMEOUT);
+}
+
+// Remove leftover temporary files in directory name of dir_fd and below.
+// Symbolic links are not followed.
+static void remove_leftovers(struct mg_context *ctx, int dir_fd,
+                             const char *name, time_t now) {
+    struct dirent *dp;
+    struct stat st;
+    DIR *dirp;
+    int fd;
+
+    if ((fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                     O_CLOEXEC)) < 0) {
+        return;
+    } else if ((dirp = fdopendir(fd)) == NULL) {
+        close(fd);
+        return;
+    }
+
+    while (ctx->stop_flag == 0 && (dp = readdir(dirp)) != NULL) {
+        if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..")) {
+            continue;
+        } else if (dp->d_type == DT_DIR ||
+                   (dp->d_type == DT_UNKNOWN &&
+                    fstatat(fd, dp->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                    S_ISDIR(st.st_mode))) {
+            remove_leftovers(ctx, fd, dp->d_name, now);
+        } else if (is_leftover(fd, dp->d_name, now) &&
+                   unlinkat(fd, dp->d_name, 0) != 0) {
+            cry(create_fake_connection(ctx), "Cannot remove %s: %s",
+                dp->d_name, strerror(ERRNO));
+        }
+    }
+    (void) closedir(dirp);
+}
+
+static void *cleanup_thread(void *param) {
+    struct mg_context *ctx = (struct mg_context *) param;
+
+    remove_leftovers(ctx, AT_FDCWD, ctx->settings.document_root, time(NULL));
+
+    (void) pthread_mutex_lock(&ctx->mutex);
+    ctx->num_threads--;
+    (void) pthread_cond_signal(&ctx->cond);
+    (void) pthread_mutex_unlock(&ctx->mutex);
+
+    DEBUG_TRACE(("exiting"));
+    return NULL;
+}
+
+// Remove, in the background, temporary files of PUTs that were being
+// written when a server stopped.
+void upload_start(struct mg_context *ctx) {
+    if (ctx->settings.document_root == NULL) {
+        return;
+    }
+
+    // Counted first, the thread may be done before mg_start_thread() returns
+    (void) pthread_mutex_lock(&ctx->mutex);
+    ctx->num_threads++;
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    if (mg_start_thread(cleanup_thread, ctx) != 0) {
+        cry(create_fake_connection(ctx), "Cannot start cleanup thread: %ld",
+            (long) ERRNO);
+        (void) pthread_mutex_lock(&ctx->mutex);
+        ctx->num_threads--;
+        (void) pthread_mutex_unlock(&ctx->mutex);
+    }
+}
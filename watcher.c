@@ -0,0 +1,311 @@
+#include "mingoose.h"
+#include <sys/inotify.h>
+
+// inotify-driven invalidation of the in-process caches.
+//
+// The watcher thread keeps an inotify watch on every directory under
+// document_root and forwards each change to the registered listeners.
+// Caches only keep entries for paths whose parent directory is watched,
+// so a cache hit is as fresh as a stat() without making one.
+
+#define MAX_WATCH_LISTENERS 8
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | \
+                    IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_DELETE_SELF | IN_MOVE_SELF)
+
+static struct {
+    int fd;                     // inotify descriptor
+    volatile int active;        // 1 if invalidations are being delivered
+    pthread_rwlock_t lock;      // Protects dirs and dir_set
+    char **dirs;                // Watched directory path, indexed by wd
+    int dirs_size;              // Size of the dirs array
+    char **dir_set;             // Open addressing set of watched paths
+    int dir_set_size;           // Size of dir_set, power of two
+    int num_dirs;               // Number of watched directories
+    mg_watch_listener_t listeners[MAX_WATCH_LISTENERS];
+    int num_listeners;
+} watcher = { -1, 0, PTHREAD_RWLOCK_INITIALIZER, NULL, 0, NULL, 0, 0,
+              { NULL }, 0 };
+
+void mg_watch_add_listener(mg_watch_listener_t listener) {
+    assert(watcher.num_listeners < MAX_WATCH_LISTENERS);
+    watcher.listeners[watcher.num_listeners++] = listener;
+}
+
+int mg_watch_is_active(void) {
+    return watcher.active;
+}
+
+static void notify_listeners(const char *path) {
+    int i;
+
+    for (i = 0; i < watcher.num_listeners; i++) {
+        watcher.listeners[i](path);
+    }
+}
+
+// Stop delivering invalidations. Caches bypass themselves from now on.
+static void deactivate(struct mg_context *ctx, const char *reason) {
+    if (watcher.active) {
+        cry(create_fake_connection(ctx), "file watcher disabled: %s", reason);
+        watcher.active = 0;
+        notify_listeners(NULL);
+    }
+}
+
+// Return dir_set slot for the given path: either the slot holding it,
+// or the empty slot where it should go. Must be called with lock held.
+static int dir_set_slot(const char *path, size_t len) {
+    unsigned int i = mg_hash(path, len) & (watcher.dir_set_size - 1);
+
+    while (watcher.dir_set[i] != NULL &&
+           (strncmp(watcher.dir_set[i], path, len) != 0 ||
+            watcher.dir_set[i][len] != '\0')) {
+        i = (i + 1) & (watcher.dir_set_size - 1);
+    }
+
+    return (int) i;
+}
+
+static int dir_set_grow(void) {
+    char **old = watcher.dir_set;
+    int i, old_size = watcher.dir_set_size;
+
+    watcher.dir_set_size = old_size == 0 ? 256 : old_size * 2;
+    if ((watcher.dir_set = (char **) calloc(watcher.dir_set_size,
+                                            sizeof(char *))) == NULL) {
+        watcher.dir_set = old;
+        watcher.dir_set_size = old_size;
+        return 0;
+    }
+    for (i = 0; i < old_size; i++) {
+        if (old[i] != NULL) {
+            watcher.dir_set[dir_set_slot(old[i], strlen(old[i]))] = old[i];
+        }
+    }
+    free(old);
+
+    return 1;
+}
+
+// Remove path from the open addressing set, re-inserting the rest
+// of its cluster. Must be called with lock held.
+static void dir_set_remove(const char *path) {
+    int i = dir_set_slot(path, strlen(path)), j;
+    char *p;
+
+    if (watcher.dir_set[i] == NULL) {
+        return;
+    }
+    watcher.dir_set[i] = NULL;
+    for (j = (i + 1) & (watcher.dir_set_size - 1); watcher.dir_set[j] != NULL;
+         j = (j + 1) & (watcher.dir_set_size - 1)) {
+        p = watcher.dir_set[j];
+        watcher.dir_set[j] = NULL;
+        watcher.dir_set[dir_set_slot(p, strlen(p))] = p;
+    }
+}
+
+static int remember_dir(int wd, const char *path) {
+    char **p;
+    int size, ok = 1;
+
+    (void) pthread_rwlock_wrlock(&watcher.lock);
+    if (wd >= watcher.dirs_size) {
+        size = watcher.dirs_size == 0 ? 256 : watcher.dirs_size;
+        while (size <= wd) {
+            size *= 2;
+        }
+        if ((p = (char **) realloc(watcher.dirs, size * sizeof(*p))) == NULL) {
+            ok = 0;
+        } else {
+            memset(p + watcher.dirs_size, 0,
+                   (size - watcher.dirs_size) * sizeof(*p));
+            watcher.dirs = p;
+            watcher.dirs_size = size;
+        }
+    }
+    if (ok && (watcher.num_dirs + 1) * 2 > watcher.dir_set_size) {
+        ok = dir_set_grow();
+    }
+    if (ok && watcher.dirs[wd] == NULL) {
+        // inotify returns the same wd when a directory is watched twice
+        if ((watcher.dirs[wd] = mg_strdup(path)) == NULL) {
+            ok = 0;
+        } else {
+            watcher.dir_set[dir_set_slot(path, strlen(path))] = watcher.dirs[wd];
+            watcher.num_dirs++;
+        }
+    }
+    (void) pthread_rwlock_unlock(&watcher.lock);
+
+    return ok;
+}
+
+static void forget_dir(int wd) {
+    (void) pthread_rwlock_wrlock(&watcher.lock);
+    if (wd >= 0 && wd < watcher.dirs_size && watcher.dirs[wd] != NULL) {
+        dir_set_remove(watcher.dirs[wd]);
+        free(watcher.dirs[wd]);
+        watcher.dirs[wd] = NULL;
+        watcher.num_dirs--;
+    }
+    (void) pthread_rwlock_unlock(&watcher.lock);
+}
+
+// Watch the directory and all directories below it.
+// Return 0 if the kernel refused a watch, e.g. max_user_watches is hit.
+static int watch_tree(const char *dir) {
+    char path[PATH_MAX];
+    struct dirent *dp;
+    struct stat st;
+    DIR *dirp;
+    int wd, is_dir, ok = 1;
+
+    if ((wd = inotify_add_watch(watcher.fd, dir, WATCH_MASK | IN_ONLYDIR)) < 0) {
+        // Directory could have been removed already, this is not fatal
+        return errno == ENOENT || errno == ENOTDIR;
+    } else if (!remember_dir(wd, dir) || (dirp = opendir(dir)) == NULL) {
+        return 0;
+    }
+
+    while (ok && (dp = readdir(dirp)) != NULL) {
+        if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..")) {
+            continue;
+        }
+        mg_snprintf(path, sizeof(path), "%s%c%s", dir, '/', dp->d_name);
+        // Symlinked directories are not followed, see mg_watch_covers()
+        if (dp->d_type == DT_UNKNOWN) {
+            is_dir = lstat(path, &st) == 0 && S_ISDIR(st.st_mode);
+        } else {
+            is_dir = dp->d_type == DT_DIR;
+        }
+        if (is_dir) {
+            ok = watch_tree(path);
+        }
+    }
+    (void) closedir(dirp);
+
+    return ok;
+}
+
+static void handle_event(struct mg_context *ctx,
+                         const struct inotify_event *ev) {
+    char path[PATH_MAX];
+    const char *dir;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+        notify_listeners(NULL);
+        return;
+    } else if (ev->mask & IN_IGNORED) {
+        forget_dir(ev->wd);
+        return;
+    }
+
+    // Only the watcher thread modifies dirs[], reading without lock is fine
+    if (ev->wd < 0 || ev->wd >= watcher.dirs_size ||
+        (dir = watcher.dirs[ev->wd]) == NULL) {
+        return;
+    }
+
+    if (ev->len == 0) {
+        // Event on the watched directory itself, e.g. IN_DELETE_SELF
+        notify_listeners(NULL);
+    } else if (ev->mask & IN_ISDIR) {
+        // Directory appeared, vanished or moved: the whole subtree and
+        // anything cached as missing below it is affected. Watch first,
+        // then flush, so that nothing stale survives the flush.
+        mg_snprintf(path, sizeof(path), "%s%c%s", dir, '/', ev->name);
+        if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && !watch_tree(path)) {
+            deactivate(ctx, strerror(ERRNO));
+        }
+        notify_listeners(NULL);
+    } else {
+        mg_snprintf(path, sizeof(path), "%s%c%s", dir, '/', ev->name);
+        notify_listeners(path);
+        notify_listeners(dir);
+    }
+}
+
+static void *watcher_thread(void *param) {
+    struct mg_context *ctx = (struct mg_context *) param;
+    char buf[MG_BUF_LEN] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    struct pollfd pfd;
+    ssize_t n;
+    char *p;
+
+    pfd.fd = watcher.fd;
+    pfd.events = POLLIN;
+
+    while (ctx->stop_flag == 0 && watcher.active) {
+        if (poll(&pfd, 1, 200) <= 0 || (n = read(watcher.fd, buf, sizeof(buf))) <= 0) {
+            continue;
+        }
+        for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *) p;
+            handle_event(ctx, ev);
+        }
+    }
+
+    watcher.active = 0;
+    close(watcher.fd);
+
+    // Signal master that we're done, same as worker threads do
+    (void) pthread_mutex_lock(&ctx->mutex);
+    ctx->num_threads--;
+    (void) pthread_cond_signal(&ctx->cond);
+    (void) pthread_mutex_unlock(&ctx->mutex);
+
+    DEBUG_TRACE(("exiting"));
+    return NULL;
+}
+
+// Return 1 if invalidations for the given path are delivered, i.e. the
+// path itself or the directory that holds it is watched.
+int mg_watch_covers(const char *path, size_t len) {
+    const char *slash = path + len;
+    int covered = 0;
+
+    while (slash > path && slash[-1] != '/') {
+        slash--;
+    }
+
+    if (watcher.active && slash > path) {
+        (void) pthread_rwlock_rdlock(&watcher.lock);
+        covered = watcher.dir_set_size > 0 &&
+            (watcher.dir_set[dir_set_slot(path, len)] != NULL ||
+             watcher.dir_set[dir_set_slot(path, slash - path - 1)] != NULL);
+        (void) pthread_rwlock_unlock(&watcher.lock);
+    }
+
+    return covered;
+}
+
+// Start watching document_root. Return 1 on success. On failure the
+// server keeps running, with caches bypassed.
+int mg_watch_start(struct mg_context *ctx) {
+    const char *root = ctx->settings.document_root;
+
+    if (root == NULL) {
+        return 0;
+    } else if ((watcher.fd = inotify_init1(IN_CLOEXEC)) < 0) {
+        cry(create_fake_connection(ctx), "inotify_init: %s", strerror(ERRNO));
+        return 0;
+    } else if (!watch_tree(root)) {
+        cry(create_fake_connection(ctx), "cannot watch %s: %s",
+            root, strerror(ERRNO));
+        close(watcher.fd);
+        return 0;
+    }
+
+    watcher.active = 1;
+    if (mg_start_thread(watcher_thread, ctx) != 0) {
+        watcher.active = 0;
+        close(watcher.fd);
+        return 0;
+    }
+    ctx->num_threads++;
+
+    return 1;
+}